@@ -0,0 +1,89 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the MIT License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// codec.cpp - Hex and EBCDIC codec throughput, dispatched kernels against the scalar reference
+//
+// Usage: codec [milliseconds per run]
+// Prints CSV: op,kernel,bytes,mb_per_sec
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <boost/chrono.hpp>
+/// [StorageAPI]
+#include <storage/StorageCodec.hpp>
+
+using namespace Storage;
+
+typedef boost::chrono::steady_clock Clock;
+
+/** Run op until the time is up; MB/s of input processed */
+template <class Op>
+static double measure(int millis, size_t bytes, Op op) {
+    Clock::time_point start=Clock::now();
+    Clock::time_point until=start + boost::chrono::milliseconds(millis);
+    uint64_t runs=0;
+    while(Clock::now() < until) {
+        for(int n=0; n<64; n++) {
+            op();
+        }
+        runs+=64;
+    }
+    double seconds=boost::chrono::duration<double>(Clock::now() - start).count();
+    return (double)runs * bytes / seconds / 1e6;
+}
+
+int main(int argc, char const *argv[]) {
+    int millis=(argc > 1)?std::atoi(argv[1]):200;
+    const char* kernel=CodecKernels::instance().name;
+    static const size_t sizes[]={8, 64, 1024, 65536};
+    std::printf("op,kernel,bytes,mb_per_sec\n");
+    for(size_t s=0; s<sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t bytes=sizes[s];
+        std::vector<uint8_t> raw(bytes), decoded(bytes), translated(bytes);
+        uint64_t x=88172645463325252ull;
+        for(size_t n=0; n<bytes; n++) {
+            x^=x << 13; x^=x >> 7; x^=x << 17;
+            raw[n]=(uint8_t)x;
+        }
+        std::string hex(2 * bytes, '\0');
+        fastcache_hex_encode_scalar(raw.data(), bytes, &hex[0]);
+
+        // Check the dispatched kernels against the reference before timing them
+        std::string check(2 * bytes, '\0');
+        fastcache_hex_encode(raw.data(), bytes, &check[0]);
+        if(check!=hex || !fastcache_hex_decode(hex.data(), hex.size(), decoded.data()) || decoded!=raw) {
+            std::fprintf(stderr, "hex kernel mismatch at %zu bytes\n", bytes);
+            return 1;
+        }
+        std::vector<uint8_t> reference(bytes);
+        fastcache_translate_scalar(CodePage::ebcdic_to_ascii(), raw.data(), bytes, reference.data());
+        fastcache_ebcdic_to_ascii(raw.data(), bytes, translated.data());
+        if(translated!=reference) {
+            std::fprintf(stderr, "translation kernel mismatch at %zu bytes\n", bytes);
+            return 1;
+        }
+
+        std::printf("hex_decode,scalar,%zu,%.1f\n", bytes, measure(millis, hex.size(), [&]() {
+            fastcache_hex_decode_scalar(hex.data(), hex.size(), decoded.data());
+        }));
+        std::printf("hex_decode,%s,%zu,%.1f\n", kernel, bytes, measure(millis, hex.size(), [&]() {
+            fastcache_hex_decode(hex.data(), hex.size(), decoded.data());
+        }));
+        std::printf("hex_encode,scalar,%zu,%.1f\n", bytes, measure(millis, bytes, [&]() {
+            fastcache_hex_encode_scalar(raw.data(), bytes, &check[0]);
+        }));
+        std::printf("hex_encode,%s,%zu,%.1f\n", kernel, bytes, measure(millis, bytes, [&]() {
+            fastcache_hex_encode(raw.data(), bytes, &check[0]);
+        }));
+        std::printf("ebcdic_to_ascii,scalar,%zu,%.1f\n", bytes, measure(millis, bytes, [&]() {
+            fastcache_translate_scalar(CodePage::ebcdic_to_ascii(), raw.data(), bytes, translated.data());
+        }));
+        std::printf("ebcdic_to_ascii,%s,%zu,%.1f\n", kernel, bytes, measure(millis, bytes, [&]() {
+            fastcache_ebcdic_to_ascii(raw.data(), bytes, translated.data());
+        }));
+    }
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the MIT License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// get_scaling.cpp - StorageCache::get throughput per read mode, 1 to 64 threads
+//
+// Usage: get_scaling [milliseconds per run] [keys]
+// Prints CSV: mode,keys,threads,gets_per_sec
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <boost/thread.hpp>
+#include <boost/chrono.hpp>
+/// [StorageAPI]
+#include <storage/Storage.hpp>
+
+using namespace Storage;
+
+static const char* mode_name(fastcache_readmode mode) {
+    switch(mode) {
+        case FASTCACHE_READMODE_EXCLUSIVE: return "exclusive";
+        case FASTCACHE_READMODE_SHARED: return "shared";
+        default: return "optimistic";
+    }
+}
+
+struct Reader {
+    StorageCache<std::string, StorageItem>* cache;
+    const std::vector<std::string>* keys;
+    std::atomic<bool>* go;
+    std::atomic<bool>* stop;
+    uint64_t seed;
+    uint64_t gets;
+
+    void operator()() {
+        uint64_t x=this->seed;
+        uint64_t n=0;
+        while(!this->go->load(std::memory_order_acquire)) {
+        }
+        while(!this->stop->load(std::memory_order_relaxed)) {
+            // xorshift64
+            x^=x << 13; x^=x >> 7; x^=x << 17;
+            shared_ptr<StorageItem> item=this->cache->get((*this->keys)[x % this->keys->size()]);
+            if(!item) {
+                std::abort();
+            }
+            ++n;
+        }
+        this->gets=n;
+    }
+};
+
+static double run(StorageCache<std::string, StorageItem>& cache, const std::vector<std::string>& keys, unsigned threads, unsigned millis) {
+    std::atomic<bool> go(false);
+    std::atomic<bool> stop(false);
+    std::vector<Reader> readers(threads);
+    boost::thread_group group;
+    for(unsigned n=0; n<threads; n++) {
+        Reader reader={&cache, &keys, &go, &stop, 0x9E3779B97F4A7C15ull * (n + 1), 0};
+        readers[n]=reader;
+        group.create_thread(boost::ref(readers[n]));
+    }
+    boost::chrono::steady_clock::time_point start=boost::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(millis));
+    stop.store(true, std::memory_order_relaxed);
+    group.join_all();
+    double seconds=boost::chrono::duration<double>(boost::chrono::steady_clock::now() - start).count();
+    uint64_t total=0;
+    for(unsigned n=0; n<threads; n++) {
+        total+=readers[n].gets;
+    }
+    return total / seconds;
+}
+
+int main(int argc, char const *argv[]) {
+    unsigned millis=(argc > 1)?(unsigned)std::atoi(argv[1]):1000u;
+    long key_arg=(argc > 2)?std::atol(argv[2]):100000l;
+    if(key_arg <= 0) {
+        std::fprintf(stderr, "keys must be above 0\n");
+        return 1;
+    }
+    size_t key_count=(size_t)key_arg;
+    const fastcache_readmode modes[]={FASTCACHE_READMODE_EXCLUSIVE, FASTCACHE_READMODE_SHARED, FASTCACHE_READMODE_OPTIMISTIC};
+    // All keys, and a handful of hot keys that pile onto few shards
+    const size_t key_sets[]={key_count, std::min<size_t>(8u, key_count)};
+
+    printf("mode,keys,threads,gets_per_sec\n");
+    for(size_t m=0; m<sizeof(modes) / sizeof(modes[0]); m++) {
+        StorageCache<std::string, StorageItem> cache(modes[m]);
+        std::vector<std::string> keys;
+        for(size_t n=0; n<key_count; n++) {
+            shared_ptr<StorageItem> item(new StorageItem());
+            item->fldno=(int)(n % 128);
+            item->set_descriptor("A packager name");
+            item->set_value("F0F1F0F0");
+            keys.push_back(std::to_string(n % 128) + "." + std::to_string(n / 128));
+            cache.set(keys.back(), item);
+        }
+        for(size_t k=0; k<sizeof(key_sets) / sizeof(key_sets[0]); k++) {
+            std::vector<std::string> subset(keys.begin(), keys.begin() + key_sets[k]);
+            for(unsigned threads=1; threads<=64; threads*=2) {
+                printf("%s,%zu,%u,%.0f\n", mode_name(modes[m]), subset.size(), threads, run(cache, subset, threads, millis));
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,365 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the MIT License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// ycsb.cpp - StorageCache under YCSB-style workload mixes
+//
+// Usage: ycsb [--option=value ...]; list options take comma separated values and every combination is run
+//   --workload=a,b,c,e,f      a: 50% read 50% update, b: 95% read 5% update, c: read only,
+//                             e: 95% scan 5% insert, f: 50% read 50% read-modify-write
+//   --distribution=uniform,zipfian   key popularity (zipfian: theta 0.99, hot keys scattered)
+//   --threads=1,2,4,8
+//   --shards=256              rounded up to a power of two; the CSV shows the shard count used
+//   --key-size=16             bytes (e: path keys "<group>.<item>...", at most 23 bytes)
+//   --value-size=100          bytes
+//   --ttl-ratio=0             share of writes with an expiration (--ttl seconds out)
+//   --ttl=60
+//   --records=100000          loaded before each run, at least 2 for zipfian
+//   --scan-length=100         keys per scan (e), i.e. per path group
+//   --millis=1000             per run
+// Prints CSV, one line per run: parameters, throughput and p50/p99/p999 per operation kind in ns
+// (reads: get, writes: update/insert/read-modify-write, scans: prefix_scan + multi_get)
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <boost/thread.hpp>
+/// [StorageAPI]
+#include <storage/StorageCache.hpp>
+
+using namespace Storage;
+
+typedef std::chrono::steady_clock Clock;
+
+/** Options as given, --name=value */
+struct Options {
+    std::map<std::string, std::string> values;
+
+    std::string get(const std::string& name, const std::string& fallback) const {
+        std::map<std::string, std::string>::const_iterator it=this->values.find(name);
+        return (it==this->values.end())?fallback:it->second;
+    }
+    std::vector<std::string> list(const std::string& name, const std::string& fallback) const {
+        std::vector<std::string> items;
+        std::string text=this->get(name, fallback);
+        for(size_t start=0, end; start<=text.size(); start=end + 1) {
+            end=text.find(',', start);
+            if(end==std::string::npos) {
+                end=text.size();
+            }
+            if(end > start) {
+                items.push_back(text.substr(start, end - start));
+            }
+        }
+        return items;
+    }
+};
+
+/** splitmix64, one per thread */
+struct Random {
+    uint64_t state;
+
+    uint64_t next() {
+        uint64_t z=(this->state+=0x9E3779B97F4A7C15ull);
+        z=(z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z=(z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    double unit() {
+        return (this->next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+/**
+ * Key popularity: uniform, or zipfian (Gray et al., as YCSB) with the ranks scattered over the key
+ * space by a hash, so the hot keys don't sit next to each other.
+ */
+class KeyChooser {
+    public:
+        KeyChooser(uint64_t items, bool zipfian, double theta=0.99) : items(items), zipfian(zipfian), theta(theta) {
+            if(zipfian) {
+                double zeta2=0.0;
+                this->zetan=0.0;
+                for(uint64_t n=1; n<=items; n++) {
+                    this->zetan+=1.0 / std::pow((double)n, theta);
+                    if(n==2) {
+                        zeta2=this->zetan;
+                    }
+                }
+                this->alpha=1.0 / (1.0 - theta);
+                this->eta=(1.0 - std::pow(2.0 / items, 1.0 - theta)) / (1.0 - zeta2 / this->zetan);
+            }
+        }
+        uint64_t next(Random& random) const {
+            if(!this->zipfian) {
+                return random.next() % this->items;
+            }
+            double u=random.unit();
+            double uz=u * this->zetan;
+            uint64_t rank;
+            if(uz < 1.0) {
+                rank=0;
+            } else if(uz < 1.0 + std::pow(0.5, this->theta)) {
+                rank=1;
+            } else {
+                rank=(uint64_t)(this->items * std::pow(this->eta * u - this->eta + 1.0, this->alpha));
+            }
+            // FNV-1a of the rank
+            uint64_t hash=14695981039346656037ull;
+            for(int n=0; n<8; n++) {
+                hash=(hash ^ ((rank >> (8 * n)) & 0xFF)) * 1099511628211ull;
+            }
+            return hash % this->items;
+        }
+
+    private:
+        uint64_t items;
+        bool zipfian;
+        double theta;
+        double zetan;
+        double alpha;
+        double eta;
+};
+
+/** Workload mix, in percent */
+struct Mix {
+    char name;
+    unsigned int read;
+    unsigned int update;
+    unsigned int insert;
+    unsigned int scan;
+    unsigned int rmw;
+};
+static const Mix MIXES[]={
+    {'a', 50, 50, 0, 0, 0},
+    {'b', 95, 5, 0, 0, 0},
+    {'c', 100, 0, 0, 0, 0},
+    {'e', 0, 0, 5, 95, 0},
+    {'f', 50, 0, 0, 0, 50},
+};
+
+/** One run's settings */
+struct Run {
+    const Mix* mix;
+    bool zipfian;
+    unsigned int threads;
+    size_t shards;
+    size_t key_size;
+    size_t value_size;
+    double ttl_ratio;
+    time_t ttl;
+    uint64_t records;
+    uint64_t scan_length;
+    unsigned int millis;
+};
+
+/** Key of record n: "user" and the number, zero padded; path "<group>.<item>" for scans */
+static std::string make_key(const Run& run, uint64_t n) {
+    if(run.mix->scan) {
+        std::string key=std::to_string(n / run.scan_length) + "." + std::to_string(n % run.scan_length);
+        // Pad with zero components (depth 4, 5 digits at most)
+        for(size_t components=2; components<4 && key.size() + 2<=run.key_size; components++) {
+            key+="." + std::string(std::min<size_t>(5, run.key_size - key.size() - 1), '0');
+        }
+        return key;
+    }
+    std::string digits=std::to_string(n);
+    size_t width=(run.key_size > 4)?run.key_size - 4:0;
+    return "user" + ((digits.size() < width)?std::string(width - digits.size(), '0'):std::string()) + digits;
+}
+
+/** Latencies of one run, by operation kind */
+struct Latencies {
+    LatencyHistogram reads;
+    LatencyHistogram writes;
+    LatencyHistogram scans;
+};
+
+template <class Cache>
+struct Worker {
+    Cache* cache;
+    const Run* run;
+    const KeyChooser* chooser;
+    Latencies* latencies;
+    std::atomic<uint64_t>* inserted;
+    std::atomic<bool>* go;
+    std::atomic<bool>* stop;
+    uint64_t seed;
+    uint64_t ops;
+
+    void operator()() {
+        Random random={this->seed};
+        const std::string value(this->run->value_size, 'v');
+        uint64_t done=0;
+        while(!this->go->load(std::memory_order_acquire)) {
+        }
+        while(!this->stop->load(std::memory_order_relaxed)) {
+            unsigned int dice=(unsigned int)(random.next() % 100);
+            const Mix& mix=*this->run->mix;
+            Clock::time_point start=Clock::now();
+            LatencyHistogram* kind;
+            if(dice < mix.read) {
+                this->cache->get(make_key(*this->run, this->chooser->next(random)));
+                kind=&this->latencies->reads;
+            } else if(dice < mix.read + mix.update) {
+                this->write(make_key(*this->run, this->chooser->next(random)), value, random);
+                kind=&this->latencies->writes;
+            } else if(dice < mix.read + mix.update + mix.insert) {
+                this->write(make_key(*this->run, this->inserted->fetch_add(1, std::memory_order_relaxed)), value, random);
+                kind=&this->latencies->writes;
+            } else if(dice < mix.read + mix.update + mix.insert + mix.scan) {
+                this->scan(this->chooser->next(random) / this->run->scan_length);
+                kind=&this->latencies->scans;
+            } else {
+                // Read-modify-write
+                std::string key=make_key(*this->run, this->chooser->next(random));
+                shared_ptr<std::string> old=this->cache->get(key);
+                this->write(key, old?*old:value, random);
+                kind=&this->latencies->writes;
+            }
+            kind->record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+            ++done;
+        }
+        this->ops=done;
+    }
+    void write(const std::string& key, const std::string& value, Random& random) {
+        time_t expiration=(random.unit() < this->run->ttl_ratio)?std::time(NULL) + this->run->ttl:0;
+        this->cache->set(key, boost::make_shared<std::string>(value), expiration);
+    }
+    void scan(uint64_t group) {
+        scan_group(*this->cache, group);
+    }
+    static void scan_group(StorageCache<std::string, std::string, FlatStore, PathKeyIndex>& cache, uint64_t group) {
+        cache.multi_get(cache.prefix_scan(std::to_string(group)));
+    }
+    static void scan_group(StorageCache<std::string, std::string>&, uint64_t) {
+    }
+};
+
+template <class Cache>
+static void measure(const Run& run) {
+    Cache cache(FASTCACHE_READMODE_OPTIMISTIC, run.shards);
+    {
+        Random random={42};
+        const std::string value(run.value_size, 'v');
+        for(uint64_t n=0; n<run.records; n++) {
+            time_t expiration=(random.unit() < run.ttl_ratio)?std::time(NULL) + run.ttl:0;
+            cache.set(make_key(run, n), boost::make_shared<std::string>(value), expiration);
+        }
+    }
+    KeyChooser chooser(run.records, run.zipfian);
+    std::unique_ptr<Latencies> latencies(new Latencies());
+    std::atomic<uint64_t> inserted(run.records);
+    std::atomic<bool> go(false);
+    std::atomic<bool> stop(false);
+    std::vector<Worker<Cache> > workers(run.threads);
+    boost::thread_group group;
+    for(unsigned int n=0; n<run.threads; n++) {
+        Worker<Cache> worker={&cache, &run, &chooser, latencies.get(), &inserted, &go, &stop, 0x9E3779B97F4A7C15ull * (n + 1), 0};
+        workers[n]=worker;
+        group.create_thread(boost::ref(workers[n]));
+    }
+    Clock::time_point start=Clock::now();
+    go.store(true, std::memory_order_release);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(run.millis));
+    stop.store(true, std::memory_order_relaxed);
+    group.join_all();
+    double seconds=std::chrono::duration<double>(Clock::now() - start).count();
+    uint64_t ops=0;
+    for(unsigned int n=0; n<run.threads; n++) {
+        ops+=workers[n].ops;
+    }
+    StorageLatency reads=latencies->reads.summary();
+    StorageLatency writes=latencies->writes.summary();
+    StorageLatency scans=latencies->scans.summary();
+    std::printf("%c,%s,%u,%zu,%llu,%zu,%zu,%.2f,%llu,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                run.mix->name, run.zipfian?"zipfian":"uniform", run.threads, cache.shard_count(), (unsigned long long)run.records,
+                run.key_size, run.value_size, run.ttl_ratio, (unsigned long long)ops, ops / seconds,
+                (unsigned long long)reads.p50, (unsigned long long)reads.p99, (unsigned long long)reads.p999,
+                (unsigned long long)writes.p50, (unsigned long long)writes.p99, (unsigned long long)writes.p999,
+                (unsigned long long)scans.p50, (unsigned long long)scans.p99, (unsigned long long)scans.p999);
+    std::fflush(stdout);
+}
+
+int main(int argc, char const *argv[]) {
+    Options options;
+    for(int n=1; n<argc; n++) {
+        const char* arg=argv[n];
+        const char* equals=std::strchr(arg, '=');
+        if(std::strncmp(arg, "--", 2)!=0 || !equals) {
+            std::fprintf(stderr, "Unknown argument %s, options are --name=value (see ycsb.cpp)\n", arg);
+            return 1;
+        }
+        options.values[std::string(arg + 2, equals)]=equals + 1;
+    }
+    Run run;
+    run.ttl=(time_t)std::atol(options.get("ttl", "60").c_str());
+    run.records=(uint64_t)std::atoll(options.get("records", "100000").c_str());
+    run.scan_length=(uint64_t)std::atoll(options.get("scan-length", "100").c_str());
+    run.millis=(unsigned int)std::atoi(options.get("millis", "1000").c_str());
+    if(run.records==0 || run.scan_length==0 || run.records / run.scan_length >= 0xFFFF) {
+        std::fprintf(stderr, "--records must be above 0 and below 65535 * --scan-length\n");
+        return 1;
+    }
+
+    std::vector<std::string> workloads=options.list("workload", "a,b,c,e,f");
+    std::vector<const Mix*> mixes;
+    for(size_t w=0; w<workloads.size(); w++) {
+        const Mix* mix=NULL;
+        for(size_t m=0; m<sizeof(MIXES) / sizeof(MIXES[0]); m++) {
+            if(workloads[w].size()==1 && MIXES[m].name==workloads[w][0]) {
+                mix=&MIXES[m];
+            }
+        }
+        if(!mix) {
+            std::fprintf(stderr, "Unknown workload %s\n", workloads[w].c_str());
+            return 1;
+        }
+        mixes.push_back(mix);
+    }
+    std::vector<std::string> distributions=options.list("distribution", "uniform,zipfian");
+    for(size_t d=0; d<distributions.size(); d++) {
+        // KeyChooser's zipfian constants need zeta(2), i.e. two records
+        if(distributions[d]=="zipfian" && run.records < 2) {
+            std::fprintf(stderr, "--distribution=zipfian needs --records of at least 2\n");
+            return 1;
+        }
+    }
+    std::vector<std::string> threads=options.list("threads", "1,2,4,8");
+    std::vector<std::string> shards=options.list("shards", "256");
+    std::vector<std::string> key_sizes=options.list("key-size", "16");
+    std::vector<std::string> value_sizes=options.list("value-size", "100");
+    std::vector<std::string> ttl_ratios=options.list("ttl-ratio", "0");
+    std::printf("workload,distribution,threads,shards,records,key_size,value_size,ttl_ratio,ops,ops_per_sec,"
+                "read_p50_ns,read_p99_ns,read_p999_ns,write_p50_ns,write_p99_ns,write_p999_ns,scan_p50_ns,scan_p99_ns,scan_p999_ns\n");
+    for(size_t w=0; w<mixes.size(); w++) {
+        run.mix=mixes[w];
+        for(size_t d=0; d<distributions.size(); d++)
+        for(size_t t=0; t<threads.size(); t++)
+        for(size_t s=0; s<shards.size(); s++)
+        for(size_t k=0; k<key_sizes.size(); k++)
+        for(size_t v=0; v<value_sizes.size(); v++)
+        for(size_t r=0; r<ttl_ratios.size(); r++) {
+            run.zipfian=(distributions[d]=="zipfian");
+            run.threads=(unsigned int)std::atoi(threads[t].c_str());
+            run.shards=(size_t)std::atol(shards[s].c_str());
+            run.key_size=(size_t)std::atol(key_sizes[k].c_str());
+            run.value_size=(size_t)std::atol(value_sizes[v].c_str());
+            run.ttl_ratio=std::atof(ttl_ratios[r].c_str());
+            if(run.mix->scan) {
+                // Scans go by field path, which needs the path index
+                measure<StorageCache<std::string, std::string, FlatStore, PathKeyIndex> >(run);
+            } else {
+                measure<StorageCache<std::string, std::string> >(run);
+            }
+        }
+    }
+    return 0;
+}
@@ -11,89 +11,56 @@
 
 using namespace Storage;
 
-std::vector<std::string> explode(const std::string& str, const char& ch) {
-    std::string next;
-    std::vector<std::string> result;
-
-    // For each character in the string
-    for (std::string::const_iterator it = str.begin(); it != str.end(); it++) {
-        // If we've hit the terminal character
-        if (*it == ch) {
-            // If we have some characters accumulated
-            if (!next.empty()) {
-                // Add them to the result vector
-                result.push_back(next);
-                next.clear();
-            }
-        } else {
-            // Accumulate the next character into the sequence
-            next += *it;
-        }
-    }
-    if (!next.empty())
-         result.push_back(next);
-    return result;
-}
-
 int main(int argc, char const *argv[]) {
     /// [BEGIN] -> Storage
-    // Make data for cache
-    shared_ptr<StorageItem>fld3_1=shared_ptr<StorageItem>(new StorageItem());
-    fld3_1->fldno=1;
-    fld3_1->descriptor="A packager name";
-    fld3_1->value="F0F0";
-    shared_ptr<StorageItem>fld3_2=shared_ptr<StorageItem>(new StorageItem());
-    fld3_2->fldno=2;
-    fld3_2->descriptor="A packager name";
-    fld3_2->value="F0F0";
-    shared_ptr<StorageItem>fld3_3=shared_ptr<StorageItem>(new StorageItem());
-    fld3_3->fldno=3;
-    fld3_3->descriptor="A packager name";
-    fld3_3->value="F0F0";
-    shared_ptr<StorageItem>fld4=shared_ptr<StorageItem>(new StorageItem());
-    fld4->fldno=4;
-    fld4->descriptor="A packager name";
-    fld4->value="F0F0F0F0F0F0";
-    shared_ptr<StorageItem>fld5=shared_ptr<StorageItem>(new StorageItem());
-    fld5->fldno=5;
-    fld5->descriptor="A packager name";
-    fld5->value="F0F1F0F0";
+    // Create cache as string->StorageItem store.  Add data, built in place
+    StorageManager::INSTANCE()->cache.emplace("3.1", 1, "A packager name", "F0F0");
+    StorageManager::INSTANCE()->cache.emplace("3.2", 2, "A packager name", "F0F0");
+    StorageManager::INSTANCE()->cache.emplace("3.3", 3, "A packager name", "F0F0");
+    StorageManager::INSTANCE()->cache.emplace("4", 4, "A packager name", "F0F0F0F0F0F0");
+    StorageManager::INSTANCE()->cache.emplace("5", 5, "A packager name", "F0F1F0F0");
+    // Values made elsewhere can still be handed over
     shared_ptr<StorageItem>fld48_61_3=shared_ptr<StorageItem>(new StorageItem());
     fld48_61_3->fldno=3;
-    fld48_61_3->descriptor="A packager name";
-    fld48_61_3->value="F0F1F0F0";
-    // Create cache as string->StorageItem store.  Add data
-    StorageManager::INSTANCE()->cache.set("3.1",fld3_1);
-    StorageManager::INSTANCE()->cache.set("3.2",fld3_2);
-    StorageManager::INSTANCE()->cache.set("3.3",fld3_3);
-    StorageManager::INSTANCE()->cache.set("4",fld4);
-    StorageManager::INSTANCE()->cache.set("5",fld5);
+    fld48_61_3->set_descriptor("A packager name");
+    fld48_61_3->set_value("F0F1F0F0");
     StorageManager::INSTANCE()->cache.set("48.61.3",fld48_61_3);
     // Fetch back
     boost::shared_ptr<StorageItem>out=StorageManager::INSTANCE()->cache.get("3.1");
-    printf("%d:%s    %s\n",out->fldno,out->descriptor.c_str(),out->value.c_str());
+    printf("%d:%s    %s\n",out->fldno,out->descriptor().c_str(),out->value().c_str());
     /// [END] -> Storage
     /// [BEGIN] -> Storage - KeySet
-    std::vector<std::string> keys = StorageManager::INSTANCE()->cache.keySet();
-    struct {
-        bool operator()(std::string lhs, std::string rhs) {
-            std::vector<std::string> lhsArr = explode(lhs, '.');
-            std::vector<std::string> rhsArr = explode(rhs, '.');
-
-            if (std::atoi(lhsArr[0].c_str()) == std::atoi(rhsArr[0].c_str())) {
-                if (std::atoi(lhsArr[1].c_str()) == std::atoi(rhsArr[1].c_str())) {
-                    if (std::atoi(lhsArr[2].c_str()) == std::atoi(rhsArr[2].c_str()))
-                        return std::atoi(lhsArr[3].c_str()) < std::atoi(rhsArr[3].c_str());
-                    return std::atoi(lhsArr[2].c_str()) < std::atoi(rhsArr[2].c_str());
-                }
-                return std::atoi(lhsArr[1].c_str()) < std::atoi(rhsArr[1].c_str());
-            }
-            return std::atoi(lhsArr[0].c_str()) < std::atoi(rhsArr[0].c_str());
-        }
-    } atoiComp;
-    std::sort(keys.begin(), keys.end(), atoiComp);
+    // Keys come back in field order from the path index, no sorting needed
+    std::vector<std::string> keys = StorageManager::INSTANCE()->cache.sorted_keys();
     for (std::string key : keys)
         printf("[Key] %s\n", key.c_str());
+    // Everything below field 48.61
+    for (std::string key : StorageManager::INSTANCE()->cache.prefix_scan("48.61"))
+        printf("[48.61] %s\n", key.c_str());
     /// [END] -> Storage - KeySet
+    /// [BEGIN] -> Storage - Snapshot
+    // Save for the next start; load_snapshot() on startup maps the file, values are decoded on first use
+    StorageManager::INSTANCE()->cache.save_snapshot("storage.snap");
+    StorageManager::INSTANCE()->cache.clear();
+    size_t loaded = StorageManager::INSTANCE()->cache.load_snapshot("storage.snap");
+    printf("[Snapshot] %zu entries, 48.61.3=%s\n", loaded, StorageManager::INSTANCE()->cache.get("48.61.3")->value().c_str());
+    /// [END] -> Storage - Snapshot
+    /// [BEGIN] -> Storage - Ingest
+    // Parse whole messages instead: field 3 is three 2 byte subfields, stored as "3.1" ... "3.3"
+    StorageLayout processing(false);
+    processing.field(1, "A packager name", FASTCACHE_FIELD_FIXED, 2)
+              .field(2, "A packager name", FASTCACHE_FIELD_FIXED, 2)
+              .field(3, "A packager name", FASTCACHE_FIELD_FIXED, 2);
+    StorageLayout layout;
+    layout.field(0, "Message type", FASTCACHE_FIELD_FIXED, 4)
+          .field(3, "A packager name", FASTCACHE_FIELD_FIXED, 6, processing)
+          .field(4, "A packager name", FASTCACHE_FIELD_LLVAR, 12);
+    // MTI "0100", bitmap with fields 3 and 4, field 3, field 4 with its length "06"
+    const uint8_t message[]={0xF0, 0xF1, 0xF0, 0xF0, 0x30, 0, 0, 0, 0, 0, 0, 0,
+                             0xF0, 0xF0, 0xF0, 0xF1, 0xF0, 0xF2, 0xF0, 0xF6, 0xF0, 0xF0, 0xF1, 0xF2, 0xF3, 0xF4};
+    StorageIngest<decltype(StorageManager::INSTANCE()->cache)> ingest(StorageManager::INSTANCE()->cache, layout);
+    size_t fields = ingest.message(message, sizeof(message));
+    printf("[Ingest] %zu fields, 3.3=%s\n", fields, StorageManager::INSTANCE()->cache.get("3.3")->value().c_str());
+    /// [END] -> Storage - Ingest
     return 0;
 }
\ No newline at end of file
@@ -7,6 +7,8 @@
 #define _STORAGEAPI_MAIN_H_
 #include "StorageManager.hpp"   // <-- StorageManager
 #include "StorageItem.hpp"      // <-- StorageItem
+#include "StorageDense.hpp"     // <-- DenseStore
+#include "StorageMessage.hpp"   // <-- StorageLayout, StorageIngest
 namespace Storage {
 
 };
@@ -7,63 +7,79 @@
 #define _STORAGEAPI_STORAGECACHE_H_
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/make_shared.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/detail/atomic_count.hpp>
 #include <vector>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
 #include <exception>
-//#include <iterator>
-#include <map>
+#include <new>
+#include <iterator>
 #include <iostream>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include "StorageClock.hpp"
+#include "StorageEpoch.hpp"
+#include "StorageEviction.hpp"
+#include "StorageExpiry.hpp"
+#include "StorageFilter.hpp"
+#include "StorageIndex.hpp"
+#include "StorageJournal.hpp"
+#include "StorageSerializer.hpp"
+#include "StorageSnapshot.hpp"
+#include "StorageStats.hpp"
+#include "StorageTasks.hpp"
+#include "StorageTable.hpp"
 //#include <utility>
-/** >>--- OS macros ---<<
- * Linux and Linux-derived           __linux__
- * Android                           __ANDROID__ (implies __linux__)
- * Linux (non-Android)               __linux__ && !__ANDROID__
- * Darwin (Mac OS X and iOS)         __APPLE__
- * Akaros (http://akaros.org)        __ros__
- * Windows                           _WIN32
- * Windows 64 bit                    _WIN64 (implies _WIN32)
- * NaCL                              __native_client__
- * AsmJS                             __asmjs__
- * Fuschia                           __Fuchsia__
- */
-/** >>--- Compiler macros ---<<
- * Visual Studio       _MSC_VER
- * gcc                 __GNUC__
- * clang               __clang__
- * emscripten          __EMSCRIPTEN__ (for asm.js and webassembly)
- * MinGW 32            __MINGW32__
- * MinGW-w64 32bit     __MINGW32__
- * MinGW-w64 64bit     __MINGW64__
- */
-#if defined(__MINGW32__)
-    #include <pthread_time.h>
-#elif defined(__GNUC__ && (__linux__ && !__ANDROID__))
-    #include <time.h>
-#elif defined(_MSC_VER && _WIN64)
-    #include <windows.h>
-    struct timespec { long tv_sec; long tv_nsec; };
-    int clock_gettime(int, struct timespec *spec) {
-        __int64 wintime; GetSystemTimeAsFileTime((FILETIME*)&wintime);
-        wintime      -=116444736000000000i64;  //1jan1601 to 1jan1970
-        spec->tv_sec  =wintime / 10000000i64;           //seconds
-        spec->tv_nsec =wintime % 10000000i64 *100;      //nano-seconds
-        return 0;
-    }
-#else
-    #include <time.h>
-#endif
 
 /// [Definitions]
 // Shard size.  This should be much larger than the number of threads likely to access the cache at any one time.
+// Default only, see StorageCache(); rounded up to a power of two.
 #ifndef FASTCACHE_SHARDSIZE
 #define FASTCACHE_SHARDSIZE 256u
 #endif
 
+// Shard alignment: one cache line, so shards (and their counter blocks) don't share one.  Raise it to 128 on
+// CPUs whose adjacent-line prefetcher fetches lines in pairs (Intel), at the cost of more padding per shard.
+#ifndef FASTCACHE_SHARD_ALIGN
+#define FASTCACHE_SHARD_ALIGN 64u
+#endif
+
+// The curator only visits due items, so it can afford to wake up often
 #ifndef FASTCACHE_CURATOR_SLEEP_MS
-#define FASTCACHE_CURATOR_SLEEP_MS 30000u
+#define FASTCACHE_CURATOR_SLEEP_MS 1000u
+#endif
+
+// Expired items the curator removes per shard lock acquisition
+#ifndef FASTCACHE_CURATOR_BATCH
+#define FASTCACHE_CURATOR_BATCH 256u
+#endif
+
+// Entries a Cursor visits per shard lock acquisition
+#ifndef FASTCACHE_CURSOR_BATCH
+#define FASTCACHE_CURSOR_BATCH 1024u
+#endif
+
+// Optimistic lookups retried against a busy shard before falling back to its shared lock
+#ifndef FASTCACHE_OPTIMISTIC_RETRIES
+#define FASTCACHE_OPTIMISTIC_RETRIES 4u
+#endif
+
+// Threads loading refresh-ahead values, see refresh_with()
+#ifndef FASTCACHE_REFRESH_THREADS
+#define FASTCACHE_REFRESH_THREADS 2u
+#endif
+
+// Shards serialized (in parallel) before save_snapshot() writes them out; bounds the memory a save takes
+#ifndef FASTCACHE_SNAPSHOT_WINDOW
+#define FASTCACHE_SNAPSHOT_WINDOW 16u
 #endif
 /// [Usings]
 using boost::shared_ptr;
@@ -76,84 +92,757 @@ namespace Storage {
         FASTCACHE_WRITEMODE_ONLY_WRITE_IF_SET,
         FASTCACHE_WRITEMODE_ONLY_WRITE_IF_NOT_SET
     };
+    // Read modes
+    enum fastcache_readmode {
+        FASTCACHE_READMODE_EXCLUSIVE,       // Readers lock the shard exclusively
+        FASTCACHE_READMODE_SHARED,          // Readers share the shard lock
+        FASTCACHE_READMODE_OPTIMISTIC       // Readers take no lock and validate against the shard sequence
+    };
 
-    struct StorageCacheObjectLocked : std::exception { 
-        char const* what() const throw() {
-            return "Object is currently locked";
-        }; 
+    /**
+     * Expiration relative to the write, in ms
+     *
+     * A sliding entry's TTL starts over on every read.  With refresh-ahead, the first read within the
+     * last refresh_percent of the TTL has the cache's refresher (see StorageCache::refresh_with()) load
+     * a new value in the background, while the current one is still handed out.
+     */
+    struct StorageTTL {
+        explicit StorageTTL(int64_t ms=0, bool sliding=false, unsigned int refresh_percent=0)
+            : ms(ms), sliding(sliding), refresh_percent(refresh_percent) {};
+
+        int64_t ms;                     // 0 = never expires
+        bool sliding;
+        unsigned int refresh_percent;   // 0 = no refresh-ahead
     };
 
-    template <class Key, class T>
+    template <class Key, class T, class Store=FlatStore, class Index=NoKeyIndex>
     class StorageCache {
         /**
          * CacheItem
          * A wrapper class for cache values
+         *
+         * Items are allocated by make_shared and keep themselves alive through `self` while the table
+         * holds them.  Values handed out share that reference count, so an item leaving the table is
+         * freed by whoever lets go of it last.
          */
         template <class W>
         class CacheItem {
             public:
-                CacheItem(shared_ptr<T> data, time_t expiration){
+                /**
+                 * @param data the value, owned by the caller's pointer
+                 * @param expiration UNIX timestamp, 0 for none
+                 */
+                CacheItem(const Key& key, size_t hash, shared_ptr<T>&& data, time_t expiration)
+                    : key(key), hash(hash), data(std::move(data)), value(this->data.get()), version(0), ttl(0), renewed(0), heap_index(ExpiryHeap<CacheItem>::NPOS),
+                      access(0), policy_index(EvictionPolicy<CacheItem>::NPOS), segment(0), mapped(false), sliding(false), refresh(0),
+                      refreshing(false), weight(1) {
 
-                    this->data=data;
-                    this->expiration=expiration;
+                    this->expiration=deadline(expiration);
+                };
+                /**
+                 * The value, NULL if none
+                 *
+                 * Values loaded from a snapshot are built here on first access (see MappedItem).
+                 */
+                T* get() const {
+                    T* value=this->value.load(std::memory_order_acquire);
+                    if(!value && this->mapped) {
+                        value=static_cast<const MappedItem<W>*>(this)->materialize();
+                    }
+                    return value;
+                };
+                /** The value as a pointer sharing the item's ownership, empty if none */
+                shared_ptr<T> share() const {
+                    if(this->data) {
+                        return this->data;
+                    }
+                    T* value=this->get();
+                    return value?shared_ptr<T>(this->self, value):shared_ptr<T>();
+                };
+                /** Drop the table's reference.  The item goes once no handed out value is left. */
+                static void drop(CacheItem* item) {
+                    shared_ptr<CacheItem> last;
+                    last.swap(item->self);
+                };
+                /** drop() for the epoch reclaimer */
+                static void drop_retired(void* item) {
+                    drop(static_cast<CacheItem*>(item));
                 };
                 /**
                  * Have we expired?
                  * 
                  * @retval bool
                  */
-                bool expired(){
+                bool expired() const {
+                    int64_t expiration=this->expiration.load(std::memory_order_relaxed);
                     // If we have no expiration, the answer is easy
-                    if(this->expiration==0) {
+                    if(expiration==0) {
+                        return false;
+                    }
+                    // Compare against the coarse clock
+                    int64_t now=CoarseClock::instance().now();
+                    return now >= expiration && (!this->sliding || now >= this->renewed.load(std::memory_order_relaxed));
+                };
+                /** Deadline incl. renewals by reads, 0 for none */
+                int64_t due() const {
+                    int64_t expiration=this->expiration.load(std::memory_order_relaxed);
+                    if(this->sliding) {
+                        expiration=std::max(expiration, this->renewed.load(std::memory_order_relaxed));
+                    }
+                    return expiration;
+                };
+                /**
+                 * Expire a relative time from now.  Call before the item is written.
+                 *
+                 * @param ttl the expiration, nothing to do if ttl.ms is 0
+                 */
+                void expire_after(const StorageTTL& ttl) {
+                    if(ttl.ms <= 0) {
+                        return;
+                    }
+                    int64_t expiration=CoarseClock::instance().now() + ttl.ms;
+                    this->expiration.store(expiration, std::memory_order_relaxed);
+                    this->renewed.store(expiration, std::memory_order_relaxed);
+                    this->ttl=ttl.ms;
+                    this->sliding=ttl.sliding;
+                    this->refresh=(uint8_t)std::min(ttl.refresh_percent, 100u);
+                };
+                /**
+                 * Expire at a deadline recovered from a snapshot or the journal.  Call before the item is written.
+                 *
+                 * @param expiration CoarseClock ms deadline, 0 for none
+                 * @param ttl the settings the item was first written with
+                 */
+                void expire_at(int64_t expiration, const StorageTTL& ttl) {
+                    this->expiration.store(expiration, std::memory_order_relaxed);
+                    this->renewed.store(expiration, std::memory_order_relaxed);
+                    this->ttl=ttl.ms;
+                    this->sliding=ttl.sliding;
+                    this->refresh=(uint8_t)std::min(ttl.refresh_percent, 100u);
+                };
+                /** Expire like another item (the one replaced by an update) */
+                void expire_like(const CacheItem& other) {
+                    int64_t due=other.due();
+                    this->expiration.store(due, std::memory_order_relaxed);
+                    this->renewed.store(due, std::memory_order_relaxed);
+                    this->ttl=other.ttl;
+                    this->sliding=other.sliding;
+                    this->refresh=other.refresh;
+                };
+                /** The TTL settings the item was written with */
+                StorageTTL settings() const {
+                    return StorageTTL(this->ttl, this->sliding, this->refresh);
+                };
+                /**
+                 * Convert a UNIX timestamp to a deadline on the coarse clock
+                 *
+                 * The item stays valid through the whole second named by the timestamp.
+                 *
+                 * @param expiration UNIX timestamp, 0 for none
+                 * @retval monotonic ms deadline, 0 for none
+                 */
+                static int64_t deadline(time_t expiration) {
+                    if(expiration==0) {
+                        return 0;
+                    }
+                    int64_t ms=CoarseClock::instance().from_unix_ms(((int64_t)expiration + 1) * 1000);
+                    return (ms==0)?-1:ms;
+                };
+
+            const Key key;
+            const size_t hash;
+            shared_ptr<CacheItem> self;     // The table's reference
+            shared_ptr<T> data;     // Separately allocated value (set()), empty if emplaced
+            mutable std::atomic<T*> value;  // NULL until a mapped value is materialized
+            uint64_t version;       // Set by the shard right before the item is written, see compare_and_set()
+            std::atomic<int64_t> expiration;    // Deadline in CoarseClock ms, 0 = never.  Moved by the curator only.
+            int64_t ttl;            // Relative ms if written with a StorageTTL, 0 otherwise
+            std::atomic<int64_t> renewed;       // Deadline as extended by reads (sliding)
+            size_t heap_index;      // Position in the shard's expiry heap
+            std::atomic<uint32_t> access;   // Eviction recency/reference, written by readers
+            size_t policy_index;    // Position in the shard's eviction ring
+            uint8_t segment;        // Eviction area (W-TinyLFU window/main)
+            bool mapped;            // A MappedItem
+            bool sliding;           // Reads renew the TTL
+            uint8_t refresh;        // Refresh-ahead window, percent of ttl
+            std::atomic<bool> refreshing;       // Refresh queued, see StorageCache::renew()
+            uint32_t weight;        // Share of the capacity
+        };
+        /**
+         * EmplacedItem
+         * Item with its value inline: key, value, bookkeeping and reference count share one allocation.
+         */
+        template <class W>
+        class EmplacedItem : public CacheItem<W> {
+            public:
+                template <class... Args>
+                EmplacedItem(const Key& key, size_t hash, time_t expiration, Args&&... args)
+                    : CacheItem<W>(key, hash, shared_ptr<T>(), expiration), stored(construct(std::forward<Args>(args)...)) {
+
+                    this->value.store(&this->stored, std::memory_order_relaxed);
+                };
+
+            private:
+                /** Constructor call if T has a matching one, aggregate initialization otherwise */
+                template <class... Args>
+                static T construct(Args&&... args) {
+                    if constexpr(std::is_constructible<T, Args&&...>::value) {
+                        return T(std::forward<Args>(args)...);
+                    } else {
+                        return T{std::forward<Args>(args)...};
+                    }
+                };
+
+                T stored;
+        };
+        /**
+         * MappedItem
+         * Item loaded from a snapshot.  The value stays serialized in the mapped file until first accessed;
+         * the item keeps the mapping alive.
+         */
+        template <class W>
+        class MappedItem : public CacheItem<W> {
+            public:
+                /**
+                 * @param file the mapped snapshot
+                 * @param image the serialized value, inside file
+                 * @param size bytes of the serialized value
+                 * @param expiration CoarseClock ms deadline, 0 for none
+                 * @param ttl the TTL settings recorded with it
+                 */
+                MappedItem(const Key& key, size_t hash, const shared_ptr<SnapshotFile>& file, const uint8_t* image, size_t size, int64_t expiration,
+                           const StorageTTL& ttl)
+                    : CacheItem<W>(key, hash, shared_ptr<T>(), 0), build(&MappedItem::deserialize), file(file), image(image), size(size) {
+
+                    this->mapped=true;
+                    this->expire_at(expiration, ttl);
+                };
+                ~MappedItem() {
+                    delete this->value.load(std::memory_order_relaxed);
+                };
+                /**
+                 * Build the value from its image.  Racing readers build one each, the first published wins.
+                 *
+                 * @retval the value, NULL if the image is damaged (StorageSerializer<T>::read() threw): the
+                 *         entry then reads as empty instead of failing every get() and for_each() that meets it
+                 */
+                T* materialize() const {
+                    T* built;
+                    try {
+                        built=this->build(this->image, this->size);
+                    } catch(const std::bad_alloc&) {
+                        throw;
+                    } catch(...) {
+                        return NULL;
+                    }
+                    T* expected=NULL;
+                    if(!this->value.compare_exchange_strong(expected, built, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                        delete built;
+                        return expected;
+                    }
+                    return built;
+                };
+                /** The serialized value if not materialized yet, for writing it out again unparsed */
+                const uint8_t* unparsed(size_t& size) const {
+                    if(this->value.load(std::memory_order_acquire)) {
+                        return NULL;
+                    }
+                    size=this->size;
+                    return this->image;
+                };
+
+            private:
+                /** Only instantiated by loading, so caches that never load need no StorageSerializer<T> */
+                static T* deserialize(const uint8_t* image, size_t size) {
+                    return new T(StorageSerializer<T>::read(image, size));
+                };
+
+                T* (*build)(const uint8_t*, size_t);
+                shared_ptr<SnapshotFile> file;
+                const uint8_t* image;
+                size_t size;
+        };
+        /**
+         * Flight
+         * A get_or_load() in progress: the first caller missing on a key loads it, later ones wait here
+         * for its result.
+         */
+        class Flight {
+            public:
+                Flight(const Key& key, size_t hash) : key(key), hash(hash), done(false), abandoned(false) {};
+                /** Hand the result (or failure) to every waiter */
+                void finish(const shared_ptr<T>& value, std::exception_ptr error) {
+                    boost::lock_guard<boost::mutex> lock(this->guard);
+                    this->value=value;
+                    this->error=error;
+                    this->done=true;
+                    this->ready.notify_all();
+                };
+                /** End without a result: waiters are to look the key up again */
+                void abandon() {
+                    boost::lock_guard<boost::mutex> lock(this->guard);
+                    this->abandoned=true;
+                    this->done=true;
+                    this->ready.notify_all();
+                };
+                /**
+                 * Wait for the loading caller
+                 *
+                 * @param value set to the loaded value, empty for a negative result
+                 * @retval false if the flight was abandoned and value is not set
+                 * @throws whatever the loader threw
+                 */
+                bool wait(shared_ptr<T>& value) {
+                    boost::unique_lock<boost::mutex> lock(this->guard);
+                    while(!this->done) {
+                        this->ready.wait(lock);
+                    }
+                    if(this->abandoned) {
                         return false;
                     }
-                    // Get the time and compare
-                    struct timespec time;
-                    clock_gettime(CLOCK_REALTIME, &time);
-                    return (time.tv_sec > this->expiration);
+                    if(this->error) {
+                        std::rethrow_exception(this->error);
+                    }
+                    value=this->value;
+                    return true;
                 };
 
-            shared_ptr<T> data;
-            time_t expiration;
+            const Key key;
+            const size_t hash;
+
+            private:
+                boost::mutex guard;
+                boost::condition_variable ready;
+                bool done;
+                bool abandoned;         // By a failed refresh, see StorageCache::refresh()
+                shared_ptr<T> value;
+                std::exception_ptr error;
         };
-        /** Shard */
+        /** Table type of the selected store */
+        typedef typename Store::template table<Key, CacheItem<T> >::type Table;
+        /** Secondary index type of the selected index */
+        typedef typename Index::template index<Key, CacheItem<T> >::type KeyIndex;
+        /**
+         * Shard
+         * Lives inline in the cache's shard array, padded so no two shards share a cache line.
+         */
         template <class S>    // Keep compiler happy... really will be T
-        class Shard {
+        class alignas(FASTCACHE_SHARD_ALIGN) Shard {
             public:
-                Shard(){
-                    this->guard=shared_ptr<mutex>(new mutex());
+                Shard() : seq(0), next_deadline(INT64_MAX), versions(0), filter(NULL) {
+                    this->table.set_reclaimer(&this->reclaimer);
+                    this->filter_reclaimer.enable();
                 };
-                void cull_expired_keys() {
-                    // Iterate map.  Somehow this is ok to do even though we are deleting stuff?
-                    for(typename std::map<Key,shared_ptr<CacheItem<T> > >::iterator it=this->map.begin();it != this->map.end();/* no increment */){
-                        shared_ptr<CacheItem<T> >item=it->second;
-                        if(item->expired()){
-                            this->map.erase(it++);
-                        } else {
-                            ++it;
+                /** Retire removed items through the epoch domain (lock-free readers) */
+                void defer_reclamation() {
+                    this->reclaimer.enable();
+                };
+                ~Shard(){
+                    this->table.clear(&Shard::dispose);
+                    delete this->filter.load(std::memory_order_relaxed);
+                };
+                /**
+                 * Remove due items, earliest first
+                 *
+                 * @param now CoarseClock ms
+                 * @param budget maximum number of items to remove
+                 * @param released items the caller should release after unlocking
+                 * @retval true if due items are left (budget exhausted)
+                 */
+                bool cull_expired_keys(int64_t now, size_t budget, std::vector<CacheItem<T>*>& released) {
+                    for(CacheItem<T>* item=this->expiry.top(); item && item->expiration <= now; item=this->expiry.top()) {
+                        if(budget-- == 0) {
+                            return true;
                         }
+                        int64_t renewed=item->sliding?item->renewed.load(std::memory_order_relaxed):0;
+                        if(renewed > now) {
+                            // Read meanwhile, due later
+                            item->expiration.store(renewed, std::memory_order_relaxed);
+                            this->expiry.update(item);
+                            this->next_deadline.store(this->expiry.next(), std::memory_order_relaxed);
+                            continue;
+                        }
+                        this->table.erase(item->key, item->hash);
+                        if(this->unlink(item)) {
+                            released.push_back(item);
+                        }
+                        bump(this->counters.expirations);
+                    }
+                    return false;
+                }
+                /**
+                 * Write an item according to the write mode.  Call under the write lock.
+                 *
+                 * @param item the new item
+                 * @param mode the write mode
+                 * @param released items the caller should release after unlocking (incl. item if not written)
+                 * @retval number of items written
+                 */
+                size_t write(CacheItem<T>* item, const fastcache_writemode mode, std::vector<CacheItem<T>*>& released) {
+                    CacheItem<T>* old=NULL;
+                    // Before the table publishes it.  Never repeats within the shard, so a key deleted and set
+                    // again doesn't get an old version back.
+                    item->version=++this->versions;
+                    MissFilter* filter=this->filter.load(std::memory_order_relaxed);
+                    if(filter) {
+                        filter->add(item->hash);
+                    }
+                    if(mode==FASTCACHE_WRITEMODE_ONLY_WRITE_IF_SET) {
+                        old=this->table.replace(item);
+                        if(!old) {
+                            // Key not found.  Return.
+                            released.push_back(item);
+                            return 0;
+                        }
+                    } else if(mode==FASTCACHE_WRITEMODE_ONLY_WRITE_IF_NOT_SET) {
+                        if(this->table.insert(item)) {
+                            // Key exists, so nothing was written
+                            released.push_back(item);
+                            return 0;
+                        }
+                    } else {
+                        old=this->table.assign(item);
+                    }
+                    bump(old?this->counters.overwrites:this->counters.inserts);
+                    if(this->unlink(old)) {
+                        released.push_back(old);
+                    }
+                    this->link(item);
+                    this->evict(item, released);
+                    return 1;
+                }
+                /**
+                 * Evict until the shard is within its budget again
+                 *
+                 * @param protect the item just written
+                 * @param released items the caller should release after unlocking
+                 */
+                void evict(CacheItem<T>* protect, std::vector<CacheItem<T>*>& released) {
+                    while(this->policy.over()) {
+                        CacheItem<T>* victim=this->policy.victim(protect);
+                        if(!victim) {
+                            break;
+                        }
+                        this->table.erase(victim->key, victim->hash);
+                        if(this->unlink(victim)) {
+                            released.push_back(victim);
+                        }
+                        bump(this->counters.evictions);
+                    }
+                }
+                /**
+                 * Remove every item.  Call under the write lock.
+                 *
+                 * @param released items the caller should release after unlocking
+                 * @retval number of items removed
+                 */
+                size_t clear(std::vector<CacheItem<T>*>& released) {
+                    size_t count=this->table.size();
+                    this->table.clear([this, &released](CacheItem<T>* item) {
+                        if(this->unlink(item)) {
+                            released.push_back(item);
+                        }
+                    });
+                    return count;
+                }
+                /** Index an item just put into the table */
+                void link(CacheItem<T>* item) {
+                    this->policy.admit(item);
+                    this->index.insert(item);
+                    if(item->expiration) {
+                        this->expiry.push(item);
+                        this->next_deadline.store(this->expiry.next(), std::memory_order_relaxed);
+                    }
+                }
+                /**
+                 * Release an item removed from the table
+                 *
+                 * @retval the item if the caller should release it (after unlocking), NULL if retired
+                 */
+                CacheItem<T>* unlink(CacheItem<T>* item) {
+                    if(item) {
+                        this->policy.remove(item);
+                        this->index.erase(item);
+                        MissFilter* filter=this->filter.load(std::memory_order_relaxed);
+                        if(filter) {
+                            filter->remove();
+                        }
+                    }
+                    if(item && item->heap_index!=ExpiryHeap<CacheItem<T> >::NPOS) {
+                        this->expiry.remove(item);
+                        this->next_deadline.store(this->expiry.next(), std::memory_order_relaxed);
+                    }
+                    if(item && this->reclaimer.deferred()) {
+                        this->reclaimer.retire(item, &CacheItem<T>::drop_retired);
+                        return NULL;
+                    }
+                    return item;
+                }
+                /** Seqlock, writer side.  Call with the guard held exclusively. */
+                void begin_write() {
+                    this->seq.store(this->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_release);
+                }
+                void end_write() {
+                    MissFilter* filter=this->filter.load(std::memory_order_relaxed);
+                    if(filter && filter->stale()) {
+                        this->build_filter(filter->bits_per_key);
+                    }
+                    this->counters.entries.store(this->table.size(), std::memory_order_relaxed);
+                    this->seq.store(this->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+                }
+                /**
+                 * Replace the miss filter by one of the current keys.  Call under the write lock.
+                 *
+                 * @param bits_per_key filter bits per key, 0 to drop the filter
+                 */
+                void build_filter(unsigned int bits_per_key) {
+                    MissFilter* built=NULL;
+                    if(bits_per_key) {
+                        // Room to grow before the next rebuild
+                        built=new MissFilter(this->table.size() * 2, bits_per_key);
+                        this->table.for_each([built](CacheItem<T>* item) {
+                            built->add(item->hash);
+                        });
+                    }
+                    MissFilter* old=this->filter.exchange(built, std::memory_order_acq_rel);
+                    if(old) {
+                        // Readers check it without the lock
+                        this->filter_reclaimer.retire(old);
                     }
                 }
+                /** Count an event under the write lock: no other writer, so no atomic add needed */
+                static void bump(std::atomic<uint64_t>& counter) {
+                    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                }
+                /** Seqlock, reader side.  Odd values mean a writer is active. */
+                uint64_t read_begin() const {
+                    return this->seq.load(std::memory_order_acquire);
+                }
+                bool read_validate(uint64_t version) const {
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    return this->seq.load(std::memory_order_relaxed)==version;
+                }
+                static void dispose(CacheItem<T>* item) {
+                    CacheItem<T>::drop(item);
+                }
             
-            shared_ptr<mutex> guard;
-            std::map<Key,shared_ptr<CacheItem<T> > > map;
+            boost::shared_mutex guard;
+            std::atomic<uint64_t> seq;
+            std::atomic<int64_t> next_deadline;     // Earliest deadline in the shard, peeked without the lock
+            uint64_t versions;      // Last version given to an item
+            std::atomic<MissFilter*> filter;        // Keys that may be in the shard, NULL unless filter_misses()
+            EpochReclaimer filter_reclaimer;        // Replaced filters
+            EpochReclaimer reclaimer;       // Declared before the table, which retires into it
+            Table table;
+            ExpiryHeap<CacheItem<T> > expiry;
+            EvictionPolicy<CacheItem<T> > policy;
+            KeyIndex index;
+            boost::mutex flights_guard;     // Guards flights only, never held with the shard lock
+            std::vector<shared_ptr<Flight> > flights;   // get_or_load() calls loading keys of this shard
+            /**
+             * Kept off the lock's cache line.  Readers add atomically, writers bump() under the lock; the
+             * writer side gets its own line so readers' adds don't bounce it.  stats() reads them unlocked.
+             */
+            struct Counters {
+                Counters() : hits(0), misses(0), contention(0), evictions(0), inserts(0), overwrites(0), deletes(0),
+                             expirations(0), entries(0) {};
+
+                alignas(FASTCACHE_SHARD_ALIGN) std::atomic<uint64_t> hits;
+                std::atomic<uint64_t> misses;
+                std::atomic<uint64_t> contention;       // Waited for the lock, or retried optimistically
+                alignas(FASTCACHE_SHARD_ALIGN) std::atomic<uint64_t> evictions;
+                std::atomic<uint64_t> inserts;
+                std::atomic<uint64_t> overwrites;
+                std::atomic<uint64_t> deletes;
+                std::atomic<uint64_t> expirations;
+                std::atomic<uint64_t> entries;          // table.size() as of the last write
+            } counters;
+        };
+        /** Exclusive shard lock that also bumps the shard sequence */
+        class ShardWriter {
+            public:
+                explicit ShardWriter(Shard<T>* shard) : shard(shard), lock(shard->guard, boost::try_to_lock) {
+                    if(!this->lock.owns_lock()) {
+                        shard->counters.contention.fetch_add(1, std::memory_order_relaxed);
+                        this->lock.lock();
+                    }
+                    this->shard->begin_write();
+                };
+                ~ShardWriter(){
+                    this->shard->end_write();
+                };
+
+            private:
+                Shard<T>* shard;
+                boost::unique_lock<boost::shared_mutex> lock;
         };
 
         ///Variables
-        boost::hash<Key> hash;
-        std::vector<shared_ptr<Shard<T>>> shards;
+        StorageHash<Key> hash;
+        Shard<T>* shards;
+        size_t shard_mask;
         shared_ptr<boost::thread> curator;
         shared_ptr<boost::detail::atomic_count> curator_run;
+        fastcache_readmode readmode;
+        int64_t created;
 
         public:
-            StorageCache(){
+            /** Weight of an item against the capacity, e.g. its size in bytes */
+            typedef size_t (*weigher_t)(const Key&, const T&);
 
-                // We are making a new cache.  Init our shards.
-                this->shards.reserve(FASTCACHE_SHARDSIZE);
-                for(unsigned int n=0; n<FASTCACHE_SHARDSIZE; n++) {
+        private:
+        weigher_t weigher;
+        shared_ptr<StorageJournal> journal;     // Empty unless open_journal()
+        LatencyHistogram get_latency;
+        LatencyHistogram set_latency;
+        uint64_t (*log)(StorageJournal&, const CacheItem<T>*, bool);    // log_item(), set with the journal
+        /** A refresh-ahead load to do */
+        struct Refresh {
+            Key key;
+            size_t hash;
+            StorageTTL ttl;
+        };
+        std::function<shared_ptr<T>(const Key&)> refresher;    // Empty unless refresh_with()
+        boost::mutex refresh_guard;
+        boost::condition_variable refresh_ready;
+        std::deque<Refresh> refreshes;
+        boost::thread_group refresh_threads;
+        /** Items to drop once unlocked; dropped on scope exit too, e.g. when a journal error unwinds a write */
+        struct Released : std::vector<CacheItem<T>*> {
+            ~Released() {
+                release(*this);
+            };
+        };
+
+        public:
+            /**
+             * Borrowed
+             * A value lent out by borrow().
+             *
+             * In FASTCACHE_READMODE_OPTIMISTIC the borrow pins the calling thread's epoch instead of
+             * copying the shared_ptr: no refcount is touched and items replaced or deleted meanwhile are
+             * only freed once the borrow is gone.  Keep borrows short (they hold back reclamation) and
+             * release them on the thread that took them.  Other read modes lend a shared_ptr copy.
+             */
+            class Borrowed {
+                public:
+                    Borrowed(Borrowed&& other) : record(other.record), held(other.held), data(other.data) {
+                        other.record=NULL;
+                        other.held.reset();
+                        other.data=NULL;
+                    };
+                    ~Borrowed(){
+                        if(this->record) {
+                            EpochDomain::instance().leave(this->record);
+                        }
+                    };
+                    const T* get() const {
+                        return this->data;
+                    };
+                    const T& operator*() const {
+                        return *this->data;
+                    };
+                    const T* operator->() const {
+                        return this->data;
+                    };
+                    explicit operator bool() const {
+                        return this->data!=NULL;
+                    };
+
+                private:
+                    friend class StorageCache;
+                    /** Pinned, nothing lent yet */
+                    Borrowed() : record(EpochDomain::instance().enter()), data(NULL) {};
+                    /** Lent through a refcount */
+                    explicit Borrowed(shared_ptr<T> held) : record(NULL), held(held), data(held.get()) {};
+                    Borrowed(const Borrowed&);
+                    Borrowed& operator=(const Borrowed&);
+
+                    EpochDomain::Record* record;
+                    shared_ptr<T> held;
+                    const T* data;
+            };
+            /**
+             * Cursor
+             * Walks the cache in batches, holding a shard's shared lock for one batch at a time only.
+             *
+             * Weakly consistent: entries written or deleted during the walk may or may not be seen, and a
+             * shard that grew meanwhile is walked again from its start (see FlatTable::for_each_from()).
+             * Must not outlive its cache.
+             */
+            class Cursor {
+                public:
+                    /**
+                     * Visit the next batch
+                     *
+                     * @param visit called with (const Key&, const T&) for each live entry, under the shard lock
+                     * @retval false once the walk is complete
+                     */
+                    template <class F>
+                    bool next(F visit){
+                        if(this->shard > this->cache->shard_mask) {
+                            return false;
+                        }
+                        Shard<T>* shard=&this->cache->shards[this->shard];
+                        bool more;
+                        {    // Scope for lock
+                            boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                            more=shard->table.for_each_from(this->position, this->batch, [&visit](CacheItem<T>* item) {
+                                StorageCache::visit_item(item, visit);
+                            });
+                        }
+                        if(!more) {
+                            // Shard done.  Go on with the next one in the next batch.
+                            ++this->shard;
+                            this->position=typename Table::Position();
+                        }
+                        return this->shard <= this->cache->shard_mask;
+                    };
+
+                private:
+                    friend class StorageCache;
+                    Cursor(StorageCache* cache, size_t batch) : cache(cache), shard(0), batch(batch) {};
+
+                    StorageCache* cache;
+                    size_t shard;
+                    typename Table::Position position;
+                    size_t batch;
+            };
+            /**
+             * @param readmode how get() synchronizes with writers.  FASTCACHE_READMODE_OPTIMISTIC needs a
+             *        store with concurrent reads and falls back to FASTCACHE_READMODE_SHARED otherwise.
+             * @param shard_count number of shards, rounded up to a power of two and, for a bounded cache,
+             *        down to at most capacity
+             * @param capacity maximum total weight (item count unless a weigher is given), 0 for unbounded.
+             *        Split across the shards so their budgets differ by at most one and sum to capacity.
+             * @param eviction how to make room once a shard is full
+             * @param weigher weight of an item, NULL to count items
+             */
+            StorageCache(const fastcache_readmode readmode=FASTCACHE_READMODE_OPTIMISTIC, size_t shard_count=FASTCACHE_SHARDSIZE,
+                         size_t capacity=0, const fastcache_eviction eviction=FASTCACHE_EVICTION_SAMPLED_LRU, weigher_t weigher=NULL)
+                : readmode(readmode), created(CoarseClock::instance().now()), weigher(weigher), log(NULL) {
 
-                    shared_ptr<Shard<T> >p (new Shard<T>());
-                    this->shards.push_back(p);
+                if(this->readmode==FASTCACHE_READMODE_OPTIMISTIC && !Table::CONCURRENT_READS) {
+                    this->readmode=FASTCACHE_READMODE_SHARED;
+                }
+                // We are making a new cache.  Init our shards.
+                size_t count=1;
+                while(count < shard_count) {
+                    count<<=1;
+                }
+                // A shard budget of 0 means unbounded, so every shard needs at least one unit
+                while(capacity && count > capacity) {
+                    count>>=1;
+                }
+                this->shard_mask=count - 1;
+                this->shards=new Shard<T>[count];
+                for(size_t n=0; n<count; n++) {
+                    if(this->readmode==FASTCACHE_READMODE_OPTIMISTIC) {
+                        this->shards[n].defer_reclamation();
+                    }
+                    // The first capacity % count shards take one unit of the remainder each
+                    this->shards[n].policy.configure(eviction, capacity / count + (n < capacity % count?1:0));
                 }
 
                 // Start up the curator thread
@@ -162,10 +851,14 @@ namespace Storage {
             };
             ~StorageCache(){
 
+                // Retire the refreshers (they write to the shards)
+                this->refresh_threads.interrupt_all();
+                this->refresh_threads.join_all();
                 // Retire the curator
                 --(*this->curator_run);
                 this->curator->interrupt();
                 this->curator->join();
+                delete[] this->shards;
 
             };
             /**
@@ -174,18 +867,55 @@ namespace Storage {
              * @retval 
              */
             size_t metrics() {
+                // Each shard publishes its size on every write, no need to lock them
                 size_t total_size=0;
-                // Iterate all objects in cache
-                for(typename std::vector<shared_ptr<Shard<T> > >::iterator it=this->shards.begin(); it != this->shards.end(); ++it) {
-                    shared_ptr<Shard<T> >shard=*it;
-                    {    // Scope for lock
-                        mutex::scoped_lock lock(*shard->guard);
-                        //  tally
-                        total_size+=shard->map.size();
-                    }
+                for(size_t n=0; n<=this->shard_mask; n++) {
+                    total_size+=this->shards[n].counters.entries.load(std::memory_order_relaxed);
                 }
                 return total_size;
             };
+            /**
+             * Counters and latencies
+             *
+             * Read without any shard lock, so the figures of different shards are not from one instant.
+             * Latencies are of sampled calls (#FASTCACHE_STATS_SAMPLE).
+             *
+             * @retval the counters summed over all shards
+             */
+            StorageCacheStats stats() {
+                StorageCacheStats stats;
+                for(size_t n=0; n<=this->shard_mask; n++) {
+                    const typename Shard<T>::Counters& counters=this->shards[n].counters;
+                    stats.hits+=counters.hits.load(std::memory_order_relaxed);
+                    stats.misses+=counters.misses.load(std::memory_order_relaxed);
+                    stats.evictions+=counters.evictions.load(std::memory_order_relaxed);
+                    stats.entries+=counters.entries.load(std::memory_order_relaxed);
+                    stats.inserts+=counters.inserts.load(std::memory_order_relaxed);
+                    stats.overwrites+=counters.overwrites.load(std::memory_order_relaxed);
+                    stats.deletes+=counters.deletes.load(std::memory_order_relaxed);
+                    stats.expirations+=counters.expirations.load(std::memory_order_relaxed);
+                    stats.contention+=counters.contention.load(std::memory_order_relaxed);
+                }
+                stats.get_latency=this->get_latency.summary();
+                stats.set_latency=this->set_latency.summary();
+                if(stats.hits + stats.misses) {
+                    stats.hit_rate=(double)stats.hits / (double)(stats.hits + stats.misses);
+                }
+                int64_t elapsed=CoarseClock::instance().now() - this->created;
+                if(elapsed > 0) {
+                    stats.evictions_per_sec=stats.evictions * 1000.0 / elapsed;
+                }
+                return stats;
+            };
+            /**
+             * stats() in the Prometheus text format, for a scrape endpoint
+             *
+             * @param prefix metric name prefix
+             * @param labels added to every sample, e.g. "cache=\"fields\"", empty for none
+             */
+            std::string prometheus(const std::string& prefix="fastcache", const std::string& labels=""){
+                return fastcache_prometheus(this->stats(), prefix, labels);
+            };
             /**
              * Set a value into the cache
              *
@@ -194,141 +924,1386 @@ namespace Storage {
              * @param expiration UNIX timestamp
              * @param mode the write mode
              * @retval number of items written
+             * @throws StorageJournalError if a journal is open and can't log or sync the write.  The write is
+             *         applied in memory by then, so readers may see a value that won't survive a restart.
              */
-            size_t set(Key id, shared_ptr<T> val, time_t expiration=0, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+            size_t set(const Key& id, shared_ptr<T> val, time_t expiration=0, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                LatencyTimer timer(this->set_latency);
                 // Get shard
-                size_t index=this->calc_index(id);
-                shared_ptr<Shard<T> >shard=this->shards.at(index);
-                shared_ptr<CacheItem<T> >item=shared_ptr<CacheItem<T> >(new CacheItem<T>(val, expiration));
-                // Lock and write
-                mutex::scoped_lock lock(*shard->guard);
-                #ifdef FASTCACHE_SLOW
-                sleep(1);
-                #endif
-                if(mode==FASTCACHE_WRITEMODE_ONLY_WRITE_IF_SET) {
-                    if(shard->map.find(id) == shard->map.end()) {            
-                        // Key not found.  Return.
-                        return 0;    
-                    } else {
-                        // Erase it so we can set it below
-                        shard->map.erase(id);                
-                    }
-                } 
-                std::pair<typename std::map<Key, shared_ptr<CacheItem<T> > >::iterator,bool>result;
-                result=shard->map.insert(std::pair<Key,shared_ptr<CacheItem<T> > >(id,item));    //TODO... use .emplace() once we have C++11 !! (may be faster)
-                if(!result.second) {
-                    // Key exists, so nothing was written
-                    if(mode==FASTCACHE_WRITEMODE_ONLY_WRITE_IF_NOT_SET){
-                        return 0;
-                    } else {
-                        // Erase and re-write
-                        shard->map.erase(id);
-                        shard->map.insert(std::pair<Key,shared_ptr<CacheItem<T> > >(id,item));
-                        return 1;
-                    }
-                }
-                return 1;
+                size_t hash=this->hash(id);
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                return this->write(shard, this->make_item(id, hash, std::move(val), expiration), mode);
             };
             /**
-             * Find if a key exists
+             * @param ttl expiration relative to now, in ms, optionally sliding and refreshed ahead
+             */
+            size_t set(const Key& id, shared_ptr<T> val, const StorageTTL& ttl, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                LatencyTimer timer(this->set_latency);
+                size_t hash=this->hash(id);
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                CacheItem<T>* item=this->make_item(id, hash, std::move(val), 0);
+                item->expire_after(ttl);
+                return this->write(shard, item, mode);
+            };
+            /**
+             * Construct a value in place
+             *
+             * The value is built inside the cache entry, so key, value, expiration and reference count take
+             * a single allocation.  get() hands out pointers sharing the entry.
              *
              * @param id the key
-             * @retval 1 if the key exists, 0 otherwise
+             * @param args constructor arguments of T (or its members, for aggregates)
+             * @retval number of items written
              */
-            size_t exists(Key id){
-                return (this->get(id))?1:0;        // So we don't get false positives on expired keys
+            template <class... Args>
+            size_t emplace(const Key& id, Args&&... args){
+                return this->emplace_expiring(id, 0, FASTCACHE_WRITEMODE_WRITE_ALWAYS, std::forward<Args>(args)...);
             };
             /**
-             * Delete a value from the cache
-             *
              * @param id the key
-             * @retval the number of items erased
+             * @param expiration UNIX timestamp, 0 for none
+             * @param mode the write mode
+             * @param args constructor arguments of T
+             * @retval number of items written
              */
-            size_t del(Key id){
-                // Get shard
-                size_t index=this->calc_index(id);
-                shared_ptr<Shard<T> >shard=this->shards.at(index);
-                // Lock and erase
-                mutex::scoped_lock lock(*shard->guard);
-                return shard->map.erase(id);
+            template <class... Args>
+            size_t emplace_expiring(const Key& id, time_t expiration, const fastcache_writemode mode, Args&&... args){
+                LatencyTimer timer(this->set_latency);
+                size_t hash=this->hash(id);
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                shared_ptr<EmplacedItem<T> > item=boost::make_shared<EmplacedItem<T> >(id, hash, expiration, std::forward<Args>(args)...);
+                return this->write(shard, this->adopt(item), mode);
             };
             /**
-             * Get a value from the cache
-             *
-             * Does not throw for invalid keys (returns empty pointer)
+             * @param ttl expiration relative to now, see set()
+             */
+            template <class... Args>
+            size_t emplace_expiring(const Key& id, const StorageTTL& ttl, const fastcache_writemode mode, Args&&... args){
+                LatencyTimer timer(this->set_latency);
+                size_t hash=this->hash(id);
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                CacheItem<T>* item=this->adopt(boost::make_shared<EmplacedItem<T> >(id, hash, 0, std::forward<Args>(args)...));
+                item->expire_after(ttl);
+                return this->write(shard, item, mode);
+            };
+            /**
+             * Set several values, locking each shard once
              *
-             * @param id the key
-             * @retval boost::shared_ptr<T>.  ==empty pointer if nonexistent or expired.
-             * @throws FastcacheObjectLocked if #FASTCACHE_MUTABLE_DATA is set and object is in use
+             * @param entries key/value pairs
+             * @param expiration UNIX timestamp, for all entries
+             * @param mode the write mode
+             * @retval number of items written
              */
-            shared_ptr<T> get(Key id){
-                // Get shard
-                size_t index=this->calc_index(id);
-                shared_ptr<Shard<T> >shard=this->shards.at(index);
-                // Lock
-                mutex::scoped_lock lock(*shard->guard);
-                // Delay if in slow mode...
-                #ifdef FASTCACHE_SLOW
-                sleep(1);
-                #endif
-                // OK, we now have exclusive access to the shard.  So no race condition is possible for the affections of this item...
-                shared_ptr<CacheItem<T> >item;
-                try {
-                    item=shard->map.at(id);            // Will throw std::out_of_range if not there!
-                    // Check for expired
-                    if(item->expired()){
-                        // It's expired.  Erase it and return empty.
-                        shard->map.erase(id);
-                        return shared_ptr<T>();
-                    }
-                } catch (std::exception& e) {
-                    return shared_ptr<T>();        // Return empty since it wasn't found
+            size_t multi_set(std::vector<std::pair<Key, shared_ptr<T> > > entries, time_t expiration=0, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                std::vector<size_t> hashes(entries.size());
+                std::vector<CacheItem<T>*> items(entries.size());
+                for(size_t n=0; n<entries.size(); n++) {
+                    hashes[n]=this->hash(entries[n].first);
+                    items[n]=this->make_item(entries[n].first, hashes[n], std::move(entries[n].second), expiration);
                 }
-                // If we are allowing mutables, make sure no one else is using this data!
-                #ifdef FASTCACHE_MUTABLE_DATA
-                if(!item->data.unique()){
-
-                    throw StorageCacheObjectLocked();
+                return this->write_grouped(hashes, items, mode);
+            };
+            /**
+             * @param ttl expiration relative to now, for all entries, see set()
+             */
+            size_t multi_set(std::vector<std::pair<Key, shared_ptr<T> > > entries, const StorageTTL& ttl, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                std::vector<size_t> hashes(entries.size());
+                std::vector<CacheItem<T>*> items(entries.size());
+                for(size_t n=0; n<entries.size(); n++) {
+                    hashes[n]=this->hash(entries[n].first);
+                    items[n]=this->make_item(entries[n].first, hashes[n], std::move(entries[n].second), 0);
+                    items[n]->expire_after(ttl);
                 }
-                #endif
-                return item->data;
+                return this->write_grouped(hashes, items, mode);
             };
-            /// [Custom] Added
-            std::vector<Key> keySet() {
-                std::vector<Key> _keyset;
-                // Get shard
-                for (shared_ptr<Shard<T>> shard : this->shards) {
-                    // Lock
-                    mutex::scoped_lock lock(*shard->guard);
-                    for (std::pair<Key,shared_ptr<CacheItem<T>>> entry : shard->map) {
-                        _keyset.push_back(entry.first);
-                    }
+            /**
+             * Move several values into the cache, locking each shard once.  Like emplace(), each value
+             * shares its allocation with the entry.
+             *
+             * @param entries key/value pairs
+             * @param expiration UNIX timestamp, for all entries
+             * @param mode the write mode
+             * @retval number of items written
+             */
+            size_t multi_emplace(std::vector<std::pair<Key, T> > entries, time_t expiration=0, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                std::vector<size_t> hashes(entries.size());
+                std::vector<CacheItem<T>*> items(entries.size());
+                for(size_t n=0; n<entries.size(); n++) {
+                    hashes[n]=this->hash(entries[n].first);
+                    items[n]=this->adopt(boost::make_shared<EmplacedItem<T> >(entries[n].first, hashes[n], expiration, std::move(entries[n].second)));
                 }
-                //std::stable_sort(_keyset.begin(), _keyset.end()); // <- Only for values which can be compared with < / >
-                return _keyset;
+                return this->write_grouped(hashes, items, mode);
             };
-            /// [Custom] Deleted
-
-        protected:
             /**
-             * We are the curator
+             * Modify a value in one shard lock acquisition
              *
-             * Purge expired keys, etc
+             * fn gets a copy of the current value to change; the copy then replaces the entry (keeping its
+             * expiration).  Readers holding the old value keep seeing it unchanged.  fn runs under the
+             * shard's write lock: keep it short and don't use the cache from it.
+             *
+             * @param id the key
+             * @param fn called as fn(T&) with the copy
+             * @retval 1 if updated, 0 if the key is nonexistent, expired or holds no value
              */
-            void curate(){
-                while(*this->curator_run) {
+            template <class F>
+            size_t update(const Key& id, F fn){
+                return this->write_locked(id, [this, &id, &fn](CacheItem<T>* current, size_t hash) -> CacheItem<T>* {
+                    const T* value=current?current->get():NULL;
+                    if(!value) {
+                        return NULL;
+                    }
+                    shared_ptr<T> copy=boost::make_shared<T>(*value);
+                    fn(*copy);
+                    CacheItem<T>* item=this->make_item(id, hash, std::move(copy), 0);
+                    item->expire_like(*current);
+                    return item;
+                });
+            };
+            /**
+             * Get a value, computing it under the shard lock if there is none
+             *
+             * Unlike get_or_load() the computation holds the shard's write lock, so it suits cheap values
+             * only.  fn must not use the cache.  An entry holding no value counts as absent.
+             *
+             * @param id the key
+             * @param fn called as fn() -> shared_ptr<T>; an empty result is not stored
+             * @param expiration UNIX timestamp for a computed value, 0 for none
+             * @retval the present or computed value
+             */
+            template <class F>
+            shared_ptr<T> compute_if_absent(const Key& id, F fn, time_t expiration=0){
+                shared_ptr<T> result;
+                this->write_locked(id, [this, &id, &fn, &result, expiration](CacheItem<T>* current, size_t hash) -> CacheItem<T>* {
+                    result=current?current->share():shared_ptr<T>();
+                    if(result) {
+                        return NULL;
+                    }
+                    result=fn();
+                    return result?this->make_item(id, hash, shared_ptr<T>(result), expiration):NULL;
+                });
+                return result;
+            };
+            /**
+             * Set a value if the entry is still the version the caller read
+             *
+             * @param id the key
+             * @param expected_version from get_versioned(), 0 to write only if the key is absent
+             * @param val the new value
+             * @param expiration UNIX timestamp, 0 for none
+             * @param version set to the new version if written, unless NULL
+             * @retval 1 if written, 0 if the entry changed meanwhile
+             */
+            size_t compare_and_set(const Key& id, uint64_t expected_version, shared_ptr<T> val, time_t expiration=0, uint64_t* version=NULL){
+                return this->write_locked(id, [this, &id, &val, expected_version, expiration](CacheItem<T>* current, size_t hash) -> CacheItem<T>* {
+                    if((current?current->version:0)!=expected_version) {
+                        return NULL;
+                    }
+                    return this->make_item(id, hash, std::move(val), expiration);
+                }, version);
+            };
+            /**
+             * Hash of a key, as used for shard and slot selection
+             *
+             * Lookups take it back so a key used several times is hashed once.
+             *
+             * @param id the key, or anything comparing and hashing like it (e.g. std::string_view for std::string)
+             */
+            template <class K>
+            size_t key_hash(const K& id) const {
+                return this->hash(id);
+            };
+            /**
+             * Find if a key exists
+             *
+             * @param id the key
+             * @retval 1 if the key exists, 0 otherwise
+             */
+            template <class K>
+            size_t exists(const K& id){
+                return this->exists(id, this->hash(id));
+            };
+            /**
+             * @param hash key_hash(id)
+             */
+            template <class K>
+            size_t exists(const K& id, size_t hash){
+                // Expired and empty entries don't count, as for get()
+                return this->find_live(id, hash, [](CacheItem<T>* item) -> size_t {
+                    return (item && (item->mapped || item->get()))?1:0;
+                });
+            };
+            /**
+             * Delete a value from the cache
+             *
+             * @param id the key
+             * @retval the number of items erased
+             * @throws StorageJournalError if a journal is open and can't log or sync the delete, applied in
+             *         memory by then as for set()
+             */
+            template <class K>
+            size_t del(const K& id){
+                return this->del(id, this->hash(id));
+            };
+            /**
+             * @param hash key_hash(id)
+             */
+            template <class K>
+            size_t del(const K& id, size_t hash){
+                // Get shard
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                CacheItem<T>* erased;
+                Released released;
+                uint64_t sequence=0;
+                {    // Scope for lock
+                    // Lock and erase
+                    EpochGuard pin;
+                    ShardWriter writer(shard);
+                    erased=shard->table.erase(id, hash);
+                    if(erased) {
+                        Shard<T>::bump(shard->counters.deletes);
+                        // Unlinked before logging, see multi_del()
+                        if(shard->unlink(erased)) {
+                            released.push_back(erased);
+                        }
+                    }
+                    if(erased && this->journal) {
+                        sequence=this->log(*this->journal, erased, true);
+                    }
+                }
+                release(released);
+                this->commit(hash, sequence);
+                return erased?1:0;
+            };
+            /**
+             * Delete several values, locking each shard once
+             *
+             * @param ids the keys
+             * @retval the number of items erased
+             */
+            template <class K>
+            size_t multi_del(const std::vector<K>& ids){
+                std::vector<size_t> hashes(ids.size());
+                for(size_t n=0; n<ids.size(); n++) {
+                    hashes[n]=this->hash(ids[n]);
+                }
+                std::vector<std::pair<size_t, size_t> > order=this->group(hashes);
+                Released released;
+                size_t erased=0;
+                for(size_t begin=0, end=0; begin<order.size(); begin=end) {
+                    Shard<T>* shard=&this->shards[order[begin].first];
+                    for(end=begin; end<order.size() && order[end].first==order[begin].first; end++) {
+                        shard->table.prefetch(hashes[order[end].second]);
+                    }
+                    {    // Scope for lock
+                        EpochGuard pin;
+                        ShardWriter writer(shard);
+                        for(size_t n=begin; n<end; n++) {
+                            CacheItem<T>* item=shard->table.erase(ids[order[n].second], hashes[order[n].second]);
+                            if(item) {
+                                ++erased;
+                                Shard<T>::bump(shard->counters.deletes);
+                                // Unlinked first, so a journal error leaves the shard consistent; pinned, so
+                                // the item outlives the log copying it even if unlink() retired it
+                                if(shard->unlink(item)) {
+                                    released.push_back(item);
+                                }
+                                if(this->journal) {
+                                    this->log(*this->journal, item, true);
+                                }
+                            }
+                        }
+                    }
+                }
+                release(released);
+                if(erased && this->journal && this->journal->synchronous()) {
+                    this->journal->commit_all();
+                }
+                return erased;
+            };
+            /**
+             * Get a value from the cache
+             *
+             * Does not throw for invalid keys (returns empty pointer).  Never modifies the shard: expired
+             * items are left for the curator.
+             *
+             * @param id the key, or anything comparing and hashing like it.  Nothing is allocated for the lookup.
+             * @retval boost::shared_ptr<T>.  ==empty pointer if nonexistent or expired.
+             */
+            template <class K>
+            shared_ptr<T> get(const K& id){
+                return this->get(id, this->hash(id));
+            };
+            /**
+             * @param hash key_hash(id)
+             */
+            template <class K>
+            shared_ptr<T> get(const K& id, size_t hash){
+                LatencyTimer timer(this->get_latency);
+                bool found;
+                return this->lookup(id, hash, found);
+            };
+            /**
+             * Get a value and its version, for compare_and_set()
+             *
+             * @param id the key
+             * @param version set to the entry's version, 0 if nonexistent or expired
+             * @retval the value, empty if nonexistent or expired
+             */
+            template <class K>
+            shared_ptr<T> get_versioned(const K& id, uint64_t& version){
+                LatencyTimer timer(this->get_latency);
+                bool found;
+                return this->lookup(id, this->hash(id), found, &version);
+            };
+            /**
+             * Get a value, loading it on a miss
+             *
+             * Concurrent callers missing on the same key share one load: the first runs the loader (without
+             * any shard lock held), the others wait for its result.  A loader failure is rethrown to all of
+             * them and nothing is cached.  The loader must not get_or_load() the same key.
+             *
+             * @param id the key
+             * @param loader called as loader() -> shared_ptr<T>, an empty pointer for a key that doesn't exist
+             * @param expiration UNIX timestamp for a loaded value, 0 for none
+             * @param negative_expiration UNIX timestamp until which an empty result is cached (get() returns
+             *        empty, get_or_load() doesn't load again), 0 to not cache it
+             * @retval the value, empty if the loader found none
+             */
+            template <class F>
+            shared_ptr<T> get_or_load(const Key& id, F loader, time_t expiration=0, time_t negative_expiration=0){
+                return this->load_once(id, loader, expiration, negative_expiration, negative_expiration!=0);
+            };
+            /**
+             * @param ttl expiration of a loaded value relative to now, see set()
+             * @param negative_ttl expiration of an empty result, not cached if negative_ttl.ms is 0
+             */
+            template <class F>
+            shared_ptr<T> get_or_load(const Key& id, F loader, const StorageTTL& ttl, const StorageTTL& negative_ttl=StorageTTL()){
+                return this->load_once(id, loader, ttl, negative_ttl, negative_ttl.ms!=0);
+            };
+            /**
+             * Reject misses with a per-shard Bloom filter, before any lock or table probe
+             *
+             * Pays off for lookups of mostly absent keys; every write then sets the key's filter bits too.
+             * About 1 in 100 absent keys (at 10 bits per key) still goes to the table.  Filters are rebuilt
+             * under the shard lock as keys come and go.  May be called any time.
+             *
+             * @param bits_per_key filter bits per key, 0 to go without filters again
+             */
+            void filter_misses(unsigned int bits_per_key=FASTCACHE_FILTER_BITS){
+                for(size_t n=0; n<=this->shard_mask; n++) {
+                    ShardWriter writer(&this->shards[n]);
+                    this->shards[n].build_filter(bits_per_key);
+                }
+            };
+            /**
+             * Set the loader of refresh-ahead entries (StorageTTL::refresh_percent)
+             *
+             * Refreshes run on FASTCACHE_REFRESH_THREADS threads of the cache, one per key at a time and
+             * never along with a get_or_load() of the same key.  An empty result deletes the entry; a
+             * failed refresh leaves it to expire.  Call once, before the cache is shared.
+             *
+             * @param loader called as loader(key) -> shared_ptr<T>
+             */
+            void refresh_with(std::function<shared_ptr<T>(const Key&)> loader){
+                this->refresher=loader;
+                for(unsigned int n=0; n<FASTCACHE_REFRESH_THREADS; n++) {
+                    this->refresh_threads.create_thread([this]() { this->refresh_loop(); });
+                }
+            };
+            /**
+             * Get several values, locking (or validating) each shard once
+             *
+             * Keys the miss filters (filter_misses()) rule out are not probed, as for get().  The whole call
+             * is one get latency sample.
+             *
+             * @param ids the keys
+             * @retval the values in the order of ids, empty pointers for nonexistent or expired keys
+             */
+            template <class K>
+            std::vector<shared_ptr<T> > multi_get(const std::vector<K>& ids){
+                LatencyTimer timer(this->get_latency);
+                std::vector<shared_ptr<T> > result(ids.size());
+                std::vector<size_t> hashes(ids.size());
+                for(size_t n=0; n<ids.size(); n++) {
+                    hashes[n]=this->hash(ids[n]);
+                }
+                std::vector<std::pair<size_t, size_t> > order=this->group(hashes);
+                // Filtered keys count as misses right away and leave the probe order
+                order.erase(std::remove_if(order.begin(), order.end(), [this, &hashes](const std::pair<size_t, size_t>& entry) {
+                    Shard<T>* shard=&this->shards[entry.first];
+                    if(!this->filtered(shard, hashes[entry.second])) {
+                        return false;
+                    }
+                    this->account(shard, NULL, hashes[entry.second]);
+                    return true;
+                }), order.end());
+                std::vector<CacheItem<T>*> found(ids.size());
+                // Cheap, and keeps optimistically found items allocated
+                EpochGuard guard;
+                for(size_t begin=0, end=0; begin<order.size(); begin=end) {
+                    Shard<T>* shard=&this->shards[order[begin].first];
+                    for(end=begin; end<order.size() && order[end].first==order[begin].first; end++) {
+                        shard->table.prefetch(hashes[order[end].second]);
+                    }
+                    if(this->readmode==FASTCACHE_READMODE_OPTIMISTIC) {
+                        bool valid=false;
+                        for(unsigned int attempt=0; attempt<FASTCACHE_OPTIMISTIC_RETRIES && !valid; attempt++) {
+                            uint64_t version=shard->read_begin();
+                            if(!(version & 1)) {
+                                for(size_t n=begin; n<end; n++) {
+                                    found[order[n].second]=shard->table.find(ids[order[n].second], hashes[order[n].second]);
+                                }
+                                valid=shard->read_validate(version);
+                            }
+                            if(!valid) {
+                                // Writer active or done meanwhile, as in find_pinned()
+                                shard->counters.contention.fetch_add(1, std::memory_order_relaxed);
+                            }
+                        }
+                        if(valid) {
+                            for(size_t n=begin; n<end; n++) {
+                                size_t pos=order[n].second;
+                                result[pos]=this->fetch(this->account(shard, found[pos], hashes[pos]));
+                            }
+                            continue;
+                        }
+                    }
+                    if(this->readmode==FASTCACHE_READMODE_EXCLUSIVE) {
+                        boost::unique_lock<boost::shared_mutex> lock(shard->guard);
+                        this->get_locked(shard, ids, hashes, order, begin, end, result);
+                    } else {
+                        boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                        this->get_locked(shard, ids, hashes, order, begin, end, result);
+                    }
+                }
+                return result;
+            };
+            /**
+             * Borrow a value from the cache without taking a reference
+             *
+             * @param id the key
+             * @retval the borrowed value, empty if nonexistent or expired
+             */
+            template <class K>
+            Borrowed borrow(const K& id){
+                return this->borrow(id, this->hash(id));
+            };
+            /**
+             * @param hash key_hash(id)
+             */
+            template <class K>
+            Borrowed borrow(const K& id, size_t hash){
+                if(this->readmode!=FASTCACHE_READMODE_OPTIMISTIC) {
+                    return Borrowed(this->get(id, hash));
+                }
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                Borrowed borrowed;
+                if(this->filtered(shard, hash)) {
+                    this->account(shard, NULL, hash);
+                    return borrowed;
+                }
+                CacheItem<T>* item=this->account(shard, this->find_pinned(shard, id, hash), hash);
+                if(item) {
+                    borrowed.data=item->get();
+                }
+                return borrowed;
+            };
+            /**
+             * Visit every live entry in place
+             *
+             * Nothing is copied: the visitor sees the stored key and value under the shard's shared lock, one
+             * shard at a time.  It must not write to the cache.
+             *
+             * @param visit called with (const Key&, const T&)
+             */
+            template <class F>
+            void for_each(F visit){
+                for(size_t n=0; n<=this->shard_mask; n++) {
+                    this->for_each_shard(n, visit);
+                }
+            };
+            /**
+             * Visit the live entries of one shard, see for_each()
+             *
+             * Lets callers spread a walk over threads.
+             *
+             * @param index the shard, below shard_count()
+             * @param visit called with (const Key&, const T&)
+             */
+            template <class F>
+            void for_each_shard(size_t index, F visit){
+                Shard<T>* shard=&this->shards[index];
+                boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                shard->table.for_each([&visit](CacheItem<T>* item) {
+                    StorageCache::visit_item(item, visit);
+                });
+            };
+            size_t shard_count() const {
+                return this->shard_mask + 1;
+            };
+            /**
+             * Start a batched walk
+             *
+             * @param batch entries visited per shard lock acquisition
+             */
+            Cursor cursor(size_t batch=FASTCACHE_CURSOR_BATCH){
+                return Cursor(this, batch);
+            };
+            /// [Custom] Added
+            /**
+             * Keys of the entries get() would return a value for
+             *
+             * Expired entries and empty ones (negative get_or_load() results) are left out.  Values loaded
+             * from a snapshot count without being parsed.
+             */
+            std::vector<Key> keySet() {
+                // Collect the shards in parallel, then join the per shard lists
+                std::vector<std::vector<Key> > parts(this->shard_mask + 1);
+                this->each_shard([this, &parts](size_t n) {
+                    Shard<T>* shard=&this->shards[n];
+                    std::vector<Key>& part=parts[n];
+                    // Lock
+                    boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                    part.reserve(shard->table.size());
+                    shard->table.for_each([&part](CacheItem<T>* item) {
+                        if(StorageCache::holds_value(item)) {
+                            part.push_back(item->key);
+                        }
+                    });
+                });
+                std::vector<Key> _keyset;
+                _keyset.reserve(joined_size(parts));
+                for(size_t n=0; n<parts.size(); n++) {
+                    std::move(parts[n].begin(), parts[n].end(), std::back_inserter(_keyset));
+                }
+                //std::stable_sort(_keyset.begin(), _keyset.end()); // <- Only for values which can be compared with < / >
+                return _keyset;
+            };
+            /**
+             * Copy out every live entry
+             *
+             * Shards are copied in parallel, each under its own shared lock.  Values are shared, not copied.
+             *
+             * @retval key/value pairs, grouped by shard
+             */
+            std::vector<std::pair<Key, shared_ptr<T> > > snapshot() {
+                std::vector<std::vector<std::pair<Key, shared_ptr<T> > > > parts(this->shard_mask + 1);
+                this->each_shard([this, &parts](size_t n) {
+                    Shard<T>* shard=&this->shards[n];
+                    std::vector<std::pair<Key, shared_ptr<T> > >& part=parts[n];
+                    boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                    part.reserve(shard->table.size());
+                    shard->table.for_each([&part](CacheItem<T>* item) {
+                        if(!item->expired()) {
+                            shared_ptr<T> value=item->share();
+                            if(value) {
+                                part.push_back(std::make_pair(item->key, value));
+                            }
+                        }
+                    });
+                });
+                std::vector<std::pair<Key, shared_ptr<T> > > entries;
+                entries.reserve(joined_size(parts));
+                for(size_t n=0; n<parts.size(); n++) {
+                    std::move(parts[n].begin(), parts[n].end(), std::back_inserter(entries));
+                }
+                return entries;
+            };
+            /**
+             * Write every live entry to a snapshot file
+             *
+             * Shards are serialized in parallel, a window (#FASTCACHE_SNAPSHOT_WINDOW) at a time, each under
+             * its shared lock; writers are only held up for their own shard.  The file is written next to
+             * path and renamed over it once complete and synced.  Entries keep their TTL settings.
+             *
+             * @param path the snapshot file
+             * @retval number of entries written
+             * @throws StorageSnapshotError if the file can't be written
+             */
+            size_t save_snapshot(const std::string& path){
+                size_t count=this->shard_mask + 1;
+                SnapshotWriter writer(path, count);
+                std::vector<std::vector<uint8_t> > sections(std::min<size_t>(count, FASTCACHE_SNAPSHOT_WINDOW));
+                std::vector<size_t> entries(sections.size());
+                size_t total=0;
+                for(size_t first=0; first<count; first+=sections.size()) {
+                    TaskPool::instance().parallel_for(sections.size(), [this, first, &sections, &entries](size_t n) {
+                        sections[n].clear();
+                        entries[n]=this->serialize_shard(&this->shards[first + n], sections[n]);
+                    });
+                    for(size_t n=0; n<sections.size(); n++) {
+                        writer.append(sections[n], entries[n]);
+                        total+=entries[n];
+                    }
+                }
+                writer.commit(CoarseClock::instance().to_unix_ms(CoarseClock::instance().now()));
+                return total;
+            };
+            /**
+             * Load a snapshot written by save_snapshot()
+             *
+             * The file is mapped, not read: keys are rebuilt (and hashed) right away, values stay in the
+             * mapping until first accessed.  Sections are loaded in parallel.  The snapshot may come from a
+             * cache with a different shard count.  Entries expired meanwhile are skipped.  With a weigher,
+             * values are materialized on load since their weight is needed.
+             *
+             * @param path the snapshot file
+             * @param mode the write mode, per entry
+             * @retval number of items written
+             * @throws StorageSnapshotError if the file can't be mapped or is damaged
+             */
+            size_t load_snapshot(const std::string& path, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                shared_ptr<SnapshotFile> file=boost::make_shared<SnapshotFile>(path);
+                std::vector<size_t> written(file->header().sections);
+                TaskPool::instance().parallel_for(written.size(), [this, &file, &written, mode](size_t n) {
+                    const SnapshotSection& section=file->section(n);
+                    std::vector<size_t> hashes;
+                    std::vector<CacheItem<T>*> items;
+                    hashes.reserve(section.entries);
+                    items.reserve(section.entries);
+                    int64_t now=CoarseClock::instance().now();
+                    uint64_t cursor=section.offset;
+                    SnapshotRecord record;
+                    const uint8_t* key;
+                    try {
+                        while(file->next(cursor, section.offset + section.size, record, key)) {
+                            int64_t expiration=0;
+                            if(record.expiration) {
+                                expiration=CoarseClock::instance().from_unix_ms(record.expiration);
+                                if(expiration <= now) {
+                                    continue;
+                                }
+                            }
+                            Key id=StorageSerializer<Key>::read(key, record.key_size);
+                            size_t hash=this->hash(id);
+                            hashes.push_back(hash);
+                            StorageTTL ttl(record.ttl, record.sliding!=0, record.refresh);
+                            items.push_back(this->adopt(boost::make_shared<MappedItem<T> >(id, hash, file, key + record.key_size, record.value_size, expiration, ttl)));
+                        }
+                    } catch(...) {
+                        release(items);
+                        throw;
+                    }
+                    written[n]=this->write_grouped(hashes, items, mode, false);
+                });
+                size_t total=0;
+                for(size_t n=0; n<written.size(); n++) {
+                    total+=written[n];
+                }
+                if(this->journal) {
+                    // Cheaper than logging every entry
+                    this->checkpoint();
+                }
+                return total;
+            };
+            /**
+             * Remove every item, all shards in parallel
+             *
+             * @retval the number of items removed
+             */
+            size_t clear() {
+                std::vector<size_t> removed(this->shard_mask + 1);
+                this->each_shard([this, &removed](size_t n) {
+                    Shard<T>* shard=&this->shards[n];
+                    std::vector<CacheItem<T>*> released;
+                    {    // Scope for lock
+                        ShardWriter writer(shard);
+                        removed[n]=shard->clear(released);
+                    }
+                    release(released);
+                });
+                size_t total=0;
+                for(size_t n=0; n<removed.size(); n++) {
+                    total+=removed[n];
+                }
+                if(this->journal) {
+                    this->checkpoint();
+                }
+                return total;
+            };
+            /**
+             * Make writes durable: log them to a directory and recover what it holds
+             *
+             * Loads the directory's snapshot, replays the logs written since (in parallel, a stripe per task)
+             * and logs every write from then on: set(), emplace(), multi_set(), del(), multi_del().  Expiry
+             * and eviction are not logged; expired records are dropped on replay and capacity applies again.
+             * TTL settings are logged with each write, so sliding and refresh-ahead entries recover as such;
+             * renewals by reads are not, so a sliding entry comes back with the deadline of its last write.
+             * clear() and load_snapshot() compact the journal instead of logging.  Needs StorageSerializer
+             * for Key and T.  Call before the cache is shared between threads.
+             *
+             * @param directory where logs and snapshots go, created if missing
+             * @param options when records reach the disk
+             * @retval number of entries after recovery
+             * @throws StorageJournalError, StorageSnapshotError if the directory or its files can't be used
+             */
+            size_t open_journal(const std::string& directory, const StorageJournalOptions& options=StorageJournalOptions()){
+                if(this->journal) {
+                    throw StorageJournalError("Journal already open");
+                }
+                shared_ptr<StorageJournal> journal=boost::make_shared<StorageJournal>(directory, options);
+                std::string snapshot=journal->recovery_snapshot();
+                if(!snapshot.empty()) {
+                    this->load_snapshot(snapshot);
+                }
+                // Generations in order; a key's records are all in one stripe of a generation
+                std::vector<std::vector<std::string> > logs=journal->recovery_logs();
+                for(size_t g=0; g<logs.size(); g++) {
+                    const std::vector<std::string>& files=logs[g];
+                    TaskPool::instance().parallel_for(files.size(), [this, &files](size_t n) {
+                        StorageJournal::replay(files[n], [this](const JournalRecord& record, const uint8_t* payload) {
+                            this->redo(record, payload);
+                        });
+                    });
+                }
+                this->log=&StorageCache::log_item;
+                this->journal=journal;
+                return this->metrics();
+            };
+            /**
+             * Compact the journal: snapshot the cache and remove the logs (and snapshots) it covers
+             *
+             * Writers go on meanwhile.  Call now and then to bound log size and recovery time.
+             *
+             * @retval number of entries in the snapshot
+             * @throws StorageJournalError, StorageSnapshotError if the files can't be written
+             */
+            size_t checkpoint(){
+                if(!this->journal) {
+                    throw StorageJournalError("No journal open");
+                }
+                return this->journal->compact([this](const std::string& path) {
+                    return this->save_snapshot(path);
+                });
+            };
+            /**
+             * Write and sync the journal now, whatever its policy
+             *
+             * @throws StorageJournalError if the log can't be written
+             */
+            void sync_journal(){
+                if(this->journal) {
+                    this->journal->sync();
+                }
+            };
+            /**
+             * Keys under a field path, in path order
+             *
+             * Needs an ordered index (e.g. PathKeyIndex).  Each shard is scanned under its shared lock and
+             * the ordered runs are merged, so the keys are not sorted (or even all visited) here.
+             *
+             * @param prefix the path, e.g. "48.61" for "48.61" and everything below it; "" for all keys
+             * @retval the keys, expired and empty entries left out as for keySet()
+             */
+            std::vector<Key> prefix_scan(std::string_view prefix){
+                static_assert(KeyIndex::ORDERED, "prefix_scan() needs an ordered key index");
+                std::vector<std::vector<typename KeyIndex::Ranked> > runs(this->shard_mask + 1);
+                this->each_shard([this, &runs, prefix](size_t n) {
+                    Shard<T>* shard=&this->shards[n];
+                    std::vector<typename KeyIndex::Ranked>& run=runs[n];
+                    boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                    shard->index.scan(prefix, [&run](uint64_t rank, CacheItem<T>* item) {
+                        if(StorageCache::holds_value(item)) {
+                            run.push_back(typename KeyIndex::Ranked(rank, item->key));
+                        }
+                    });
+                });
+                return KeyIndex::merge(runs);
+            };
+            /** All keys in path order, see prefix_scan() */
+            std::vector<Key> sorted_keys(){
+                return this->prefix_scan(std::string_view());
+            };
+            /// [Custom] Deleted
+
+        protected:
+            /** Allocate the item for a write, outside of any lock */
+            CacheItem<T>* make_item(const Key& id, size_t hash, shared_ptr<T>&& val, time_t expiration){
+                return this->adopt(boost::make_shared<CacheItem<T> >(id, hash, std::move(val), expiration));
+            };
+            /** Hand a new item over to the table's reference and weigh it */
+            template <class I>
+            CacheItem<T>* adopt(const shared_ptr<I>& allocated){
+                CacheItem<T>* item=allocated.get();
+                item->self=allocated;
+                T* value=this->weigher?item->get():NULL;
+                if(value) {
+                    item->weight=(uint32_t)this->weigher(item->key, *value);
+                }
+                return item;
+            };
+            /** Write one item, releasing whatever it displaced outside of the lock */
+            size_t write(Shard<T>* shard, CacheItem<T>* item, const fastcache_writemode mode){
+                Released released;
+                size_t written;
+                size_t hash=item->hash;
+                uint64_t sequence=0;
+                {    // Scope for lock
+                    // Lock and write
+                    ShardWriter writer(shard);
+                    #ifdef FASTCACHE_SLOW
+                    sleep(1);
+                    #endif
+                    written=shard->write(item, mode, released);
+                    if(written && this->journal) {
+                        sequence=this->log(*this->journal, item, false);
+                    }
+                }
+                release(released);
+                this->commit(hash, sequence);
+                return written;
+            };
+            /**
+             * Write a batch of items, locking each shard once
+             *
+             * @param hashes hashes of the items' keys
+             * @param items the new items
+             * @param mode the write mode
+             * @param logged journal the written items (if a journal is open)
+             * @retval number of items written
+             */
+            size_t write_grouped(const std::vector<size_t>& hashes, const std::vector<CacheItem<T>*>& items, const fastcache_writemode mode,
+                                 bool logged=true){
+                StorageJournal* journal=logged?this->journal.get():NULL;
+                std::vector<std::pair<size_t, size_t> > order=this->group(hashes);
+                Released released;
+                size_t written=0;
+                size_t next=0;      // Items from here on are not in the table yet
+                try {
+                    for(size_t begin=0, end=0; begin<order.size(); begin=end) {
+                        Shard<T>* shard=&this->shards[order[begin].first];
+                        for(end=begin; end<order.size() && order[end].first==order[begin].first; end++) {
+                            shard->table.prefetch(hashes[order[end].second]);
+                        }
+                        {    // Scope for lock
+                            ShardWriter writer(shard);
+                            for(size_t n=begin; n<end; n++) {
+                                CacheItem<T>* item=items[order[n].second];
+                                next=n + 1;
+                                if(shard->write(item, mode, released)) {
+                                    ++written;
+                                    if(journal) {
+                                        this->log(*journal, item, false);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                } catch(...) {
+                    for(; next<order.size(); next++) {
+                        released.push_back(items[order[next].second]);
+                    }
+                    throw;
+                }
+                release(released);
+                if(written && journal && journal->synchronous()) {
+                    journal->commit_all();
+                }
+                return written;
+            };
+            /**
+             * Decide on a write and do it in one write lock acquisition
+             *
+             * @param id the key
+             * @param make called under the lock as make(live item or NULL, hash) -> the item to write, NULL for none
+             * @param version set to the written item's version, unless NULL
+             * @retval number of items written
+             */
+            template <class F>
+            size_t write_locked(const Key& id, F make, uint64_t* version=NULL){
+                LatencyTimer timer(this->set_latency);
+                size_t hash=this->hash(id);
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                Released released;
+                size_t written=0;
+                uint64_t sequence=0;
+                {    // Scope for lock
+                    ShardWriter writer(shard);
+                    CacheItem<T>* current=shard->table.find(id, hash);
+                    CacheItem<T>* item=make((current && !current->expired())?current:NULL, hash);
+                    if(item) {
+                        written=shard->write(item, FASTCACHE_WRITEMODE_WRITE_ALWAYS, released);
+                        if(version) {
+                            *version=item->version;
+                        }
+                        if(this->journal) {
+                            sequence=this->log(*this->journal, item, false);
+                        }
+                    }
+                }
+                release(released);
+                this->commit(hash, sequence);
+                return written;
+            };
+            /**
+             * Append a write to the journal.  Call under the shard lock, right where it is applied.
+             *
+             * @param journal the journal
+             * @param item the item written, or erased
+             * @param erased log a deletion of the item's key
+             * @retval the record's sequence, see commit()
+             */
+            static uint64_t log_item(StorageJournal& journal, const CacheItem<T>* item, bool erased){
+                size_t key_size=StorageSerializer<Key>::size(item->key);
+                const T* value=erased?NULL:item->get();
+                size_t value_size=value?StorageSerializer<T>::size(*value):0;
+                JournalRecord record;
+                std::memset(&record, 0, sizeof(record));
+                record.op=erased?JournalRecord::DEL:(value?JournalRecord::SET:JournalRecord::SET_EMPTY);
+                record.size=(uint32_t)(key_size + value_size);
+                record.key_size=(uint32_t)key_size;
+                if(!erased) {
+                    int64_t due=item->due();
+                    record.expiration=due?CoarseClock::instance().to_unix_ms(due):0;
+                    record.ttl=item->ttl;
+                    record.sliding=item->sliding;
+                    record.refresh=item->refresh;
+                }
+                return journal.append(journal.stripe(item->hash), record, [item, value, key_size](uint8_t* out) {
+                    StorageSerializer<Key>::write(item->key, out);
+                    if(value) {
+                        StorageSerializer<T>::write(*value, out + key_size);
+                    }
+                });
+            };
+            /** Wait for a logged write to be durable if the journal asks for it */
+            void commit(size_t hash, uint64_t sequence){
+                if(sequence && this->journal->synchronous()) {
+                    this->journal->commit(this->journal->stripe(hash), sequence);
+                }
+            };
+            /** Apply a journal record during recovery */
+            void redo(const JournalRecord& record, const uint8_t* payload){
+                Key id=StorageSerializer<Key>::read(payload, record.key_size);
+                size_t hash=this->hash(id);
+                int64_t expiration=record.expiration?CoarseClock::instance().from_unix_ms(record.expiration):0;
+                if(record.op==JournalRecord::DEL || (record.expiration && expiration <= CoarseClock::instance().now())) {
+                    // Expired since: drops what earlier records set, too
+                    this->del(id, hash);
+                    return;
+                }
+                shared_ptr<T> value;
+                if(record.op==JournalRecord::SET) {
+                    value=boost::make_shared<T>(StorageSerializer<T>::read(payload + record.key_size, record.size - record.key_size));
+                }
+                CacheItem<T>* item=this->make_item(id, hash, std::move(value), 0);
+                item->expire_at(expiration, StorageTTL(record.ttl, record.sliding!=0, record.refresh));
+                this->write(&this->shards[this->calc_index(hash)], item, FASTCACHE_WRITEMODE_WRITE_ALWAYS);
+            };
+            /** Serialize the live entries of a shard into a snapshot section */
+            size_t serialize_shard(Shard<T>* shard, std::vector<uint8_t>& records){
+                size_t count=0;
+                boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                shard->table.for_each([&records, &count](CacheItem<T>* item) {
+                    if(item->expired()) {
+                        return;
+                    }
+                    // Values nobody asked for since the last load are copied over as they are
+                    size_t size=0;
+                    const uint8_t* image=item->mapped?static_cast<const MappedItem<T>*>(item)->unparsed(size):NULL;
+                    const T* value=image?NULL:item->get();
+                    if(!image && !value) {
+                        return;
+                    }
+                    if(value) {
+                        size=StorageSerializer<T>::size(*value);
+                    }
+                    size_t key_size=StorageSerializer<Key>::size(item->key);
+                    int64_t due=item->due();
+                    SnapshotRecord record;
+                    std::memset(&record, 0, sizeof(record));
+                    record.key_size=(uint32_t)key_size;
+                    record.value_size=(uint32_t)size;
+                    record.expiration=due?CoarseClock::instance().to_unix_ms(due):0;
+                    record.ttl=item->ttl;
+                    record.sliding=item->sliding;
+                    record.refresh=item->refresh;
+                    uint8_t* out=SnapshotRecord::append(records, record);
+                    StorageSerializer<Key>::write(item->key, out);
+                    if(value) {
+                        StorageSerializer<T>::write(*value, out + key_size);
+                    } else if(size) {
+                        std::memcpy(out + key_size, image, size);
+                    }
+                    ++count;
+                });
+                return count;
+            };
+            /** Drop items that left the table, once unlocked */
+            static void release(std::vector<CacheItem<T>*>& released){
+                for(size_t n=0; n<released.size(); n++) {
+                    CacheItem<T>::drop(released[n]);
+                }
+                released.clear();
+            };
+            /** Run fn(shard index) for every shard on the task pool */
+            template <class F>
+            void each_shard(F fn){
+                TaskPool::instance().parallel_for(this->shard_mask + 1, fn);
+            };
+            /** Total size of per shard results */
+            template <class V>
+            static size_t joined_size(const std::vector<V>& parts){
+                size_t total=0;
+                for(size_t n=0; n<parts.size(); n++) {
+                    total+=parts[n].size();
+                }
+                return total;
+            };
+            /** Would get() find a value?  Mapped values are not parsed to tell. */
+            static bool holds_value(const CacheItem<T>* item){
+                return !item->expired() && (item->mapped || item->get());
+            };
+            /** Hand an entry to a visitor unless it is expired or empty */
+            template <class F>
+            static void visit_item(const CacheItem<T>* item, F& visit){
+                if(item->expired()) {
+                    return;
+                }
+                const T* value=item->get();
+                if(value) {
+                    visit(item->key, *value);
+                }
+            };
+            /**
+             * Order the positions of a batch by shard
+             *
+             * @param hashes hashes of the batch's keys
+             * @retval (shard index, position) pairs, grouped by shard
+             */
+            std::vector<std::pair<size_t, size_t> > group(const std::vector<size_t>& hashes){
+                std::vector<std::pair<size_t, size_t> > order(hashes.size());
+                for(size_t n=0; n<hashes.size(); n++) {
+                    order[n]=std::make_pair(this->calc_index(hashes[n]), n);
+                }
+                std::sort(order.begin(), order.end());
+                return order;
+            };
+            /** multi_get() of one shard group, with the shard lock held */
+            template <class K>
+            void get_locked(Shard<T>* shard, const std::vector<K>& ids, const std::vector<size_t>& hashes,
+                            const std::vector<std::pair<size_t, size_t> >& order, size_t begin, size_t end,
+                            std::vector<shared_ptr<T> >& result){
+                for(size_t n=begin; n<end; n++) {
+                    size_t pos=order[n].second;
+                    result[pos]=this->fetch(this->account(shard, shard->table.find(ids[pos], hashes[pos]), hashes[pos]));
+                }
+            };
+            /**
+             * get_or_load() for either kind of expiration
+             *
+             * @param cache_negative cache an empty result (with negative)
+             */
+            template <class F, class E>
+            shared_ptr<T> load_once(const Key& id, F& loader, const E& expiration, const E& negative, bool cache_negative){
+                size_t hash=this->hash(id);
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                bool found;
+                shared_ptr<T> value;
+                shared_ptr<Flight> flight;
+                for(bool leader=false; !leader;) {
+                    value=this->lookup(id, hash, found);
+                    if(found) {
+                        return value;
+                    }
+                    flight=this->board(shard, id, hash, leader);
+                    if(!leader && flight->wait(value)) {
+                        return value;
+                    }
+                }
+                std::exception_ptr error;
+                try {
+                    // A load that finished after our miss left its flight, but its result is in the cache by now
+                    value=this->lookup(id, hash, found);
+                    if(!found) {
+                        value=loader();
+                        if(value || cache_negative) {
+                            this->set(id, value, value?expiration:negative);
+                        }
+                    }
+                } catch(...) {
+                    error=std::current_exception();
+                }
+                this->land(shard, flight, value, error);
+                if(error) {
+                    std::rethrow_exception(error);
+                }
+                return value;
+            };
+            /**
+             * Join the load of a key in progress, or start one
+             *
+             * @param leader set to true if the caller is to load, and land() the flight when done
+             * @retval the key's flight
+             */
+            shared_ptr<Flight> board(Shard<T>* shard, const Key& id, size_t hash, bool& leader){
+                boost::lock_guard<boost::mutex> lock(shard->flights_guard);
+                for(size_t n=0; n<shard->flights.size(); n++) {
+                    if(shard->flights[n]->hash==hash && shard->flights[n]->key==id) {
+                        leader=false;
+                        return shard->flights[n];
+                    }
+                }
+                leader=true;
+                shard->flights.push_back(boost::make_shared<Flight>(id, hash));
+                return shard->flights.back();
+            };
+            /** End a load started by board(), waking its waiters */
+            static void land(Shard<T>* shard, const shared_ptr<Flight>& flight, const shared_ptr<T>& value, std::exception_ptr error){
+                unboard(shard, flight);
+                flight->finish(value, error);
+            };
+            /** End a load started by board() without a result, see Flight::abandon() */
+            static void abandon(Shard<T>* shard, const shared_ptr<Flight>& flight){
+                unboard(shard, flight);
+                flight->abandon();
+            };
+            /** Take a flight off its shard's list, so later misses start a new one */
+            static void unboard(Shard<T>* shard, const shared_ptr<Flight>& flight){
+                boost::lock_guard<boost::mutex> lock(shard->flights_guard);
+                shard->flights.erase(std::find(shard->flights.begin(), shard->flights.end(), flight));
+            };
+            /**
+             * Renew a sliding entry read just now, and queue its refresh once it is due for one
+             *
+             * @param item the item, found live.  Still in the table or retired but pinned.
+             */
+            void renew(CacheItem<T>* item){
+                int64_t now=CoarseClock::instance().now();
+                if(item->sliding && now + item->ttl > item->renewed.load(std::memory_order_relaxed)) {
+                    item->renewed.store(now + item->ttl, std::memory_order_relaxed);
+                }
+                if(!item->refresh || !this->refresher || item->refreshing.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                if((item->due() - now) * 100 > item->ttl * item->refresh || item->refreshing.exchange(true)) {
+                    return;
+                }
+                Refresh refresh={item->key, item->hash, item->settings()};
+                {    // Scope for lock
+                    boost::lock_guard<boost::mutex> lock(this->refresh_guard);
+                    this->refreshes.push_back(refresh);
+                }
+                this->refresh_ready.notify_one();
+            };
+            /** A refresher thread */
+            void refresh_loop(){
+                try {
+                    while(true) {
+                        Refresh refresh;
+                        {    // Scope for lock
+                            boost::unique_lock<boost::mutex> lock(this->refresh_guard);
+                            while(this->refreshes.empty()) {
+                                this->refresh_ready.wait(lock);
+                            }
+                            refresh=this->refreshes.front();
+                            this->refreshes.pop_front();
+                        }
+                        this->refresh(refresh);
+                    }
+                } catch(boost::thread_interrupted& e) {
+                    // We were asked to leave
+                }
+            };
+            /**
+             * Load a new value for a refresh-ahead entry, unless its key is being loaded already
+             *
+             * get_or_load() callers missing meanwhile wait on the refresh.  If it fails they are not handed
+             * the refresher's error: the flight is abandoned and they look again, finding the current value
+             * while it lasts or loading the key themselves.
+             */
+            void refresh(const Refresh& refresh){
+                Shard<T>* shard=&this->shards[this->calc_index(refresh.hash)];
+                bool leader;
+                shared_ptr<Flight> flight=this->board(shard, refresh.key, refresh.hash, leader);
+                if(!leader) {
+                    return;
+                }
+                shared_ptr<T> value;
+                try {
+                    value=this->refresher(refresh.key);
+                    if(value) {
+                        this->set(refresh.key, value, refresh.ttl);
+                    } else {
+                        this->del(refresh.key, refresh.hash);
+                    }
+                } catch(boost::thread_interrupted& e) {
+                    this->abandon(shard, flight);
+                    throw;
+                } catch(...) {
+                    // The entry just expires as usual
+                    this->abandon(shard, flight);
+                    return;
+                }
+                this->land(shard, flight, value, std::exception_ptr());
+            };
+            /**
+             * get() without the timing
+             *
+             * @param id the key
+             * @param hash key_hash(id)
+             * @param found set to whether a live entry was found, even one holding no value
+             * @param version set to the entry's version (0 if none found), unless NULL
+             * @retval the data, empty if not found, expired or empty
+             */
+            template <class K>
+            shared_ptr<T> lookup(const K& id, size_t hash, bool& found, uint64_t* version=NULL){
+                return this->find_live(id, hash, [this, &found, version](CacheItem<T>* item) {
+                    found=(item!=NULL);
+                    if(version) {
+                        *version=item?item->version:0;
+                    }
+                    return this->fetch(item);
+                });
+            };
+            /**
+             * Find a key and hand the item to a continuation, in the protection of the read mode
+             *
+             * @param id the key
+             * @param hash key_hash(id)
+             * @param deliver called as deliver(item) with the live item, NULL if not found or expired
+             * @retval what deliver returned
+             */
+            template <class K, class D>
+            auto find_live(const K& id, size_t hash, D deliver) -> decltype(deliver(NULL)) {
+                // Get shard
+                Shard<T>* shard=&this->shards[this->calc_index(hash)];
+                if(this->filtered(shard, hash)) {
+                    return deliver(this->account(shard, NULL, hash));
+                }
+                if(this->readmode==FASTCACHE_READMODE_OPTIMISTIC) {
+                    // Items found without a lock stay allocated while we are pinned
+                    EpochGuard guard;
+                    return deliver(this->account(shard, this->find_pinned(shard, id, hash), hash));
+                }
+                if(this->readmode==FASTCACHE_READMODE_SHARED) {
+                    boost::shared_lock<boost::shared_mutex> lock(shard->guard, boost::try_to_lock);
+                    this->acquire(shard, lock);
+                    #ifdef FASTCACHE_SLOW
+                    sleep(1);
+                    #endif
+                    return deliver(this->account(shard, shard->table.find(id, hash), hash));
+                }
+                // Lock
+                boost::unique_lock<boost::shared_mutex> lock(shard->guard, boost::try_to_lock);
+                this->acquire(shard, lock);
+                // Delay if in slow mode...
+                #ifdef FASTCACHE_SLOW
+                sleep(1);
+                #endif
+                // OK, we now have exclusive access to the shard.  So no race condition is possible for the affections of this item...
+                return deliver(this->account(shard, shard->table.find(id, hash), hash));
+            };
+            /**
+             * Is the key certainly not in the shard?  Asks the shard's filter (if any) without a lock.
+             *
+             * @param shard the key's shard
+             * @param hash the hash of the key
+             */
+            bool filtered(Shard<T>* shard, size_t hash){
+                if(!shard->filter.load(std::memory_order_relaxed)) {
+                    return false;
+                }
+                // The shard may replace its filter meanwhile
+                EpochGuard guard;
+                const MissFilter* filter=shard->filter.load(std::memory_order_acquire);
+                return filter && !filter->may_contain(hash);
+            };
+            /**
+             * Optimistic lookup
+             *
+             * The caller must be pinned (EpochGuard); the returned item stays allocated until it unpins.
+             *
+             * @param shard the key's shard
+             * @param id the key
+             * @param hash the hash of the key
+             * @retval the item, NULL if not found
+             */
+            template <class K>
+            CacheItem<T>* find_pinned(Shard<T>* shard, const K& id, size_t hash){
+                for(unsigned int attempt=0; attempt<FASTCACHE_OPTIMISTIC_RETRIES; attempt++) {
+                    uint64_t version=shard->read_begin();
+                    if(!(version & 1)) {
+                        CacheItem<T>* item=shard->table.find(id, hash);
+                        if(shard->read_validate(version)) {
+                            return item;
+                        }
+                    }
+                    // Writer active or done meanwhile
+                    shard->counters.contention.fetch_add(1, std::memory_order_relaxed);
+                }
+                // Too busy, queue up behind the writers
+                boost::shared_lock<boost::shared_mutex> lock(shard->guard);
+                return shard->table.find(id, hash);
+            };
+            /** Complete a try_to_lock lock, counting the wait */
+            template <class Lock>
+            static void acquire(Shard<T>* shard, Lock& lock){
+                if(!lock.owns_lock()) {
+                    shard->counters.contention.fetch_add(1, std::memory_order_relaxed);
+                    lock.lock();
+                }
+            };
+            /**
+             * Count a lookup as hit or miss and tell the eviction policy
+             *
+             * @param shard the key's shard
+             * @param item the item found, NULL if none
+             * @param hash the hash of the key
+             * @retval the item, NULL if not found or expired
+             */
+            CacheItem<T>* account(Shard<T>* shard, CacheItem<T>* item, size_t hash){
+                if(!item || item->expired()) {
+                    shard->counters.misses.fetch_add(1, std::memory_order_relaxed);
+                    shard->policy.record(hash);
+                    return NULL;
+                }
+                shard->counters.hits.fetch_add(1, std::memory_order_relaxed);
+                shard->policy.touch(item);
+                if(item->ttl) {
+                    this->renew(item);
+                }
+                return item;
+            };
+            /**
+             * Hand out the data of a found item
+             *
+             * @param item the item, NULL if not found or expired
+             * @retval the data, empty if not found or expired
+             */
+            shared_ptr<T> fetch(CacheItem<T>* item){
+                if(!item) {
+                    return shared_ptr<T>();
+                }
+                return item->share();
+            };
+            /**
+             * We are the curator
+             *
+             * Purge expired keys, etc
+             */
+            void curate(){
+                while(*this->curator_run) {
                     try {
                         // Snooze a little
                         boost::this_thread::sleep(boost::posix_time::milliseconds(FASTCACHE_CURATOR_SLEEP_MS));
-                        // Iterate all objects in cache, checking for expired objects
-                        for(typename std::vector<shared_ptr<Shard<T> > >::iterator it=this->shards.begin(); it != this->shards.end(); ++it) {
-                            shared_ptr<Shard<T> >shard=*it;
-                            {    // Scope for lock
-                                mutex::scoped_lock lock(*shard->guard);
-                                // Cull expired keys
-                                shard->cull_expired_keys();
+                        // Visit the shards with due items only (in parallel), a bounded batch per lock acquisition
+                        int64_t now=CoarseClock::instance().now();
+                        this->each_shard([this, now](size_t n) {
+                            Shard<T>* shard=&this->shards[n];
+                            std::vector<CacheItem<T>*> released;
+                            bool more=(shard->next_deadline.load(std::memory_order_relaxed) <= now);
+                            while(more) {
+                                {    // Scope for lock
+                                    ShardWriter writer(shard);
+                                    // Cull expired keys
+                                    more=shard->cull_expired_keys(now, FASTCACHE_CURATOR_BATCH, released);
+                                }
+                                release(released);
                             }
-                        }
+                        });
+                        boost::this_thread::interruption_point();
                     } catch(boost::thread_interrupted& e) {
                         // We were asked to leave?
                         return;
@@ -342,12 +2317,13 @@ namespace Storage {
              *
              * It is important that this function has a repeatable but otherwise randomish (uniform) output
              * We use the boost hash, "a TR1 compliant hash function object"
+             * The shard count is a power of two, so this is a mask rather than a division.
              *
-             * @param id 
+             * @param hash the hash of the key
              */
-            size_t calc_index(Key id){
-                //printf("[Debug] Hash : %llu\n", (size_t)this->hash(id));
-                return (size_t) this->hash(id) % FASTCACHE_SHARDSIZE;
+            size_t calc_index(size_t hash){
+                //printf("[Debug] Hash : %llu\n", hash);
+                return hash & this->shard_mask;
             };
     };
 };
@@ -0,0 +1,129 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageClock.hpp - Coarse monotonic clock for expiration checks
+#ifndef _STORAGEAPI_STORAGECLOCK_H_
+#define _STORAGEAPI_STORAGECLOCK_H_
+#include <boost/thread.hpp>
+#include <stdint.h>
+#include <atomic>
+/** >>--- OS macros ---<<
+ * Linux and Linux-derived           __linux__
+ * Android                           __ANDROID__ (implies __linux__)
+ * Linux (non-Android)               __linux__ && !__ANDROID__
+ * Darwin (Mac OS X and iOS)         __APPLE__
+ * Akaros (http://akaros.org)        __ros__
+ * Windows                           _WIN32
+ * Windows 64 bit                    _WIN64 (implies _WIN32)
+ * NaCL                              __native_client__
+ * AsmJS                             __asmjs__
+ * Fuschia                           __Fuchsia__
+ */
+/** >>--- Compiler macros ---<<
+ * Visual Studio       _MSC_VER
+ * gcc                 __GNUC__
+ * clang               __clang__
+ * emscripten          __EMSCRIPTEN__ (for asm.js and webassembly)
+ * MinGW 32            __MINGW32__
+ * MinGW-w64 32bit     __MINGW32__
+ * MinGW-w64 64bit     __MINGW64__
+ */
+#if defined(__MINGW32__)
+    #include <pthread_time.h>
+#elif defined(__GNUC__) && (defined(__linux__) && !defined(__ANDROID__))
+    #include <time.h>
+#elif defined(_MSC_VER) && defined(_WIN64)
+    #include <windows.h>
+    struct timespec { long tv_sec; long tv_nsec; };
+    int clock_gettime(int, struct timespec *spec) {
+        __int64 wintime; GetSystemTimeAsFileTime((FILETIME*)&wintime);
+        wintime      -=116444736000000000i64;  //1jan1601 to 1jan1970
+        spec->tv_sec  =wintime / 10000000i64;           //seconds
+        spec->tv_nsec =wintime % 10000000i64 *100;      //nano-seconds
+        return 0;
+    }
+#else
+    #include <time.h>
+#endif
+#ifndef CLOCK_MONOTONIC
+    #define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
+/// [Definitions]
+// Tick of the coarse clock.  Expiration checks are at most this late.
+#ifndef FASTCACHE_CLOCK_TICK_MS
+#define FASTCACHE_CLOCK_TICK_MS 4u
+#endif
+
+namespace Storage {
+    /**
+     * CoarseClock
+     * Process wide millisecond clock, refreshed by a background tick.
+     *
+     * now() is one relaxed atomic load.  It counts on a monotonic base, so stepping the
+     * wall clock (NTP, operator) does not move deadlines that were already converted.
+     * Absolute UNIX timestamps are converted with the wall clock sampled at the same tick.
+     */
+    class CoarseClock {
+        public:
+            /** The clock.  Never destroyed, its tick thread runs until the process exits. */
+            static CoarseClock& instance() {
+                static CoarseClock* clock=new CoarseClock();
+                return *clock;
+            };
+            /**
+             * Monotonic milliseconds, at most FASTCACHE_CLOCK_TICK_MS old
+             *
+             * @retval ms on the monotonic base
+             */
+            int64_t now() const {
+                return this->monotonic_ms.load(std::memory_order_relaxed);
+            };
+            /**
+             * Convert a UNIX time to the monotonic base
+             *
+             * @param unix_ms milliseconds since 1970
+             * @retval ms on the monotonic base
+             */
+            int64_t from_unix_ms(int64_t unix_ms) const {
+                return unix_ms - this->offset_ms.load(std::memory_order_relaxed);
+            };
+            /**
+             * Convert back to UNIX time
+             *
+             * @param monotonic_ms ms on the monotonic base
+             * @retval milliseconds since 1970
+             */
+            int64_t to_unix_ms(int64_t monotonic_ms) const {
+                return monotonic_ms + this->offset_ms.load(std::memory_order_relaxed);
+            };
+
+        private:
+            CoarseClock() {
+                this->tick();
+                boost::thread ticker(&CoarseClock::run, this);
+                ticker.detach();
+            };
+            static int64_t read_ms(int clock) {
+                struct timespec time;
+                clock_gettime(clock, &time);
+                return (int64_t)time.tv_sec * 1000 + time.tv_nsec / 1000000;
+            };
+            void tick() {
+                int64_t monotonic=read_ms(CLOCK_MONOTONIC);
+                this->offset_ms.store(read_ms(CLOCK_REALTIME) - monotonic, std::memory_order_relaxed);
+                this->monotonic_ms.store(monotonic, std::memory_order_relaxed);
+            };
+            void run() {
+                while(true) {
+                    boost::this_thread::sleep(boost::posix_time::milliseconds(FASTCACHE_CLOCK_TICK_MS));
+                    this->tick();
+                }
+            };
+
+            std::atomic<int64_t> monotonic_ms;
+            std::atomic<int64_t> offset_ms;     // UNIX ms - monotonic ms
+    };
+};
+#endif
@@ -0,0 +1,302 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageCodec.hpp - Hex and EBCDIC codecs for field values (SSE2/AVX2 with scalar fallback)
+#ifndef _STORAGEAPI_STORAGECODEC_H_
+#define _STORAGEAPI_STORAGECODEC_H_
+#include <stdint.h>
+#include <cstddef>
+
+/// [Definitions]
+// Vector kernels need GCC style target attributes; define FASTCACHE_CODEC_SCALAR to leave them out
+#if !defined(FASTCACHE_CODEC_SCALAR) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FASTCACHE_CODEC_X86
+#include <immintrin.h>
+#endif
+
+namespace Storage {
+    /**
+     * Value of an upper case hex digit
+     *
+     * @retval 0-15, -1 for anything else
+     */
+    inline int fastcache_hex_digit(char c) {
+        if(c >= '0' && c <= '9') {
+            return c - '0';
+        }
+        if(c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    };
+    /** Reference hex decoder, see fastcache_hex_decode() */
+    inline bool fastcache_hex_decode_scalar(const char* text, size_t length, uint8_t* out) {
+        if(length & 1) {
+            return false;
+        }
+        for(size_t n=0; n<length; n+=2) {
+            int high=fastcache_hex_digit(text[n]);
+            int low=fastcache_hex_digit(text[n + 1]);
+            if((high | low) < 0) {
+                return false;
+            }
+            out[n / 2]=(uint8_t)((high << 4) | low);
+        }
+        return true;
+    };
+    /** Reference hex encoder, see fastcache_hex_encode() */
+    inline void fastcache_hex_encode_scalar(const uint8_t* bytes, size_t length, char* out) {
+        static const char digits[]="0123456789ABCDEF";
+        for(size_t n=0; n<length; n++) {
+            out[2 * n]=digits[bytes[n] >> 4];
+            out[2 * n + 1]=digits[bytes[n] & 0x0F];
+        }
+    };
+    /** Reference byte translation, see fastcache_ebcdic_to_ascii() */
+    inline void fastcache_translate_scalar(const uint8_t* table, const uint8_t* in, size_t length, uint8_t* out) {
+        for(size_t n=0; n<length; n++) {
+            out[n]=table[in[n]];
+        }
+    };
+
+    /**
+     * CodePage
+     * EBCDIC code page 037 and its inverse, both as 256 byte translation tables (to ISO-8859-1).
+     */
+    struct CodePage {
+        static const uint8_t* ebcdic_to_ascii() {
+            static const uint8_t table[256]={
+                0x00, 0x01, 0x02, 0x03, 0x9C, 0x09, 0x86, 0x7F, 0x97, 0x8D, 0x8E, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+                0x10, 0x11, 0x12, 0x13, 0x9D, 0x85, 0x08, 0x87, 0x18, 0x19, 0x92, 0x8F, 0x1C, 0x1D, 0x1E, 0x1F,
+                0x80, 0x81, 0x82, 0x83, 0x84, 0x0A, 0x17, 0x1B, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x05, 0x06, 0x07,
+                0x90, 0x91, 0x16, 0x93, 0x94, 0x95, 0x96, 0x04, 0x98, 0x99, 0x9A, 0x9B, 0x14, 0x15, 0x9E, 0x1A,
+                0x20, 0xA0, 0xE2, 0xE4, 0xE0, 0xE1, 0xE3, 0xE5, 0xE7, 0xF1, 0xA2, 0x2E, 0x3C, 0x28, 0x2B, 0x7C,
+                0x26, 0xE9, 0xEA, 0xEB, 0xE8, 0xED, 0xEE, 0xEF, 0xEC, 0xDF, 0x21, 0x24, 0x2A, 0x29, 0x3B, 0xAC,
+                0x2D, 0x2F, 0xC2, 0xC4, 0xC0, 0xC1, 0xC3, 0xC5, 0xC7, 0xD1, 0xA6, 0x2C, 0x25, 0x5F, 0x3E, 0x3F,
+                0xF8, 0xC9, 0xCA, 0xCB, 0xC8, 0xCD, 0xCE, 0xCF, 0xCC, 0x60, 0x3A, 0x23, 0x40, 0x27, 0x3D, 0x22,
+                0xD8, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0xAB, 0xBB, 0xF0, 0xFD, 0xFE, 0xB1,
+                0xB0, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F, 0x70, 0x71, 0x72, 0xAA, 0xBA, 0xE6, 0xB8, 0xC6, 0xA4,
+                0xB5, 0x7E, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0xA1, 0xBF, 0xD0, 0xDD, 0xDE, 0xAE,
+                0x5E, 0xA3, 0xA5, 0xB7, 0xA9, 0xA7, 0xB6, 0xBC, 0xBD, 0xBE, 0x5B, 0x5D, 0xAF, 0xA8, 0xB4, 0xD7,
+                0x7B, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0xAD, 0xF4, 0xF6, 0xF2, 0xF3, 0xF5,
+                0x7D, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F, 0x50, 0x51, 0x52, 0xB9, 0xFB, 0xFC, 0xF9, 0xFA, 0xFF,
+                0x5C, 0xF7, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0xB2, 0xD4, 0xD6, 0xD2, 0xD3, 0xD5,
+                0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0xB3, 0xDB, 0xDC, 0xD9, 0xDA, 0x9F
+            };
+            return table;
+        };
+        static const uint8_t* ascii_to_ebcdic() {
+            struct Inverse {
+                Inverse() {
+                    for(unsigned int n=0; n<256; n++) {
+                        this->table[ebcdic_to_ascii()[n]]=(uint8_t)n;
+                    }
+                };
+                uint8_t table[256];
+            };
+            static const Inverse inverse;
+            return inverse.table;
+        };
+    };
+
+    #ifdef FASTCACHE_CODEC_X86
+    /** 16 hex digits of a vector to their values; false if one is not an upper case hex digit */
+    __attribute__((target("sse2")))
+    inline bool fastcache_hex_nibbles_sse2(__m128i text, __m128i& nibbles) {
+        __m128i digit=_mm_sub_epi8(text, _mm_set1_epi8('0'));
+        __m128i letter=_mm_sub_epi8(text, _mm_set1_epi8('A'));
+        __m128i is_digit=_mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+        __m128i is_letter=_mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+        if(_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter))!=0xFFFF) {
+            return false;
+        }
+        nibbles=_mm_or_si128(_mm_and_si128(is_digit, digit),
+                             _mm_andnot_si128(is_digit, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+        return true;
+    };
+    /** Nibbles to ASCII hex digits */
+    __attribute__((target("sse2")))
+    inline __m128i fastcache_hex_digits_sse2(__m128i nibbles) {
+        __m128i letters=_mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('A' - '0' - 10));
+        return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+    };
+    __attribute__((target("sse2")))
+    inline bool fastcache_hex_decode_sse2(const char* text, size_t length, uint8_t* out) {
+        if(length & 1) {
+            return false;
+        }
+        size_t n=0;
+        for(; n + 16 <= length; n+=16) {
+            __m128i nibbles;
+            if(!fastcache_hex_nibbles_sse2(_mm_loadu_si128((const __m128i*)(text + n)), nibbles)) {
+                return false;
+            }
+            // Per 16 bit lane: (even << 4) | odd in the low byte
+            __m128i pairs=_mm_or_si128(_mm_slli_epi16(nibbles, 4), _mm_srli_epi16(nibbles, 8));
+            pairs=_mm_and_si128(pairs, _mm_set1_epi16(0x00FF));
+            _mm_storel_epi64((__m128i*)(out + n / 2), _mm_packus_epi16(pairs, pairs));
+        }
+        return fastcache_hex_decode_scalar(text + n, length - n, out + n / 2);
+    };
+    __attribute__((target("sse2")))
+    inline void fastcache_hex_encode_sse2(const uint8_t* bytes, size_t length, char* out) {
+        size_t n=0;
+        for(; n + 16 <= length; n+=16) {
+            __m128i in=_mm_loadu_si128((const __m128i*)(bytes + n));
+            __m128i high=_mm_and_si128(_mm_srli_epi16(in, 4), _mm_set1_epi8(0x0F));
+            __m128i low=_mm_and_si128(in, _mm_set1_epi8(0x0F));
+            _mm_storeu_si128((__m128i*)(out + 2 * n), fastcache_hex_digits_sse2(_mm_unpacklo_epi8(high, low)));
+            _mm_storeu_si128((__m128i*)(out + 2 * n + 16), fastcache_hex_digits_sse2(_mm_unpackhi_epi8(high, low)));
+        }
+        fastcache_hex_encode_scalar(bytes + n, length - n, out + 2 * n);
+    };
+    __attribute__((target("avx2")))
+    inline bool fastcache_hex_decode_avx2(const char* text, size_t length, uint8_t* out) {
+        if(length & 1) {
+            return false;
+        }
+        size_t n=0;
+        for(; n + 32 <= length; n+=32) {
+            __m256i in=_mm256_loadu_si256((const __m256i*)(text + n));
+            __m256i digit=_mm256_sub_epi8(in, _mm256_set1_epi8('0'));
+            __m256i letter=_mm256_sub_epi8(in, _mm256_set1_epi8('A'));
+            __m256i is_digit=_mm256_cmpeq_epi8(_mm256_min_epu8(digit, _mm256_set1_epi8(9)), digit);
+            __m256i is_letter=_mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(5)), letter);
+            if(_mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter))!=-1) {
+                return false;
+            }
+            __m256i nibbles=_mm256_blendv_epi8(_mm256_add_epi8(letter, _mm256_set1_epi8(10)), digit, is_digit);
+            __m256i pairs=_mm256_or_si256(_mm256_slli_epi16(nibbles, 4), _mm256_srli_epi16(nibbles, 8));
+            pairs=_mm256_and_si256(pairs, _mm256_set1_epi16(0x00FF));
+            // packus works per 128 bit lane; gather the two packed quarters
+            __m256i packed=_mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0x88);
+            _mm_storeu_si128((__m128i*)(out + n / 2), _mm256_castsi256_si128(packed));
+        }
+        return fastcache_hex_decode_sse2(text + n, length - n, out + n / 2);
+    };
+    __attribute__((target("avx2")))
+    inline void fastcache_hex_encode_avx2(const uint8_t* bytes, size_t length, char* out) {
+        size_t n=0;
+        for(; n + 32 <= length; n+=32) {
+            __m256i in=_mm256_loadu_si256((const __m256i*)(bytes + n));
+            __m256i high=_mm256_and_si256(_mm256_srli_epi16(in, 4), _mm256_set1_epi8(0x0F));
+            __m256i low=_mm256_and_si256(in, _mm256_set1_epi8(0x0F));
+            __m256i first=_mm256_unpacklo_epi8(high, low);      // Bytes 0-7 | 16-23
+            __m256i second=_mm256_unpackhi_epi8(high, low);     // Bytes 8-15 | 24-31
+            __m256i nibbles[2]={_mm256_permute2x128_si256(first, second, 0x20), _mm256_permute2x128_si256(first, second, 0x31)};
+            for(int half=0; half<2; half++) {
+                __m256i letters=_mm256_and_si256(_mm256_cmpgt_epi8(nibbles[half], _mm256_set1_epi8(9)), _mm256_set1_epi8('A' - '0' - 10));
+                __m256i digits=_mm256_add_epi8(_mm256_add_epi8(nibbles[half], _mm256_set1_epi8('0')), letters);
+                _mm256_storeu_si256((__m256i*)(out + 2 * n + 32 * half), digits);
+            }
+        }
+        fastcache_hex_encode_sse2(bytes + n, length - n, out + 2 * n);
+    };
+    /**
+     * Table translation, 32 bytes at a time
+     *
+     * Looks each byte up in all 16 rows of the table (pshufb on the low nibble) and picks the row
+     * by the high nibble, one bit at a time with blends.
+     */
+    __attribute__((target("avx2")))
+    inline void fastcache_translate_avx2(const uint8_t* table, const uint8_t* in, size_t length, uint8_t* out) {
+        // Loading the rows doesn't pay off for a block or two
+        if(length < 64) {
+            fastcache_translate_scalar(table, in, length, out);
+            return;
+        }
+        __m256i rows[16];
+        for(int row=0; row<16; row++) {
+            rows[row]=_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(table + 16 * row)));
+        }
+        size_t n=0;
+        for(; n + 32 <= length; n+=32) {
+            __m256i bytes=_mm256_loadu_si256((const __m256i*)(in + n));
+            __m256i low=_mm256_and_si256(bytes, _mm256_set1_epi8(0x0F));
+            // blendv looks at bit 7: shift high nibble bits 0, 1 and 2 there (bit 3 already is)
+            __m256i bit0=_mm256_slli_epi16(bytes, 3);
+            __m256i bit1=_mm256_slli_epi16(bytes, 2);
+            __m256i bit2=_mm256_slli_epi16(bytes, 1);
+            __m256i quarter[4];
+            for(int q=0; q<4; q++) {
+                const __m256i* row=rows + 4 * q;
+                __m256i even=_mm256_blendv_epi8(_mm256_shuffle_epi8(row[0], low), _mm256_shuffle_epi8(row[1], low), bit0);
+                __m256i odd=_mm256_blendv_epi8(_mm256_shuffle_epi8(row[2], low), _mm256_shuffle_epi8(row[3], low), bit0);
+                quarter[q]=_mm256_blendv_epi8(even, odd, bit1);
+            }
+            __m256i lower=_mm256_blendv_epi8(quarter[0], quarter[1], bit2);
+            __m256i upper=_mm256_blendv_epi8(quarter[2], quarter[3], bit2);
+            _mm256_storeu_si256((__m256i*)(out + n), _mm256_blendv_epi8(lower, upper, bytes));
+        }
+        fastcache_translate_scalar(table, in + n, length - n, out + n);
+    };
+    #endif
+
+    /**
+     * CodecKernels
+     * The kernels picked for this CPU, once.
+     */
+    struct CodecKernels {
+        bool (*hex_decode)(const char*, size_t, uint8_t*);
+        void (*hex_encode)(const uint8_t*, size_t, char*);
+        void (*translate)(const uint8_t*, const uint8_t*, size_t, uint8_t*);
+        const char* name;
+
+        static const CodecKernels& instance() {
+            static const CodecKernels kernels=select();
+            return kernels;
+        };
+
+        private:
+            static CodecKernels select() {
+                CodecKernels kernels={&fastcache_hex_decode_scalar, &fastcache_hex_encode_scalar, &fastcache_translate_scalar, "scalar"};
+                #ifdef FASTCACHE_CODEC_X86
+                __builtin_cpu_init();
+                if(__builtin_cpu_supports("sse2")) {
+                    kernels.hex_decode=&fastcache_hex_decode_sse2;
+                    kernels.hex_encode=&fastcache_hex_encode_sse2;
+                    kernels.name="sse2";
+                }
+                if(__builtin_cpu_supports("avx2")) {
+                    kernels.hex_decode=&fastcache_hex_decode_avx2;
+                    kernels.hex_encode=&fastcache_hex_encode_avx2;
+                    kernels.translate=&fastcache_translate_avx2;
+                    kernels.name="avx2";
+                }
+                #endif
+                return kernels;
+            };
+    };
+
+    /**
+     * Decode upper case hex text
+     *
+     * @param text the digits, two per byte
+     * @param length number of digits
+     * @param out receives length / 2 bytes
+     * @retval false if length is odd or a character is not an upper case hex digit (out is then undefined)
+     */
+    inline bool fastcache_hex_decode(const char* text, size_t length, uint8_t* out) {
+        return CodecKernels::instance().hex_decode(text, length, out);
+    };
+    /**
+     * Encode bytes as upper case hex text
+     *
+     * @param bytes the bytes
+     * @param length number of bytes
+     * @param out receives 2 * length digits
+     */
+    inline void fastcache_hex_encode(const uint8_t* bytes, size_t length, char* out) {
+        CodecKernels::instance().hex_encode(bytes, length, out);
+    };
+    /** EBCDIC (code page 037) to ISO-8859-1, length bytes from in to out (may be the same buffer) */
+    inline void fastcache_ebcdic_to_ascii(const uint8_t* in, size_t length, uint8_t* out) {
+        CodecKernels::instance().translate(CodePage::ebcdic_to_ascii(), in, length, out);
+    };
+    /** ISO-8859-1 to EBCDIC (code page 037), see fastcache_ebcdic_to_ascii() */
+    inline void fastcache_ascii_to_ebcdic(const uint8_t* in, size_t length, uint8_t* out) {
+        CodecKernels::instance().translate(CodePage::ascii_to_ebcdic(), in, length, out);
+    };
+};
+#endif
@@ -0,0 +1,478 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageDense.hpp - StorageCache for small dense integer keys (direct indexed slots)
+#ifndef _STORAGEAPI_STORAGEDENSE_H_
+#define _STORAGEAPI_STORAGEDENSE_H_
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "StorageCache.hpp"
+
+namespace Storage {
+    /**
+     * Store selector for integral keys 0 ... Max, e.g. ISO8583 field numbers (DenseStore<128>)
+     *
+     * StorageCache<Key, T, DenseStore<Max> > is a different cache altogether: no hashing, no shards and
+     * no curator thread, just one slot per key.  Cheap enough to have one per message.
+     */
+    template <size_t Max>
+    struct DenseStore {
+        static const size_t SLOTS=Max + 1;
+    };
+
+    /**
+     * StorageCache for dense integer keys
+     *
+     * Every key has its slot in one array, holding the value pointer, the deadline and the slot's
+     * version inline; a presence bitmap tells which slots are taken.  The version is a seqlock: a
+     * writer makes it odd, changes the slot and makes it even again, so every write gives the key a
+     * new version (see compare_and_set()).  Readers take no lock: they read the slot between two equal
+     * even versions, pinned in the epoch domain, and fall back to the writers' mutex only after
+     * FASTCACHE_OPTIMISTIC_RETRIES failed attempts.  Writers are serialized by that mutex and retire
+     * replaced values through the epoch domain.  Iteration follows the bitmap, in key order.
+     *
+     * A value given to set() keeps its own allocation and gets a small holder; emplace() and update()
+     * build the value and its holder in one allocation.
+     *
+     * Expired entries read as absent; without a curator they take their slot until overwritten,
+     * deleted or cleared.  Keys outside 0 ... Max are never found, and writing one throws.
+     */
+    template <class Key, class T, size_t Max, class Index>
+    class StorageCache<Key, T, DenseStore<Max>, Index> {
+        static_assert(std::is_integral<Key>::value, "DenseStore takes integral keys");
+
+        static const size_t SLOTS=DenseStore<Max>::SLOTS;
+        static const size_t WORDS=(SLOTS + 63) / 64;
+
+        /** What a slot points to.  Never changed once published. */
+        struct Value {
+            Value() : emplaced(false) {};
+            explicit Value(shared_ptr<T>&& held) : held(std::move(held)), emplaced(false) {};
+
+            shared_ptr<T> held;
+            bool emplaced;      // held points into this allocation, see EmplacedValue
+        };
+        /** A value built in place, sharing its allocation with the holder (as EmplacedItem does) */
+        struct EmplacedValue : Value {
+            template <class... Args>
+            explicit EmplacedValue(Args&&... args) : stored(construct(std::forward<Args>(args)...)) {
+                this->emplaced=true;
+            };
+
+            /** Constructor call if T has a matching one, aggregate initialization otherwise */
+            template <class... Args>
+            static T construct(Args&&... args) {
+                if constexpr(std::is_constructible<T, Args&&...>::value) {
+                    return T(std::forward<Args>(args)...);
+                } else {
+                    return T{std::forward<Args>(args)...};
+                }
+            };
+
+            T stored;
+        };
+        struct Slot {
+            std::atomic<uint64_t> version;      // Odd while written, 0 if never written
+            std::atomic<int64_t> expiration;    // Deadline in CoarseClock ms, 0 = never
+            std::atomic<Value*> value;          // NULL if empty
+        };
+        /** A consistent read of a slot */
+        struct Entry {
+            Value* value;
+            int64_t expiration;
+            uint64_t version;
+
+            bool live() const {
+                return this->value && (this->expiration==0 || CoarseClock::instance().now() < this->expiration);
+            };
+        };
+
+        public:
+            StorageCache() {
+                for(size_t n=0; n<SLOTS; n++) {
+                    this->slots[n].version.store(0, std::memory_order_relaxed);
+                    this->slots[n].expiration.store(0, std::memory_order_relaxed);
+                    this->slots[n].value.store(NULL, std::memory_order_relaxed);
+                }
+                for(size_t n=0; n<WORDS; n++) {
+                    this->present[n].store(0, std::memory_order_relaxed);
+                }
+                this->reclaimer.enable();
+            };
+            ~StorageCache(){
+                for(size_t n=0; n<SLOTS; n++) {
+                    Value* value=this->slots[n].value.load(std::memory_order_relaxed);
+                    if(value) {
+                        drop(value);
+                    }
+                }
+            };
+            /**
+             * Number of entries, incl. expired ones
+             *
+             * @retval
+             */
+            size_t metrics() const {
+                size_t total=0;
+                for(size_t n=0; n<WORDS; n++) {
+                    total+=fastcache_popcount64(this->present[n].load(std::memory_order_relaxed));
+                }
+                return total;
+            };
+            /**
+             * Set a value into the cache
+             *
+             * @param id the key, 0 ... Max
+             * @param val shared_ptr to the object to set
+             * @param expiration UNIX timestamp, 0 for none
+             * @param mode the write mode
+             * @retval number of items written
+             * @throws std::out_of_range if the key has no slot
+             */
+            size_t set(Key id, shared_ptr<T> val, time_t expiration=0, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                size_t slot=this->slot_of(id);
+                Value* value=new Value(std::move(val));
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                return this->write(slot, value, deadline(expiration), mode);
+            };
+            /**
+             * Construct a value in place, in one allocation with its holder
+             *
+             * @param id the key, 0 ... Max
+             * @param args constructor arguments of T
+             * @retval number of items written
+             * @throws std::out_of_range if the key has no slot
+             */
+            template <class... Args>
+            size_t emplace(Key id, Args&&... args){
+                size_t slot=this->slot_of(id);
+                Value* value=make_emplaced(std::forward<Args>(args)...);
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                return this->write(slot, value, 0, FASTCACHE_WRITEMODE_WRITE_ALWAYS);
+            };
+            /**
+             * Set several values, locking once
+             *
+             * @param entries key/value pairs
+             * @param expiration UNIX timestamp, for all entries
+             * @param mode the write mode
+             * @retval number of items written
+             * @throws std::out_of_range if a key has no slot, before anything is written
+             */
+            size_t multi_set(std::vector<std::pair<Key, shared_ptr<T> > > entries, time_t expiration=0, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS){
+                std::vector<size_t> slots(entries.size());
+                for(size_t n=0; n<entries.size(); n++) {
+                    slots[n]=this->slot_of(entries[n].first);
+                }
+                std::vector<Value*> values(entries.size());
+                for(size_t n=0; n<entries.size(); n++) {
+                    values[n]=new Value(std::move(entries[n].second));
+                }
+                int64_t due=deadline(expiration);
+                size_t written=0;
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                for(size_t n=0; n<entries.size(); n++) {
+                    written+=this->write(slots[n], values[n], due, mode);
+                }
+                return written;
+            };
+            /**
+             * Modify a value: fn gets a copy to change, which then replaces it (see the general StorageCache)
+             *
+             * @param id the key
+             * @param fn called as fn(T&) with the copy
+             * @retval 1 if updated, 0 if the key is nonexistent, expired or holds no value
+             */
+            template <class F>
+            size_t update(Key id, F fn){
+                if(!this->valid(id)) {
+                    return 0;
+                }
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                Entry current=this->locked((size_t)id);
+                if(!current.live() || !current.value->held) {
+                    return 0;
+                }
+                EmplacedValue* copy=make_emplaced(*current.value->held);
+                try {
+                    fn(copy->stored);
+                } catch(...) {
+                    drop(copy);
+                    throw;
+                }
+                return this->write((size_t)id, copy, current.expiration, FASTCACHE_WRITEMODE_WRITE_ALWAYS);
+            };
+            /**
+             * Set a value if the entry is still the version the caller read
+             *
+             * @param id the key
+             * @param expected_version from get_versioned(), 0 to write only if the key is absent
+             * @param val the new value
+             * @param expiration UNIX timestamp, 0 for none
+             * @param version set to the new version if written, unless NULL
+             * @retval 1 if written, 0 if the entry changed meanwhile
+             */
+            size_t compare_and_set(Key id, uint64_t expected_version, shared_ptr<T> val, time_t expiration=0, uint64_t* version=NULL){
+                size_t slot=this->slot_of(id);
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                Entry current=this->locked(slot);
+                if((current.live()?current.version:0)!=expected_version) {
+                    return 0;
+                }
+                this->write(slot, new Value(std::move(val)), deadline(expiration), FASTCACHE_WRITEMODE_WRITE_ALWAYS);
+                if(version) {
+                    *version=this->slots[slot].version.load(std::memory_order_relaxed);
+                }
+                return 1;
+            };
+            /**
+             * Find if a key exists
+             *
+             * @param id the key
+             * @retval 1 if the key exists, 0 otherwise
+             */
+            size_t exists(Key id) const {
+                if(!this->valid(id)) {
+                    return 0;
+                }
+                EpochGuard guard;
+                Entry entry=this->read((size_t)id);
+                return (entry.live() && entry.value->held)?1:0;
+            };
+            /**
+             * Delete a value from the cache
+             *
+             * @param id the key
+             * @retval the number of items erased
+             */
+            size_t del(Key id){
+                if(!this->valid(id)) {
+                    return 0;
+                }
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                return this->erase((size_t)id);
+            };
+            /**
+             * Delete several values, locking once
+             *
+             * @param ids the keys
+             * @retval the number of items erased
+             */
+            size_t multi_del(const std::vector<Key>& ids){
+                size_t erased=0;
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                for(size_t n=0; n<ids.size(); n++) {
+                    if(this->valid(ids[n])) {
+                        erased+=this->erase((size_t)ids[n]);
+                    }
+                }
+                return erased;
+            };
+            /**
+             * Get a value from the cache.  Lock free.
+             *
+             * @param id the key
+             * @retval boost::shared_ptr<T>.  ==empty pointer if nonexistent, expired or out of range.
+             */
+            shared_ptr<T> get(Key id) const {
+                uint64_t version;
+                return this->get_versioned(id, version);
+            };
+            /**
+             * Get a value and its version, for compare_and_set()
+             *
+             * @param id the key
+             * @param version set to the entry's version, 0 if nonexistent or expired
+             * @retval the value, empty if nonexistent or expired
+             */
+            shared_ptr<T> get_versioned(Key id, uint64_t& version) const {
+                version=0;
+                if(!this->valid(id)) {
+                    return shared_ptr<T>();
+                }
+                EpochGuard guard;
+                Entry entry=this->read((size_t)id);
+                if(!entry.live()) {
+                    return shared_ptr<T>();
+                }
+                version=entry.version;
+                return entry.value->held;
+            };
+            /**
+             * Get several values
+             *
+             * @param ids the keys
+             * @retval the values in the order of ids, empty pointers for nonexistent or expired keys
+             */
+            std::vector<shared_ptr<T> > multi_get(const std::vector<Key>& ids) const {
+                std::vector<shared_ptr<T> > result(ids.size());
+                EpochGuard guard;
+                for(size_t n=0; n<ids.size(); n++) {
+                    result[n]=this->get(ids[n]);
+                }
+                return result;
+            };
+            /**
+             * Visit every live entry in key order
+             *
+             * @param visit called with (const Key&, const T&) for each entry holding a value
+             */
+            template <class F>
+            void for_each(F visit) const {
+                EpochGuard guard;
+                for(size_t word=0; word<WORDS; word++) {
+                    for(uint64_t bits=this->present[word].load(std::memory_order_acquire); bits; bits&=bits - 1) {
+                        size_t slot=word * 64 + fastcache_ctz64(bits);
+                        Entry entry=this->read(slot);
+                        if(entry.live() && entry.value->held) {
+                            visit((Key)slot, *entry.value->held);
+                        }
+                    }
+                }
+            };
+            /** Keys of the live entries, in key order */
+            std::vector<Key> keySet() const {
+                std::vector<Key> keys;
+                this->for_each([&keys](const Key& key, const T&) {
+                    keys.push_back(key);
+                });
+                return keys;
+            };
+            std::vector<Key> sorted_keys() const {
+                return this->keySet();
+            };
+            /**
+             * Remove every entry
+             *
+             * @retval number of entries removed
+             */
+            size_t clear() {
+                size_t erased=0;
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                for(size_t word=0; word<WORDS; word++) {
+                    for(uint64_t bits=this->present[word].load(std::memory_order_relaxed); bits; bits&=bits - 1) {
+                        erased+=this->erase(word * 64 + fastcache_ctz64(bits));
+                    }
+                }
+                return erased;
+            };
+
+        private:
+            StorageCache(const StorageCache&);
+            StorageCache& operator=(const StorageCache&);
+
+            static bool valid(Key id) {
+                if constexpr(std::is_signed<Key>::value) {
+                    if(id < 0) {
+                        return false;
+                    }
+                }
+                return (uint64_t)id < SLOTS;
+            };
+            static size_t slot_of(Key id) {
+                if(!valid(id)) {
+                    throw std::out_of_range("Key outside of the DenseStore range");
+                }
+                return (size_t)id;
+            };
+            /** UNIX timestamp to CoarseClock deadline, as for the general StorageCache */
+            static int64_t deadline(time_t expiration) {
+                if(expiration==0) {
+                    return 0;
+                }
+                int64_t ms=CoarseClock::instance().from_unix_ms(((int64_t)expiration + 1) * 1000);
+                return (ms==0)?-1:ms;
+            };
+            /** A value and its holder in one allocation; held keeps it alive until drop() */
+            template <class... Args>
+            static EmplacedValue* make_emplaced(Args&&... args) {
+                shared_ptr<EmplacedValue> value=boost::make_shared<EmplacedValue>(std::forward<Args>(args)...);
+                value->held=shared_ptr<T>(value, &value->stored);
+                return value.get();
+            };
+            /** Free a holder no reader can see any more.  Values still handed out live on. */
+            static void drop(void* object) {
+                Value* value=static_cast<Value*>(object);
+                if(value->emplaced) {
+                    shared_ptr<T> last;
+                    last.swap(value->held);
+                } else {
+                    delete value;
+                }
+            };
+            /** Read a slot without a lock.  Call pinned (EpochGuard), so the value stays valid. */
+            Entry read(size_t slot) const {
+                const Slot& read=this->slots[slot];
+                for(unsigned int attempt=0; attempt<FASTCACHE_OPTIMISTIC_RETRIES; attempt++) {
+                    uint64_t version=read.version.load(std::memory_order_acquire);
+                    if(version & 1) {
+                        continue;
+                    }
+                    Entry entry={read.value.load(std::memory_order_acquire), read.expiration.load(std::memory_order_relaxed), version};
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if(read.version.load(std::memory_order_relaxed)==version) {
+                        return entry;
+                    }
+                }
+                // A writer keeps getting in the way, wait for it
+                boost::lock_guard<boost::mutex> lock(this->guard);
+                return this->locked(slot);
+            };
+            /** Read a slot.  Call under the mutex. */
+            Entry locked(size_t slot) const {
+                const Slot& read=this->slots[slot];
+                Entry entry={read.value.load(std::memory_order_relaxed), read.expiration.load(std::memory_order_relaxed),
+                             read.version.load(std::memory_order_relaxed)};
+                return entry;
+            };
+            /** Change a slot under its seqlock.  Call under the mutex. */
+            void publish(size_t slot, Value* value, int64_t expiration) {
+                Slot& target=this->slots[slot];
+                uint64_t version=target.version.load(std::memory_order_relaxed);
+                target.version.store(version + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                target.value.store(value, std::memory_order_release);
+                target.expiration.store(expiration, std::memory_order_relaxed);
+                target.version.store(version + 2, std::memory_order_release);
+            };
+            /** Put a new value in a slot, or drop it if the mode says no.  Call under the mutex. */
+            size_t write(size_t slot, Value* value, int64_t expiration, const fastcache_writemode mode){
+                Value* old=this->slots[slot].value.load(std::memory_order_relaxed);
+                if((mode==FASTCACHE_WRITEMODE_ONLY_WRITE_IF_SET && !old) || (mode==FASTCACHE_WRITEMODE_ONLY_WRITE_IF_NOT_SET && old)) {
+                    drop(value);
+                    return 0;
+                }
+                this->publish(slot, value, expiration);
+                std::atomic<uint64_t>& word=this->present[slot / 64];
+                word.store(word.load(std::memory_order_relaxed) | ((uint64_t)1 << (slot % 64)), std::memory_order_release);
+                if(old) {
+                    this->reclaimer.retire(old, &StorageCache::drop);
+                }
+                return 1;
+            };
+            /** Empty a slot.  Call under the mutex. */
+            size_t erase(size_t slot){
+                Value* old=this->slots[slot].value.load(std::memory_order_relaxed);
+                if(!old) {
+                    return 0;
+                }
+                std::atomic<uint64_t>& word=this->present[slot / 64];
+                word.store(word.load(std::memory_order_relaxed) & ~((uint64_t)1 << (slot % 64)), std::memory_order_release);
+                this->publish(slot, NULL, 0);
+                this->reclaimer.retire(old, &StorageCache::drop);
+                return 1;
+            };
+
+            std::atomic<uint64_t> present[WORDS];       // Taken slots, one bit each
+            mutable boost::mutex guard;     // Writers, and readers that lost too many races
+            EpochReclaimer reclaimer;       // Replaced values, freed once no reader can see them
+            Slot slots[SLOTS];
+    };
+};
+#endif
@@ -0,0 +1,234 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageEpoch.hpp - Epoch based memory reclamation for lock-free readers
+#ifndef _STORAGEAPI_STORAGEEPOCH_H_
+#define _STORAGEAPI_STORAGEEPOCH_H_
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+/// [Definitions]
+// Retired objects collected per reclaimer before an epoch scan is attempted
+#ifndef FASTCACHE_EPOCH_BATCH
+#define FASTCACHE_EPOCH_BATCH 64u
+#endif
+
+namespace Storage {
+    /**
+     * EpochDomain
+     * Process wide epoch and the list of reader records.
+     *
+     * A reader publishes the epoch it entered in its own (cache line sized) record, so
+     * pinning never writes a shared cache line.  Objects unlinked from a shared structure
+     * are tagged with the epoch current at retirement and freed once every active reader
+     * has entered a later epoch.
+     */
+    class EpochDomain {
+        public:
+            struct alignas(64) Record {
+                Record() : epoch(0), used(true), next(NULL), depth(0) {};
+
+                std::atomic<uint64_t> epoch;    // 0 = not pinned
+                std::atomic<bool> used;
+                Record* next;
+                unsigned depth;                 // Nesting, owner thread only
+            };
+
+            /** The domain.  Never destroyed, so caches may outlive static destruction order. */
+            static EpochDomain& instance() {
+                static EpochDomain* domain=new EpochDomain();
+                return *domain;
+            };
+            /**
+             * Pin the calling thread
+             *
+             * @retval the thread's record, to be handed back to leave()
+             */
+            Record* enter() {
+                Record* record=this->local();
+                if(record->depth++ == 0) {
+                    uint64_t epoch=this->epoch.load(std::memory_order_relaxed);
+                    while(true) {
+                        record->epoch.store(epoch, std::memory_order_relaxed);
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+                        // A reclaimer that advanced meanwhile may not have seen us.  Re-pin.
+                        uint64_t now=this->epoch.load(std::memory_order_relaxed);
+                        if(now==epoch) {
+                            break;
+                        }
+                        epoch=now;
+                    }
+                }
+                return record;
+            };
+            /** Unpin the calling thread */
+            void leave(Record* record) {
+                if(--record->depth == 0) {
+                    record->epoch.store(0, std::memory_order_release);
+                }
+            };
+            /** Tag for objects retired now */
+            uint64_t current() const {
+                return this->epoch.load(std::memory_order_seq_cst);
+            };
+            /**
+             * Advance the epoch and find the oldest pinned one
+             *
+             * @retval objects tagged below this may be freed
+             */
+            uint64_t safe_epoch() {
+                uint64_t safe=this->epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+                for(Record* record=this->records.load(std::memory_order_acquire); record; record=record->next) {
+                    uint64_t pinned=record->epoch.load(std::memory_order_seq_cst);
+                    if(pinned && pinned < safe) {
+                        safe=pinned;
+                    }
+                }
+                return safe;
+            };
+
+        private:
+            EpochDomain() : epoch(1), records(NULL) {};
+
+            /** Hands the record back for reuse when its thread exits */
+            struct Owner {
+                Owner() : record(NULL) {};
+                ~Owner() {
+                    if(this->record) {
+                        this->record->used.store(false, std::memory_order_release);
+                    }
+                };
+                Record* record;
+            };
+            Record* local() {
+                static thread_local Owner owner;
+                if(!owner.record) {
+                    owner.record=this->acquire_record();
+                }
+                return owner.record;
+            };
+            Record* acquire_record() {
+                // Reuse a record left behind by an exited thread
+                for(Record* record=this->records.load(std::memory_order_acquire); record; record=record->next) {
+                    bool expected=false;
+                    if(!record->used.load(std::memory_order_relaxed) &&
+                       record->used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                        return record;
+                    }
+                }
+                Record* record=new Record();
+                record->next=this->records.load(std::memory_order_relaxed);
+                while(!this->records.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed)) {
+                }
+                return record;
+            };
+
+            std::atomic<uint64_t> epoch;
+            std::atomic<Record*> records;
+    };
+
+    /**
+     * EpochGuard
+     * RAII pin of the calling thread.  Everything read from an epoch protected structure
+     * stays allocated for the lifetime of the guard.  Guards nest.
+     */
+    class EpochGuard {
+        public:
+            EpochGuard() : record(EpochDomain::instance().enter()) {};
+            ~EpochGuard() {
+                EpochDomain::instance().leave(this->record);
+            };
+
+        private:
+            EpochGuard(const EpochGuard&);
+            EpochGuard& operator=(const EpochGuard&);
+
+            EpochDomain::Record* record;
+    };
+
+    /**
+     * EpochReclaimer
+     * Retire list of one writer (e.g. a shard, used under its write lock).
+     *
+     * Until enable() is called every retired object is freed immediately.
+     */
+    class EpochReclaimer {
+        public:
+            typedef void (*deleter)(void*);
+
+            EpochReclaimer() : domain(NULL), threshold(FASTCACHE_EPOCH_BATCH) {};
+            ~EpochReclaimer() {
+                // No reader may be left once the owner goes away
+                for(size_t n=0; n<this->retired.size(); n++) {
+                    this->retired[n].destroy(this->retired[n].object);
+                }
+            };
+            void enable() {
+                this->domain=&EpochDomain::instance();
+            };
+            /** Are retired objects deferred? */
+            bool deferred() const {
+                return this->domain!=NULL;
+            };
+            /**
+             * Retire an object
+             *
+             * @param object an object no longer reachable by new readers
+             */
+            template <class O>
+            void retire(O* object) {
+                this->retire(object, &EpochReclaimer::destroy<O>);
+            };
+            void retire(void* object, deleter destroy) {
+                if(!this->domain) {
+                    destroy(object);
+                    return;
+                }
+                Retired entry={object, destroy, this->domain->current()};
+                this->retired.push_back(entry);
+                if(this->retired.size() >= this->threshold) {
+                    this->collect();
+                }
+            };
+            /** Free everything no reader can still see */
+            void collect() {
+                if(!this->domain || this->retired.empty()) {
+                    return;
+                }
+                uint64_t safe=this->domain->safe_epoch();
+                size_t kept=0;
+                for(size_t n=0; n<this->retired.size(); n++) {
+                    if(this->retired[n].epoch < safe) {
+                        this->retired[n].destroy(this->retired[n].object);
+                    } else {
+                        this->retired[kept++]=this->retired[n];
+                    }
+                }
+                this->retired.resize(kept);
+                // A long lived reader pins everything; don't rescan on every retire meanwhile
+                this->threshold=(kept * 2 > FASTCACHE_EPOCH_BATCH)?kept * 2:FASTCACHE_EPOCH_BATCH;
+            };
+
+        private:
+            struct Retired {
+                void* object;
+                deleter destroy;
+                uint64_t epoch;
+            };
+            template <class O>
+            static void destroy(void* object) {
+                delete static_cast<O*>(object);
+            };
+
+            EpochReclaimer(const EpochReclaimer&);
+            EpochReclaimer& operator=(const EpochReclaimer&);
+
+            EpochDomain* domain;
+            std::vector<Retired> retired;
+            size_t threshold;
+    };
+};
+#endif
@@ -0,0 +1,358 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageEviction.hpp - Per-shard eviction policies (sampled LRU, CLOCK, W-TinyLFU)
+#ifndef _STORAGEAPI_STORAGEEVICTION_H_
+#define _STORAGEAPI_STORAGEEVICTION_H_
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include "StorageClock.hpp"
+
+/// [Definitions]
+// Items compared per sampled LRU decision
+#ifndef FASTCACHE_EVICTION_SAMPLES
+#define FASTCACHE_EVICTION_SAMPLES 5u
+#endif
+
+// W-TinyLFU admission window, in percent of the shard capacity
+#ifndef FASTCACHE_TINYLFU_WINDOW_PERCENT
+#define FASTCACHE_TINYLFU_WINDOW_PERCENT 1u
+#endif
+
+namespace Storage {
+    // Eviction policies
+    enum fastcache_eviction {
+        FASTCACHE_EVICTION_NONE,            // Unbounded, items leave through TTL or del() only
+        FASTCACHE_EVICTION_SAMPLED_LRU,     // Evict the least recently used of a few random items
+        FASTCACHE_EVICTION_CLOCK,           // Second chance over a ring of items
+        FASTCACHE_EVICTION_TINYLFU          // LRU window, frequency sketch decides admission to the main area
+    };
+
+    /**
+     * FrequencySketch
+     * Count-min sketch of 4 bit counters, 4 probes per key, halved periodically so
+     * old popularity fades.
+     *
+     * Increments come from lock-free readers: they are relaxed and may get lost under
+     * races, which only makes the estimate a little lower.  Saturated counters are not
+     * written again, so the hottest keys stop touching the sketch at all.
+     */
+    class FrequencySketch {
+        public:
+            FrequencySketch() : table(NULL), mask(0), sample_size(0), additions(0) {};
+            ~FrequencySketch(){
+                delete[] this->table;
+            };
+            /**
+             * Size the sketch
+             *
+             * @param capacity expected number of items
+             */
+            void configure(size_t capacity){
+                size_t words=1;
+                while(words * 4 < capacity) {
+                    words<<=1;
+                }
+                delete[] this->table;
+                this->table=new std::atomic<uint64_t>[words];
+                for(size_t n=0; n<words; n++) {
+                    this->table[n].store(0, std::memory_order_relaxed);
+                }
+                this->mask=words - 1;
+                this->sample_size=(capacity < 1?1:capacity) * 10;
+                this->additions.store(0, std::memory_order_relaxed);
+            };
+            /** Count one access */
+            void increment(size_t hash){
+                if(!this->table) {
+                    return;
+                }
+                bool added=false;
+                for(unsigned probe=0; probe<4; probe++) {
+                    uint64_t h=spread(hash, probe);
+                    std::atomic<uint64_t>& word=this->table[(size_t)h & this->mask];
+                    unsigned shift=(unsigned)((h >> 32) & 15) * 4;
+                    uint64_t value=word.load(std::memory_order_relaxed);
+                    if(((value >> shift) & 0xF) < 15) {
+                        word.store(value + (1ull << shift), std::memory_order_relaxed);
+                        added=true;
+                    }
+                }
+                if(added) {
+                    this->additions.fetch_add(1, std::memory_order_relaxed);
+                }
+            };
+            /** Estimated access count */
+            unsigned frequency(size_t hash) const {
+                if(!this->table) {
+                    return 0;
+                }
+                unsigned minimum=15;
+                for(unsigned probe=0; probe<4; probe++) {
+                    uint64_t h=spread(hash, probe);
+                    unsigned shift=(unsigned)((h >> 32) & 15) * 4;
+                    unsigned count=(unsigned)((this->table[(size_t)h & this->mask].load(std::memory_order_relaxed) >> shift) & 0xF);
+                    if(count < minimum) {
+                        minimum=count;
+                    }
+                }
+                return minimum;
+            };
+            /** Halve every counter once enough accesses were recorded.  Writer side. */
+            void age(){
+                if(!this->table || this->additions.load(std::memory_order_relaxed) < this->sample_size) {
+                    return;
+                }
+                for(size_t n=0; n<=this->mask; n++) {
+                    uint64_t value=this->table[n].load(std::memory_order_relaxed);
+                    this->table[n].store((value >> 1) & 0x7777777777777777ull, std::memory_order_relaxed);
+                }
+                this->additions.store(0, std::memory_order_relaxed);
+            };
+
+        private:
+            FrequencySketch(const FrequencySketch&);
+            FrequencySketch& operator=(const FrequencySketch&);
+
+            static uint64_t spread(size_t hash, unsigned probe){
+                static const uint64_t seeds[4]={0x97cb3127ull, 0xab1c4db1ull, 0xc2b2ae3d27d4eb4full, 0x9e3779b97f4a7c15ull};
+                uint64_t h=((uint64_t)hash + seeds[probe]) * 0x9e3779b97f4a7c15ull;
+                return h ^ (h >> 29);
+            };
+
+            std::atomic<uint64_t>* table;
+            size_t mask;
+            size_t sample_size;
+            std::atomic<size_t> additions;
+    };
+
+    /**
+     * EvictionPolicy
+     * Eviction state of one shard.
+     *
+     * Nodes must expose `std::atomic<uint32_t> access`, `size_t policy_index`,
+     * `uint8_t segment`, `uint32_t weight` and `size_t hash`.  admit(), remove() and
+     * victim() run under the shard's write lock; touch() and record() are called by
+     * readers without any lock and only write the node's access word and the sketch.
+     *
+     * Items live in flat rings (swap-remove on delete), sampled at random for LRU
+     * decisions and swept by the CLOCK hand, so no list has to be relinked on a read.
+     */
+    template <class Node>
+    class EvictionPolicy {
+        public:
+            static const size_t NPOS=(size_t)-1;
+
+            EvictionPolicy() : policy(FASTCACHE_EVICTION_NONE), capacity(0), window_capacity(0),
+                               weight(0), window_weight(0), hand(0), seed(0x2545F4914F6CDD1Dull) {};
+            /**
+             * Select the policy
+             *
+             * @param policy the policy
+             * @param capacity weight budget of this shard, 0 for unbounded
+             */
+            void configure(fastcache_eviction policy, size_t capacity){
+                this->policy=capacity?policy:FASTCACHE_EVICTION_NONE;
+                this->capacity=capacity;
+                this->window_capacity=0;
+                if(this->policy==FASTCACHE_EVICTION_TINYLFU) {
+                    this->window_capacity=capacity * FASTCACHE_TINYLFU_WINDOW_PERCENT / 100;
+                    if(this->window_capacity < 1) {
+                        this->window_capacity=1;
+                    }
+                    this->sketch.configure(capacity);
+                }
+            };
+            bool enabled() const {
+                return this->policy!=FASTCACHE_EVICTION_NONE;
+            };
+            /** Is the shard over its budget? */
+            bool over() const {
+                return this->enabled() && this->weight > this->capacity;
+            };
+            /** Track an item just put into the table */
+            void admit(Node* item){
+                if(!this->enabled()) {
+                    return;
+                }
+                item->access.store(this->stamp(), std::memory_order_relaxed);
+                this->weight+=item->weight;
+                if(this->policy==FASTCACHE_EVICTION_TINYLFU) {
+                    // New arrivals start in the window
+                    item->segment=0;
+                    this->window_weight+=item->weight;
+                    this->push(this->window, item);
+                } else {
+                    this->push(this->main, item);
+                }
+            };
+            /** Forget an item leaving the table */
+            void remove(Node* item){
+                if(item->policy_index==NPOS) {
+                    return;
+                }
+                this->weight-=item->weight;
+                if(this->policy==FASTCACHE_EVICTION_TINYLFU && item->segment==0) {
+                    this->window_weight-=item->weight;
+                    this->pull(this->window, item);
+                } else {
+                    this->pull(this->main, item);
+                }
+            };
+            /** Record a hit.  Lock-free. */
+            void touch(Node* item){
+                switch(this->policy) {
+                    case FASTCACHE_EVICTION_NONE:
+                        return;
+                    case FASTCACHE_EVICTION_CLOCK:
+                        if(!item->access.load(std::memory_order_relaxed)) {
+                            item->access.store(1, std::memory_order_relaxed);
+                        }
+                        return;
+                    case FASTCACHE_EVICTION_TINYLFU:
+                        this->sketch.increment(item->hash);
+                        // Fall through
+                    default: {
+                        // Coarse stamps: a hot item is written at most once per clock tick
+                        uint32_t now=this->stamp();
+                        if(item->access.load(std::memory_order_relaxed)!=now) {
+                            item->access.store(now, std::memory_order_relaxed);
+                        }
+                    }
+                }
+            };
+            /** Record a miss.  Lock-free. */
+            void record(size_t hash){
+                if(this->policy==FASTCACHE_EVICTION_TINYLFU) {
+                    this->sketch.increment(hash);
+                }
+            };
+            /**
+             * Pick the next item to evict
+             *
+             * The caller removes it from the table (which calls remove()).
+             *
+             * @param protect an item that must stay (the one just written)
+             * @retval the victim, NULL if nothing but protect is left
+             */
+            Node* victim(Node* protect){
+                switch(this->policy) {
+                    case FASTCACHE_EVICTION_CLOCK:
+                        return this->sweep(protect);
+                    case FASTCACHE_EVICTION_TINYLFU:
+                        return this->contest(protect);
+                    case FASTCACHE_EVICTION_SAMPLED_LRU:
+                        return this->oldest(this->main, protect);
+                    default:
+                        return NULL;
+                }
+            };
+
+        private:
+            EvictionPolicy(const EvictionPolicy&);
+            EvictionPolicy& operator=(const EvictionPolicy&);
+
+            uint32_t stamp() const {
+                return (uint32_t)CoarseClock::instance().now();
+            };
+            uint64_t random(){
+                // xorshift64*, shard local so there's nothing to share
+                this->seed^=this->seed >> 12;
+                this->seed^=this->seed << 25;
+                this->seed^=this->seed >> 27;
+                return this->seed * 0x2545F4914F6CDD1Dull;
+            };
+            static void push(std::vector<Node*>& ring, Node* item){
+                item->policy_index=ring.size();
+                ring.push_back(item);
+            };
+            static void pull(std::vector<Node*>& ring, Node* item){
+                Node* last=ring.back();
+                ring[item->policy_index]=last;
+                last->policy_index=item->policy_index;
+                ring.pop_back();
+                item->policy_index=NPOS;
+            };
+            /** Least recently used of a few random ring members */
+            Node* oldest(const std::vector<Node*>& ring, Node* protect){
+                Node* victim=NULL;
+                uint32_t now=this->stamp();
+                uint32_t victim_age=0;
+                size_t samples=(ring.size() <= FASTCACHE_EVICTION_SAMPLES)?ring.size():FASTCACHE_EVICTION_SAMPLES;
+                for(size_t n=0; n<samples; n++) {
+                    Node* item=(samples==ring.size())?ring[n]:ring[this->random() % ring.size()];
+                    if(item==protect) {
+                        continue;
+                    }
+                    uint32_t age=now - item->access.load(std::memory_order_relaxed);
+                    if(!victim || age > victim_age) {
+                        victim=item;
+                        victim_age=age;
+                    }
+                }
+                if(!victim && ring.size() > 1) {
+                    // Only drew the protected item, take its neighbour
+                    victim=ring[(protect->policy_index + 1) % ring.size()];
+                }
+                return victim;
+            };
+            /** CLOCK: first unreferenced item under the hand, clearing references on the way */
+            Node* sweep(Node* protect){
+                for(size_t steps=0; steps<=2 * this->main.size(); steps++) {
+                    if(this->hand >= this->main.size()) {
+                        this->hand=0;
+                    }
+                    Node* item=this->main[this->hand++];
+                    if(item==protect) {
+                        continue;
+                    }
+                    if(item->access.exchange(0, std::memory_order_relaxed)==0) {
+                        return item;
+                    }
+                }
+                return NULL;
+            };
+            /**
+             * W-TinyLFU: the window's LRU item moves on to the main area; if that overflows, the
+             * sketch decides whether it or the main area's LRU item has to go.
+             */
+            Node* contest(Node* protect){
+                this->sketch.age();
+                while(this->window_weight > this->window_capacity) {
+                    Node* candidate=this->oldest(this->window, protect);
+                    if(!candidate) {
+                        break;
+                    }
+                    this->pull(this->window, candidate);
+                    this->window_weight-=candidate->weight;
+                    candidate->segment=1;
+                    this->push(this->main, candidate);
+                    if(this->weight <= this->capacity) {
+                        continue;
+                    }
+                    Node* incumbent=this->oldest(this->main, candidate);
+                    if(!incumbent) {
+                        return candidate;
+                    }
+                    return (this->sketch.frequency(candidate->hash) > this->sketch.frequency(incumbent->hash))?incumbent:candidate;
+                }
+                Node* victim=this->oldest(this->main, protect);
+                return victim?victim:this->oldest(this->window, protect);
+            };
+
+            fastcache_eviction policy;
+            size_t capacity;
+            size_t window_capacity;
+            size_t weight;
+            size_t window_weight;
+            size_t hand;
+            uint64_t seed;
+            std::vector<Node*> window;      // TinyLFU only
+            std::vector<Node*> main;
+            FrequencySketch sketch;         // TinyLFU only
+    };
+};
+#endif
@@ -0,0 +1,112 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageExpiry.hpp - Expiration index (intrusive min-heap of deadlines)
+#ifndef _STORAGEAPI_STORAGEEXPIRY_H_
+#define _STORAGEAPI_STORAGEEXPIRY_H_
+#include <stdint.h>
+#include <cstddef>
+#include <vector>
+
+namespace Storage {
+    /**
+     * ExpiryHeap
+     * Min-heap of nodes ordered by deadline.
+     *
+     * Nodes must expose `expiration` (int64_t or an atomic of it) and `size_t heap_index`; the heap keeps the
+     * latter up to date so a node can be taken out in O(log n) when it is replaced or deleted.
+     * Only nodes with an expiration belong in here.  Not thread safe (use under the shard lock).
+     */
+    template <class Node>
+    class ExpiryHeap {
+        public:
+            static const size_t NPOS=(size_t)-1;
+
+            /** Add a node */
+            void push(Node* node){
+                node->heap_index=this->heap.size();
+                this->heap.push_back(node);
+                this->sift_up(node->heap_index);
+            };
+            /** Take a node out, no-op if it is not in the heap */
+            void remove(Node* node){
+                size_t index=node->heap_index;
+                if(index==NPOS) {
+                    return;
+                }
+                node->heap_index=NPOS;
+                Node* last=this->heap.back();
+                this->heap.pop_back();
+                if(last==node) {
+                    return;
+                }
+                this->heap[index]=last;
+                last->heap_index=index;
+                this->sift_down(index);
+                this->sift_up(last->heap_index);
+            };
+            /** Re-position a node whose deadline changed */
+            void update(Node* node){
+                this->sift_down(node->heap_index);
+                this->sift_up(node->heap_index);
+            };
+            /** Node with the earliest deadline, NULL if empty */
+            Node* top() const {
+                return this->heap.empty()?NULL:this->heap.front();
+            };
+            /** Earliest deadline, INT64_MAX if empty */
+            int64_t next() const {
+                return this->heap.empty()?INT64_MAX:(int64_t)this->heap.front()->expiration;
+            };
+            size_t size() const {
+                return this->heap.size();
+            };
+            void clear(){
+                for(size_t n=0; n<this->heap.size(); n++) {
+                    this->heap[n]->heap_index=NPOS;
+                }
+                this->heap.clear();
+            };
+
+        private:
+            void place(size_t index, Node* node){
+                this->heap[index]=node;
+                node->heap_index=index;
+            };
+            void sift_up(size_t index){
+                Node* node=this->heap[index];
+                while(index > 0) {
+                    size_t parent=(index - 1) / 2;
+                    if(this->heap[parent]->expiration <= node->expiration) {
+                        break;
+                    }
+                    this->place(index, this->heap[parent]);
+                    index=parent;
+                }
+                this->place(index, node);
+            };
+            void sift_down(size_t index){
+                Node* node=this->heap[index];
+                size_t count=this->heap.size();
+                while(true) {
+                    size_t child=index * 2 + 1;
+                    if(child >= count) {
+                        break;
+                    }
+                    if(child + 1 < count && this->heap[child + 1]->expiration < this->heap[child]->expiration) {
+                        ++child;
+                    }
+                    if(node->expiration <= this->heap[child]->expiration) {
+                        break;
+                    }
+                    this->place(index, this->heap[child]);
+                    index=child;
+                }
+                this->place(index, node);
+            };
+
+            std::vector<Node*> heap;
+    };
+};
+#endif
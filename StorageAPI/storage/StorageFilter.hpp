@@ -0,0 +1,119 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageFilter.hpp - Blocked Bloom filter over key hashes, to reject misses without a lock
+#ifndef _STORAGEAPI_STORAGEFILTER_H_
+#define _STORAGEAPI_STORAGEFILTER_H_
+#include <stdint.h>
+#include <cstddef>
+#include <atomic>
+
+/// [Definitions]
+// Filter bits per key.  10 gives about 1% false positives.
+#ifndef FASTCACHE_FILTER_BITS
+#define FASTCACHE_FILTER_BITS 10u
+#endif
+
+// Keys a shard's filter is sized for at least
+#ifndef FASTCACHE_FILTER_MIN_KEYS
+#define FASTCACHE_FILTER_MIN_KEYS 512u
+#endif
+
+namespace Storage {
+    /**
+     * MissFilter
+     * Bloom filter of the keys in a shard, by key hash.
+     *
+     * Split blocks: a key sets one bit in each of the eight words of one 64 byte block, so a lookup
+     * reads a single cache line.  Bits are only ever set, by the shard's writer (under its lock), and
+     * read by anyone without a lock.  Deleted keys leave their bits behind; once enough have gone (or
+     * more keys came than it was sized for) the owner builds a new filter, see stale().
+     */
+    class MissFilter {
+        public:
+            /**
+             * @param keys keys to size for
+             * @param bits_per_key filter bits per key
+             */
+            MissFilter(size_t keys, unsigned int bits_per_key) : bits_per_key(bits_per_key), added(0), removed(0) {
+                if(keys < FASTCACHE_FILTER_MIN_KEYS) {
+                    keys=FASTCACHE_FILTER_MIN_KEYS;
+                }
+                this->capacity=keys;
+                this->blocks=(keys * bits_per_key + BLOCK_BITS - 1) / BLOCK_BITS;
+                this->words=new std::atomic<uint64_t>[this->blocks * WORDS];
+                for(size_t n=0; n<this->blocks * WORDS; n++) {
+                    this->words[n].store(0, std::memory_order_relaxed);
+                }
+            };
+            ~MissFilter() {
+                delete[] this->words;
+            };
+            /** Add a key.  Call under the owner's write lock, before the key becomes visible. */
+            void add(size_t hash) {
+                uint64_t mixed=mix(hash);
+                std::atomic<uint64_t>* block=this->block(mixed);
+                for(unsigned int n=0; n<WORDS; n++) {
+                    uint64_t word=block[n].load(std::memory_order_relaxed);
+                    block[n].store(word | bit(mixed, n), std::memory_order_relaxed);
+                }
+                ++this->added;
+            };
+            /** Note a key leaving.  Its bits stay. */
+            void remove() {
+                ++this->removed;
+            };
+            /**
+             * May the key be in the shard?  Lock free.
+             *
+             * @retval false if the key is certainly absent
+             */
+            bool may_contain(size_t hash) const {
+                uint64_t mixed=mix(hash);
+                const std::atomic<uint64_t>* block=this->block(mixed);
+                for(unsigned int n=0; n<WORDS; n++) {
+                    uint64_t mask=bit(mixed, n);
+                    if((block[n].load(std::memory_order_relaxed) & mask)!=mask) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+            /** Too full, or too many deleted keys still in it? */
+            bool stale() const {
+                return this->added > this->capacity || this->removed * 2 > this->capacity;
+            };
+
+            const unsigned int bits_per_key;
+
+        private:
+            static const unsigned int WORDS=8;
+            static const size_t BLOCK_BITS=WORDS * 64;
+
+            MissFilter(const MissFilter&);
+            MissFilter& operator=(const MissFilter&);
+
+            /** The table already uses the low hash bits, spread them all over */
+            static uint64_t mix(size_t hash) {
+                uint64_t mixed=(uint64_t)hash * 0x9E3779B97F4A7C15ull;
+                return mixed ^ (mixed >> 29);
+            };
+            std::atomic<uint64_t>* block(uint64_t mixed) const {
+                return this->words + (size_t)(((mixed >> 32) * this->blocks) >> 32) * WORDS;
+            };
+            /** Bit of word n, from the low half of the hash times an odd salt */
+            static uint64_t bit(uint64_t mixed, unsigned int n) {
+                static const uint32_t SALT[WORDS]={0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+                                                   0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u};
+                return (uint64_t)1 << (((uint32_t)mixed * SALT[n]) >> 26);
+            };
+
+            std::atomic<uint64_t>* words;
+            size_t blocks;
+            size_t capacity;
+            size_t added;       // Since built, writer only
+            size_t removed;
+    };
+};
+#endif
@@ -0,0 +1,219 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageIndex.hpp - Secondary key indexes (ordered scans over the sharded store)
+#ifndef _STORAGEAPI_STORAGEINDEX_H_
+#define _STORAGEAPI_STORAGEINDEX_H_
+#include <stdint.h>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <set>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/// [Definitions]
+// Components of a field path packed into the 64 bit rank (16 bits each), so at most 4
+#ifndef FASTCACHE_PATH_DEPTH
+#define FASTCACHE_PATH_DEPTH 4u
+#endif
+
+namespace Storage {
+    static_assert(FASTCACHE_PATH_DEPTH >= 1 && FASTCACHE_PATH_DEPTH <= 4, "FASTCACHE_PATH_DEPTH must be 1 ... 4");
+
+    /**
+     * NoIndex
+     * No secondary index, nothing to maintain.
+     */
+    template <class Key, class Node>
+    class NoIndex {
+        public:
+            static const bool ORDERED=false;
+
+            void insert(Node* /* node */){
+            };
+            void erase(Node* /* node */){
+            };
+    };
+
+    /**
+     * PathIndex
+     * Orders dotted numeric field paths ("3", "3.1", "48.61.3") numerically, component by component.
+     *
+     * Paths of up to FASTCACHE_PATH_DEPTH components below 65535 are packed into a 64 bit rank
+     * (component + 1 per 16 bits, 0 = absent), so "3" < "3.1" < "3.2" < "4" < "48.61.3" is an integer
+     * comparison and a prefix is a contiguous rank range.  Other keys share rank UINT64_MAX and sort
+     * after all paths, by string.
+     *
+     * One index per shard, maintained under the shard's write lock.  Key must convert to std::string_view.
+     */
+    template <class Key, class Node>
+    class PathIndex {
+        public:
+            static const bool ORDERED=true;
+            static const uint64_t UNRANKED=UINT64_MAX;
+
+            /** A key found by a scan, comparable across shards */
+            typedef std::pair<uint64_t, Key> Ranked;
+
+            void insert(Node* node){
+                this->entries.insert(Entry(rank(node->key), node));
+            };
+            void erase(Node* node){
+                this->entries.erase(Entry(rank(node->key), node));
+            };
+            /**
+             * Visit the nodes under a path in order
+             *
+             * @param prefix the path, "" for all keys.  Matches itself and everything below it.
+             * @param visit called with (rank, node)
+             */
+            template <class F>
+            void scan(std::string_view prefix, F visit) const {
+                while(!prefix.empty() && prefix.back()=='.') {
+                    prefix.remove_suffix(1);
+                }
+                typename Set::const_iterator it;
+                if(prefix.empty()) {
+                    for(it=this->entries.begin(); it!=this->entries.end(); ++it) {
+                        visit(it->rank, it->node);
+                    }
+                    return;
+                }
+                size_t depth=0;
+                uint64_t low=rank(prefix, &depth);
+                if(low!=UNRANKED) {
+                    uint64_t high=low | ((depth < FASTCACHE_PATH_DEPTH)?(((uint64_t)1 << (16 * (FASTCACHE_PATH_DEPTH - depth))) - 1):0);
+                    for(it=this->entries.lower_bound(Probe(low, std::string_view())); it!=this->entries.end() && it->rank <= high; ++it) {
+                        visit(it->rank, it->node);
+                    }
+                }
+                // Paths too deep to rank (or with non-numeric components) are kept by string
+                for(it=this->entries.lower_bound(Probe(UNRANKED, prefix)); it!=this->entries.end(); ++it) {
+                    std::string_view key(it->node->key);
+                    if(key.compare(0, prefix.size(), prefix)!=0) {
+                        break;
+                    }
+                    if(key.size()==prefix.size() || key[prefix.size()]=='.') {
+                        visit(it->rank, it->node);
+                    }
+                }
+            };
+            size_t size() const {
+                return this->entries.size();
+            };
+            /**
+             * Merge per shard scan results into one ordered list
+             *
+             * @param runs the ordered results of each shard
+             * @retval the keys of all runs, in order
+             */
+            static std::vector<Key> merge(const std::vector<std::vector<Ranked> >& runs){
+                typedef std::pair<const Ranked*, size_t> Head;     // Current element, run
+                struct Later {
+                    bool operator()(const Head& lhs, const Head& rhs) const {
+                        return *rhs.first < *lhs.first;
+                    };
+                };
+                std::priority_queue<Head, std::vector<Head>, Later> heads;
+                std::vector<size_t> positions(runs.size(), 0);
+                size_t total=0;
+                for(size_t n=0; n<runs.size(); n++) {
+                    total+=runs[n].size();
+                    if(!runs[n].empty()) {
+                        heads.push(Head(&runs[n][0], n));
+                    }
+                }
+                std::vector<Key> keys;
+                keys.reserve(total);
+                while(!heads.empty()) {
+                    size_t run=heads.top().second;
+                    keys.push_back(heads.top().first->second);
+                    heads.pop();
+                    if(++positions[run] < runs[run].size()) {
+                        heads.push(Head(&runs[run][positions[run]], run));
+                    }
+                }
+                return keys;
+            };
+            /**
+             * Rank of a field path
+             *
+             * @param key the path
+             * @param depth receives the number of components, if given
+             * @retval the packed components, UNRANKED if the key is not a short numeric path
+             */
+            static uint64_t rank(std::string_view key, size_t* depth=NULL){
+                uint64_t packed=0;
+                size_t count=0;
+                size_t pos=0;
+                while(true) {
+                    uint64_t component=0;
+                    size_t digits=0;
+                    for(; pos<key.size() && key[pos]!='.'; pos++, digits++) {
+                        if(key[pos] < '0' || key[pos] > '9' || digits==5) {
+                            return UNRANKED;
+                        }
+                        component=component * 10 + (uint64_t)(key[pos] - '0');
+                    }
+                    if(digits==0 || component >= 0xFFFF || count==FASTCACHE_PATH_DEPTH) {
+                        return UNRANKED;
+                    }
+                    packed|=(component + 1) << (16 * (FASTCACHE_PATH_DEPTH - 1 - count));
+                    ++count;
+                    if(pos==key.size()) {
+                        break;
+                    }
+                    ++pos;      // Skip the dot
+                }
+                if(depth) {
+                    *depth=count;
+                }
+                return packed;
+            };
+
+        private:
+            /** Node in rank order; nodes of equal rank ("3.1", "3.01", unranked keys) by key */
+            struct Entry {
+                Entry(uint64_t rank, Node* node) : rank(rank), node(node) {};
+
+                uint64_t rank;
+                Node* node;
+            };
+            struct Probe {
+                Probe(uint64_t rank, std::string_view key) : rank(rank), key(key) {};
+
+                uint64_t rank;
+                std::string_view key;
+            };
+            struct Less {
+                typedef void is_transparent;
+
+                bool operator()(const Entry& lhs, const Entry& rhs) const {
+                    return lhs.rank < rhs.rank || (lhs.rank==rhs.rank && std::string_view(lhs.node->key) < std::string_view(rhs.node->key));
+                };
+                bool operator()(const Entry& lhs, const Probe& rhs) const {
+                    return lhs.rank < rhs.rank || (lhs.rank==rhs.rank && std::string_view(lhs.node->key) < rhs.key);
+                };
+                bool operator()(const Probe& lhs, const Entry& rhs) const {
+                    return lhs.rank < rhs.rank || (lhs.rank==rhs.rank && lhs.key < std::string_view(rhs.node->key));
+                };
+            };
+            typedef std::set<Entry, Less> Set;
+
+            Set entries;
+    };
+
+    /** Index selection for StorageCache */
+    struct NoKeyIndex {
+        template <class Key, class Node>
+        struct index { typedef NoIndex<Key, Node> type; };
+    };
+    struct PathKeyIndex {
+        template <class Key, class Node>
+        struct index { typedef PathIndex<Key, Node> type; };
+    };
+};
+#endif
@@ -5,14 +5,306 @@
 // StorageItem.hpp - Header Definition incl. Initialization
 #ifndef _STORAGEAPI_STORAGEITEM_H_
 #define _STORAGEAPI_STORAGEITEM_H_
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include "StorageCodec.hpp"
+#include "StorageSerializer.hpp"
+
+/// [Definitions]
+// Value bytes kept inside the item, longer values go to the heap
+#ifndef FASTCACHE_ITEM_INLINE_BYTES
+#define FASTCACHE_ITEM_INLINE_BYTES 12u
+#endif
+
+// Descriptor table: ids per chunk (power of two) and number of chunks
+#define FASTCACHE_DESCRIPTOR_CHUNK 1024u
+#define FASTCACHE_DESCRIPTOR_CHUNKS 1024u
 
 namespace Storage {
+    /**
+     * StorageDescriptors
+     * Process wide string table for field descriptors.
+     *
+     * Items hold the 32 bit id of their descriptor instead of a copy.  Names are never removed, so
+     * ids stay valid and name() needs no lock.
+     */
+    class StorageDescriptors {
+        public:
+            /** The table.  Never destroyed, so items may outlive static destruction order. */
+            static StorageDescriptors& instance() {
+                static StorageDescriptors* table=new StorageDescriptors();
+                return *table;
+            };
+            /**
+             * Id of a name, added if new
+             *
+             * @throws std::length_error if the table is full
+             */
+            uint32_t intern(std::string_view name) {
+                {    // Scope for lock
+                    boost::shared_lock<boost::shared_mutex> lock(this->guard);
+                    Ids::const_iterator it=this->ids.find(name);
+                    if(it!=this->ids.end()) {
+                        return it->second;
+                    }
+                }
+                boost::unique_lock<boost::shared_mutex> lock(this->guard);
+                Ids::const_iterator it=this->ids.find(name);
+                if(it!=this->ids.end()) {
+                    return it->second;
+                }
+                uint32_t id=this->count;
+                if(id >= FASTCACHE_DESCRIPTOR_CHUNK * FASTCACHE_DESCRIPTOR_CHUNKS) {
+                    throw std::length_error("Descriptor table is full");
+                }
+                std::string* chunk=this->chunks[id / FASTCACHE_DESCRIPTOR_CHUNK].load(std::memory_order_relaxed);
+                if(!chunk) {
+                    chunk=new std::string[FASTCACHE_DESCRIPTOR_CHUNK];
+                    this->chunks[id / FASTCACHE_DESCRIPTOR_CHUNK].store(chunk, std::memory_order_release);
+                }
+                std::string& stored=chunk[id % FASTCACHE_DESCRIPTOR_CHUNK];
+                stored.assign(name.data(), name.size());
+                this->ids.insert(Ids::value_type(std::string_view(stored), id));
+                ++this->count;
+                return id;
+            };
+            /** Name of an id handed out by intern() */
+            const std::string& name(uint32_t id) const {
+                return this->chunks[id / FASTCACHE_DESCRIPTOR_CHUNK].load(std::memory_order_acquire)[id % FASTCACHE_DESCRIPTOR_CHUNK];
+            };
+
+        private:
+            typedef std::unordered_map<std::string_view, uint32_t> Ids;     // Views of the stored names
+
+            StorageDescriptors() : count(0) {
+                for(size_t n=0; n<FASTCACHE_DESCRIPTOR_CHUNKS; n++) {
+                    this->chunks[n].store(NULL, std::memory_order_relaxed);
+                }
+                this->intern(std::string_view());       // Id 0 is the empty name
+            };
+
+            boost::shared_mutex guard;
+            Ids ids;
+            uint32_t count;
+            std::atomic<std::string*> chunks[FASTCACHE_DESCRIPTOR_CHUNKS];
+    };
+
+    /**
+     * StorageBytes
+     * Byte string with inline storage for short values; 16 bytes itself.
+     */
+    class StorageBytes {
+        public:
+            StorageBytes() : length(0) {};
+            StorageBytes(const uint8_t* bytes, size_t length) : length(0) {
+                this->assign(bytes, length);
+            };
+            StorageBytes(const StorageBytes& other) : length(0) {
+                this->assign(other.data(), other.size());
+            };
+            StorageBytes(StorageBytes&& other) : length(other.length) {
+                std::memcpy(this->local, other.local, sizeof(this->local));
+                other.length=0;
+            };
+            ~StorageBytes() {
+                this->reset();
+            };
+            StorageBytes& operator=(const StorageBytes& other) {
+                if(this!=&other) {
+                    this->assign(other.data(), other.size());
+                }
+                return *this;
+            };
+            StorageBytes& operator=(StorageBytes&& other) {
+                if(this!=&other) {
+                    this->reset();
+                    this->length=other.length;
+                    std::memcpy(this->local, other.local, sizeof(this->local));
+                    other.length=0;
+                }
+                return *this;
+            };
+            /** Replace the content */
+            void assign(const uint8_t* bytes, size_t length) {
+                uint8_t* target=this->allocate(length);
+                if(length) {
+                    std::memcpy(target, bytes, length);
+                }
+            };
+            /**
+             * Resize without keeping the content
+             *
+             * @retval the storage to fill
+             */
+            uint8_t* allocate(size_t length) {
+                this->reset();
+                this->length=(uint32_t)length;
+                if(length <= sizeof(this->local)) {
+                    return this->local;
+                }
+                uint8_t* heap=new uint8_t[length];
+                std::memcpy(this->local, &heap, sizeof(heap));
+                return heap;
+            };
+            const uint8_t* data() const {
+                return const_cast<StorageBytes*>(this)->storage();
+            };
+            size_t size() const {
+                return this->length;
+            };
+
+        private:
+            uint8_t* storage() {
+                if(this->length <= sizeof(this->local)) {
+                    return this->local;
+                }
+                uint8_t* heap;
+                std::memcpy(&heap, this->local, sizeof(heap));
+                return heap;
+            };
+            void reset() {
+                if(this->length > sizeof(this->local)) {
+                    delete[] this->storage();
+                }
+                this->length=0;
+            };
+
+            uint32_t length;
+            uint8_t local[FASTCACHE_ITEM_INLINE_BYTES];     // The bytes, or the heap pointer
+    };
+
+    /**
+     * StorageItem
+     * A field: number, descriptor and value.
+     *
+     * The descriptor is interned (StorageDescriptors).  Upper case hex values are kept as the bytes
+     * they encode and turned back into hex on access; anything else is kept verbatim.
+     */
     class StorageItem {
         public:
+            StorageItem() : fldno(0), descriptor_id(0), packed(false) {};
+            /**
+             * @param fldno field number
+             * @param descriptor field descriptor
+             * @param value hex encoded value, e.g. "F0F1F0F0"
+             */
+            StorageItem(int fldno, std::string_view descriptor, std::string_view value) : fldno(fldno), packed(false) {
+                this->set_descriptor(descriptor);
+                this->set_value(value);
+            };
+            const std::string& descriptor() const {
+                return StorageDescriptors::instance().name(this->descriptor_id);
+            };
+            void set_descriptor(std::string_view descriptor) {
+                this->descriptor_id=StorageDescriptors::instance().intern(descriptor);
+            };
+            /** Set the descriptor by an id from StorageDescriptors::intern(), skipping the lookup */
+            void set_descriptor_id(uint32_t id) {
+                this->descriptor_id=id;
+            };
+            /** The value as set, i.e. in hex */
+            std::string value() const {
+                if(!this->packed) {
+                    return std::string((const char*)this->bytes.data(), this->bytes.size());
+                }
+                std::string text(this->bytes.size() * 2, '\0');
+                fastcache_hex_encode(this->bytes.data(), this->bytes.size(), &text[0]);
+                return text;
+            };
+            void set_value(std::string_view value) {
+                uint8_t* target=this->bytes.allocate(value.size() / 2);
+                this->packed=fastcache_hex_decode(value.data(), value.size(), target);
+                if(!this->packed) {
+                    this->bytes.assign((const uint8_t*)value.data(), value.size());
+                }
+            };
+            /**
+             * The value as text: its EBCDIC bytes translated to ASCII (ISO-8859-1)
+             *
+             * Translated on every call; the item only keeps the bytes.  Values that were not hex come back as set.
+             */
+            std::string text() const {
+                std::string text((const char*)this->bytes.data(), this->bytes.size());
+                if(this->packed && !text.empty()) {
+                    fastcache_ebcdic_to_ascii((const uint8_t*)text.data(), text.size(), (uint8_t*)&text[0]);
+                }
+                return text;
+            };
+            /** Set the value from ASCII text, kept as EBCDIC bytes (value() is their hex form) */
+            void set_text(std::string_view text) {
+                uint8_t* target=this->bytes.allocate(text.size());
+                fastcache_ascii_to_ebcdic((const uint8_t*)text.data(), text.size(), target);
+                this->packed=true;
+            };
+            /** The raw bytes of a hex value (the text itself if it was not hex) */
+            const StorageBytes& raw() const {
+                return this->bytes;
+            };
+            /** Set the raw bytes, value() is their hex form */
+            void set_raw(const uint8_t* bytes, size_t length) {
+                this->bytes.assign(bytes, length);
+                this->packed=true;
+            };
+
             int fldno;
-            std::string descriptor;
-            std::string value;
+
+        private:
+            friend struct StorageSerializer<StorageItem>;
+
+            uint32_t descriptor_id;
+            bool packed;        // bytes hold decoded hex
+            StorageBytes bytes;
+    };
+
+    /**
+     * Snapshot form of a StorageItem: fldno, descriptor length, packed flag, descriptor, bytes.
+     * The descriptor is written as text since ids are only valid within a process.
+     */
+    template <>
+    struct StorageSerializer<StorageItem> {
+        static const size_t HEAD=sizeof(int32_t) + sizeof(uint32_t) + 1;
+
+        static size_t size(const StorageItem& item) {
+            return HEAD + item.descriptor().size() + item.bytes.size();
+        };
+        static void write(const StorageItem& item, uint8_t* out) {
+            const std::string& descriptor=item.descriptor();
+            int32_t fldno=item.fldno;
+            uint32_t length=(uint32_t)descriptor.size();
+            std::memcpy(out, &fldno, sizeof(fldno));
+            std::memcpy(out + sizeof(fldno), &length, sizeof(length));
+            out[sizeof(fldno) + sizeof(length)]=item.packed;
+            std::memcpy(out + HEAD, descriptor.data(), length);
+            if(item.bytes.size()) {
+                std::memcpy(out + HEAD + length, item.bytes.data(), item.bytes.size());
+            }
+        };
+        /** @throws std::length_error if size doesn't cover the descriptor */
+        static StorageItem read(const uint8_t* in, size_t size) {
+            if(size < HEAD) {
+                throw std::length_error("Truncated StorageItem");
+            }
+            int32_t fldno;
+            uint32_t length;
+            std::memcpy(&fldno, in, sizeof(fldno));
+            std::memcpy(&length, in + sizeof(fldno), sizeof(length));
+            if(size - HEAD < length) {
+                throw std::length_error("Truncated StorageItem");
+            }
+            StorageItem item;
+            item.fldno=fldno;
+            item.packed=in[sizeof(fldno) + sizeof(length)]!=0;
+            item.set_descriptor(std::string_view((const char*)in + HEAD, length));
+            item.bytes.assign(in + HEAD + length, size - HEAD - length);
+            return item;
+        };
     };
 };
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,553 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageJournal.hpp - Append-only write-ahead log with group commit
+#ifndef _STORAGEAPI_STORAGEJOURNAL_H_
+#define _STORAGEAPI_STORAGEJOURNAL_H_
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <stdint.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(_WIN32)
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// [Definitions]
+// Log files per generation (power of two).  Writers of different stripes never wait for each other.
+#ifndef FASTCACHE_JOURNAL_STRIPES
+#define FASTCACHE_JOURNAL_STRIPES 16u
+#endif
+
+// Group commit interval of FASTCACHE_JOURNAL_SYNC_INTERVAL
+#ifndef FASTCACHE_JOURNAL_SYNC_MS
+#define FASTCACHE_JOURNAL_SYNC_MS 50u
+#endif
+
+// Buffered bytes per stripe that trigger an early group commit
+#ifndef FASTCACHE_JOURNAL_SYNC_BYTES
+#define FASTCACHE_JOURNAL_SYNC_BYTES (1u << 20)
+#endif
+
+namespace Storage {
+    // When logged writes reach the disk
+    enum fastcache_journal_sync {
+        FASTCACHE_JOURNAL_SYNC_NONE,        // Written out every interval, flushing left to the OS
+        FASTCACHE_JOURNAL_SYNC_INTERVAL,    // Written and fsync'ed every sync_ms or sync_bytes, whichever comes first
+        FASTCACHE_JOURNAL_SYNC_ALWAYS       // Writes return once durable; concurrent writers share an fsync
+    };
+
+    /** A journal could not be written or opened */
+    struct StorageJournalError : std::runtime_error {
+        explicit StorageJournalError(const std::string& what) : std::runtime_error(what) {};
+    };
+
+    /** Settings of StorageCache::open_journal() */
+    struct StorageJournalOptions {
+        StorageJournalOptions(fastcache_journal_sync sync=FASTCACHE_JOURNAL_SYNC_INTERVAL, unsigned int sync_ms=FASTCACHE_JOURNAL_SYNC_MS,
+                              size_t sync_bytes=FASTCACHE_JOURNAL_SYNC_BYTES, size_t stripes=FASTCACHE_JOURNAL_STRIPES)
+            : sync(sync), sync_ms(sync_ms), sync_bytes(sync_bytes), stripes(stripes) {};
+
+        fastcache_journal_sync sync;
+        unsigned int sync_ms;
+        size_t sync_bytes;
+        size_t stripes;         // Rounded up to a power of two
+    };
+
+    /**
+     * A log record: this header, the key bytes and the value bytes (StorageSerializer), host byte order.
+     * The checksum covers header and payload, so a torn tail ends replay cleanly.
+     */
+    struct JournalRecord {
+        enum {
+            SET=1,              // Key, value
+            SET_EMPTY=2,        // Key with an empty pointer
+            DEL=3               // Key
+        };
+        uint32_t size;          // key_size + value size
+        uint32_t checksum;      // hash() of the record with this field 0
+        uint32_t key_size;
+        uint16_t op;
+        uint8_t sliding;        // TTL settings the value was written with (StorageTTL)
+        uint8_t refresh;
+        int64_t expiration;     // UNIX ms, 0 = never
+        int64_t ttl;            // ms, 0 if not written with a TTL
+
+        /** FNV-1a style, a word at a time (appends hash under the stripe lock, bytes would cost more than the copy) */
+        static uint32_t hash(const void* data, size_t size, uint64_t seed=14695981039346656037ull) {
+            const uint8_t* bytes=(const uint8_t*)data;
+            size_t n=0;
+            for(; n + 8<=size; n+=8) {
+                uint64_t word;
+                std::memcpy(&word, bytes + n, sizeof(word));
+                seed=(seed ^ word) * 1099511628211ull;
+                seed^=seed >> 29;
+            }
+            for(; n<size; n++) {
+                seed=(seed ^ bytes[n]) * 1099511628211ull;
+            }
+            return (uint32_t)(seed ^ (seed >> 32));
+        };
+    };
+
+    /**
+     * StorageJournal
+     * Write-ahead log of a cache, kept in a directory:
+     *
+     *   journal-<generation>-<stripe>.log    records appended since the snapshot of that generation
+     *   snapshot-<generation>.snap           the cache as of the start of <generation> (or later)
+     *
+     * Records go to an in-memory buffer per stripe (hash of the key), written out by group commits.
+     * Compaction starts a new generation, snapshots the cache and removes what the snapshot covers.
+     *
+     * A failed write or sync stops the journal for good: the batch may be torn or lost, and a later
+     * fsync() could succeed without it.  From then on append(), commit() and the rest throw the first
+     * failure, also one of the background flusher.
+     */
+    class StorageJournal {
+        public:
+            /**
+             * Open the journal in a directory, created if missing
+             *
+             * Existing files are left for recovery (recovery_snapshot(), recovery_logs()); new records go to
+             * a new generation.
+             *
+             * @throws StorageJournalError if the directory can't be used
+             */
+            StorageJournal(const std::string& directory, const StorageJournalOptions& options)
+                : directory(directory), options(options), snapshot_generation(0), generation(1), running(true), failed(false) {
+
+                #if defined(_WIN32)
+                _mkdir(directory.c_str());
+                #else
+                mkdir(directory.c_str(), 0755);
+                #endif
+                this->scan();
+                if(!this->logs.empty()) {
+                    this->generation=std::max<uint64_t>(this->generation, this->logs.rbegin()->first + 1);
+                }
+                this->generation=std::max<uint64_t>(this->generation, this->snapshot_generation + 1);
+                size_t count=1;
+                while(count < options.stripes) {
+                    count<<=1;
+                }
+                this->stripe_mask=count - 1;
+                this->stripes=new Stripe[count];
+                for(size_t n=0; n<count; n++) {
+                    this->stripes[n].generation=this->generation;
+                    this->stripes[n].buffer.reserve(options.sync_bytes);
+                }
+                if(options.sync!=FASTCACHE_JOURNAL_SYNC_ALWAYS) {
+                    this->flusher=boost::thread(&StorageJournal::flush_loop, this);
+                }
+            };
+            ~StorageJournal() {
+                {    // Scope for lock
+                    boost::unique_lock<boost::mutex> lock(this->wakeup_guard);
+                    this->running=false;
+                }
+                this->wakeup.notify_one();
+                if(this->flusher.joinable()) {
+                    this->flusher.join();
+                }
+                for(size_t n=0; n<=this->stripe_mask; n++) {
+                    try {
+                        this->flush(this->stripes[n], this->options.sync!=FASTCACHE_JOURNAL_SYNC_NONE);
+                    } catch(std::exception& e) {
+                        // Nowhere to report it
+                    }
+                    if(this->stripes[n].file) {
+                        std::fclose(this->stripes[n].file);
+                    }
+                }
+                delete[] this->stripes;
+            };
+            /** Stripe of a key's hash */
+            size_t stripe(size_t hash) const {
+                return hash & this->stripe_mask;
+            };
+            /** Do writers wait for their records to be durable (commit())? */
+            bool synchronous() const {
+                return this->options.sync==FASTCACHE_JOURNAL_SYNC_ALWAYS;
+            };
+            /**
+             * Append a record
+             *
+             * Cheap: a copy into the stripe's buffer.  Call in the order the writes are applied (i.e. under
+             * the shard lock), that is the order they are replayed in.
+             *
+             * @param stripe stripe(hash of the key)
+             * @param record the header: op (JournalRecord::SET, SET_EMPTY or DEL), size, key_size, expiration
+             *        and TTL settings.  The checksum is filled in here.
+             * @param fill called with the payload to fill in: record.size bytes
+             * @retval the record's sequence number, for commit()
+             * @throws StorageJournalError once the journal has failed, before anything is appended
+             */
+            template <class F>
+            uint64_t append(size_t stripe, JournalRecord record, F fill) {
+                this->check();
+                Stripe& target=this->stripes[stripe];
+                size_t span=sizeof(JournalRecord) + record.size;
+                uint64_t sequence;
+                bool full;
+                {    // Scope for lock
+                    boost::unique_lock<boost::mutex> lock(target.guard);
+                    size_t at=target.buffer.size();
+                    target.buffer.resize(at + span);
+                    uint8_t* out=&target.buffer[at];
+                    record.checksum=0;
+                    std::memcpy(out, &record, sizeof(record));
+                    fill(out + sizeof(record));
+                    record.checksum=JournalRecord::hash(out, span);
+                    std::memcpy(out, &record, sizeof(record));
+                    sequence=++target.appended;
+                    full=(target.buffer.size() >= this->options.sync_bytes);
+                }
+                if(full && !this->synchronous()) {
+                    this->wakeup.notify_one();
+                }
+                return sequence;
+            };
+            /**
+             * Wait until a stripe is durable up to a record
+             *
+             * Whoever comes first writes and syncs everything buffered so far, later callers find their
+             * records already covered: one fsync per group of concurrent writers.
+             *
+             * @throws StorageJournalError if the log can't be written, or the journal has failed before
+             */
+            void commit(size_t stripe, uint64_t sequence) {
+                this->check();
+                Stripe& target=this->stripes[stripe];
+                if(target.durable.load(std::memory_order_acquire) < sequence) {
+                    this->flush(target, true, sequence);
+                }
+            };
+            /** commit() everything appended to any stripe so far */
+            void commit_all() {
+                this->check();
+                for(size_t n=0; n<=this->stripe_mask; n++) {
+                    uint64_t appended;
+                    {    // Scope for lock
+                        boost::unique_lock<boost::mutex> lock(this->stripes[n].guard);
+                        appended=this->stripes[n].appended;
+                    }
+                    this->commit(n, appended);
+                }
+            };
+            /**
+             * Write and sync everything appended so far, whatever the policy
+             *
+             * @throws StorageJournalError if the log can't be written, also for earlier background failures
+             */
+            void sync() {
+                this->check();
+                for(size_t n=0; n<=this->stripe_mask; n++) {
+                    this->flush(this->stripes[n], true);
+                }
+            };
+            /** Snapshot to load before replaying recovery_logs(), empty if none */
+            std::string recovery_snapshot() const {
+                return this->snapshot_generation?this->snapshot_path(this->snapshot_generation):std::string();
+            };
+            /** Logs to replay after the snapshot, by generation (in order), the stripes of one in any order */
+            std::vector<std::vector<std::string> > recovery_logs() const {
+                std::vector<std::vector<std::string> > logs;
+                for(Logs::const_iterator it=this->logs.begin(); it!=this->logs.end(); ++it) {
+                    if(it->first >= this->snapshot_generation) {
+                        logs.push_back(it->second);
+                    }
+                }
+                return logs;
+            };
+            /**
+             * Read back a log
+             *
+             * Stops at the first incomplete or damaged record, which is where a crash cut the log off.
+             *
+             * @param path the log
+             * @param apply called with (const JournalRecord&, const uint8_t* payload) for each record
+             * @retval number of records read
+             */
+            template <class F>
+            static size_t replay(const std::string& path, F apply) {
+                std::FILE* file=std::fopen(path.c_str(), "rb");
+                if(!file) {
+                    return 0;
+                }
+                std::vector<uint8_t> content;
+                uint8_t chunk[65536];
+                for(size_t got; (got=std::fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+                    content.insert(content.end(), chunk, chunk + got);
+                }
+                std::fclose(file);
+                size_t count=0;
+                for(size_t at=0; content.size() - at >= sizeof(JournalRecord); count++) {
+                    JournalRecord record;
+                    std::memcpy(&record, &content[at], sizeof(record));
+                    if(record.size > content.size() - at - sizeof(record) || record.key_size > record.size) {
+                        break;
+                    }
+                    // Hashed as written, i.e. with the checksum field 0
+                    uint32_t checksum=record.checksum;
+                    record.checksum=0;
+                    std::memcpy(&content[at], &record, sizeof(record));
+                    if(JournalRecord::hash(&content[at], sizeof(record) + record.size)!=checksum) {
+                        break;
+                    }
+                    apply((const JournalRecord&)record, &content[at + sizeof(record)]);
+                    at+=sizeof(record) + record.size;
+                }
+                return count;
+            };
+            /**
+             * Compact: start a new generation, save a snapshot of it and remove the files it covers
+             *
+             * Records of the old generation were applied before the switch, so the snapshot (taken after
+             * it) includes them.  Records of the new generation are replayed over the snapshot.
+             *
+             * @param save writes the cache to the path given, returns the number of entries
+             * @retval what save returned
+             * @throws StorageJournalError if the log can't be written
+             */
+            template <class F>
+            size_t compact(F save) {
+                boost::unique_lock<boost::mutex> lock(this->compaction);
+                this->check();
+                uint64_t generation=++this->generation;
+                for(size_t n=0; n<=this->stripe_mask; n++) {
+                    this->flush(this->stripes[n], true, 0, generation);
+                }
+                size_t saved=save(this->snapshot_path(generation));
+                // The new snapshot is in place, everything before it can go
+                this->scan();
+                for(Logs::const_iterator it=this->logs.begin(); it!=this->logs.end(); ++it) {
+                    for(size_t n=0; it->first < generation && n<it->second.size(); n++) {
+                        std::remove(it->second[n].c_str());
+                    }
+                }
+                for(size_t n=0; n<this->snapshots.size(); n++) {
+                    if(this->snapshots[n] < generation) {
+                        std::remove(this->snapshot_path(this->snapshots[n]).c_str());
+                    }
+                }
+                this->scan();
+                return saved;
+            };
+
+        private:
+            typedef std::map<uint64_t, std::vector<std::string> > Logs;       // Generation -> stripe files
+
+            struct Stripe {
+                Stripe() : appended(0), durable(0), file(NULL), generation(0), created(false) {};
+
+                boost::mutex guard;         // buffer, appended
+                std::vector<uint8_t> buffer;
+                uint64_t appended;          // Sequence of the last record appended
+                boost::mutex flush_guard;   // Everything below
+                std::atomic<uint64_t> durable;  // Sequence of the last record synced
+                std::vector<uint8_t> spare; // The other buffer, being written
+                std::FILE* file;
+                uint64_t generation;        // Of file and the records in buffer
+                bool created;               // file is new, its directory entry not synced yet
+            };
+
+            StorageJournal(const StorageJournal&);
+            StorageJournal& operator=(const StorageJournal&);
+
+            std::string snapshot_path(uint64_t generation) const {
+                char name[64];
+                std::snprintf(name, sizeof(name), "/snapshot-%020llu.snap", (unsigned long long)generation);
+                return this->directory + name;
+            };
+            std::string log_path(uint64_t generation, size_t stripe) const {
+                char name[64];
+                std::snprintf(name, sizeof(name), "/journal-%020llu-%04u.log", (unsigned long long)generation, (unsigned int)stripe);
+                return this->directory + name;
+            };
+            /** Find the log and snapshot files of the directory */
+            void scan() {
+                this->logs.clear();
+                this->snapshots.clear();
+                this->snapshot_generation=0;
+                std::vector<std::string> names=list(this->directory);
+                for(size_t n=0; n<names.size(); n++) {
+                    unsigned long long generation;
+                    unsigned int stripe;
+                    char tail;
+                    if(std::sscanf(names[n].c_str(), "journal-%llu-%u.lo%c", &generation, &stripe, &tail)==3 && tail=='g') {
+                        this->logs[generation].push_back(this->directory + "/" + names[n]);
+                    } else if(std::sscanf(names[n].c_str(), "snapshot-%llu.sna%c", &generation, &tail)==2 && tail=='p') {
+                        this->snapshots.push_back(generation);
+                        this->snapshot_generation=std::max<uint64_t>(this->snapshot_generation, generation);
+                    }
+                }
+            };
+            static std::vector<std::string> list(const std::string& directory) {
+                std::vector<std::string> names;
+                #if defined(_WIN32)
+                WIN32_FIND_DATAA entry;
+                HANDLE find=FindFirstFileA((directory + "\\*").c_str(), &entry);
+                if(find==INVALID_HANDLE_VALUE) {
+                    throw StorageJournalError("Cannot read " + directory);
+                }
+                do {
+                    names.push_back(entry.cFileName);
+                } while(FindNextFileA(find, &entry));
+                FindClose(find);
+                #else
+                DIR* dir=opendir(directory.c_str());
+                if(!dir) {
+                    throw StorageJournalError("Cannot read " + directory + ": " + std::strerror(errno));
+                }
+                for(struct dirent* entry=readdir(dir); entry; entry=readdir(dir)) {
+                    names.push_back(entry->d_name);
+                }
+                closedir(dir);
+                #endif
+                return names;
+            };
+            /**
+             * Write out a stripe's buffer
+             *
+             * @param target the stripe
+             * @param durable fsync too
+             * @param sequence nothing to do if durable up to this record already (group commit), 0 to flush anyway
+             * @param generation switch to this generation after the buffer is out, 0 to stay
+             */
+            void flush(Stripe& target, bool durable, uint64_t sequence=0, uint64_t generation=0) {
+                boost::unique_lock<boost::mutex> lock(target.flush_guard);
+                // After a failure the batch in spare may be partly written or not synced, and a second fsync()
+                // could succeed without writing it: never touch it again
+                this->check();
+                if(sequence && target.durable.load(std::memory_order_acquire) >= sequence) {
+                    return;
+                }
+                uint64_t upto;
+                {    // Scope for lock
+                    boost::unique_lock<boost::mutex> buffer_lock(target.guard);
+                    target.spare.clear();
+                    target.spare.swap(target.buffer);
+                    upto=target.appended;
+                }
+                if(!target.spare.empty()) {
+                    if(!target.file) {
+                        std::string path=this->log_path(target.generation, &target - this->stripes);
+                        target.file=std::fopen(path.c_str(), "ab");
+                        if(!target.file) {
+                            this->fail("Cannot create " + path + ": " + std::strerror(errno));
+                        }
+                        target.created=true;
+                    }
+                    if(std::fwrite(&target.spare[0], 1, target.spare.size(), target.file)!=target.spare.size() || std::fflush(target.file)!=0) {
+                        this->fail(std::string("Cannot write journal: ") + std::strerror(errno));
+                    }
+                }
+                if(target.file && durable) {
+                    #if defined(_WIN32)
+                    if(_commit(_fileno(target.file))!=0) {
+                        this->fail(std::string("Cannot sync journal: ") + std::strerror(errno));
+                    }
+                    #else
+                    if(fsync(fileno(target.file))!=0) {
+                        this->fail(std::string("Cannot sync journal: ") + std::strerror(errno));
+                    }
+                    if(target.created) {
+                        // A new file is only durable with its directory entry
+                        int dir=open(this->directory.c_str(), O_RDONLY);
+                        if(dir < 0) {
+                            this->fail("Cannot open " + this->directory + ": " + std::strerror(errno));
+                        }
+                        if(fsync(dir)!=0) {
+                            int error=errno;
+                            close(dir);
+                            this->fail("Cannot sync " + this->directory + ": " + std::strerror(error));
+                        }
+                        close(dir);
+                    }
+                    #endif
+                    target.created=false;
+                }
+                if(durable) {
+                    target.durable.store(upto, std::memory_order_release);
+                }
+                if(generation) {
+                    if(target.file) {
+                        std::fclose(target.file);
+                        target.file=NULL;
+                    }
+                    target.generation=generation;
+                }
+            };
+            /** Group commits in the background: every sync_ms, or earlier once a buffer is full */
+            void flush_loop() {
+                boost::unique_lock<boost::mutex> lock(this->wakeup_guard);
+                while(this->running) {
+                    this->wakeup.timed_wait(lock, boost::posix_time::milliseconds(this->options.sync_ms));
+                    lock.unlock();
+                    try {
+                        for(size_t n=0; n<=this->stripe_mask; n++) {
+                            this->flush(this->stripes[n], this->options.sync==FASTCACHE_JOURNAL_SYNC_INTERVAL);
+                        }
+                    } catch(std::exception& e) {
+                        this->record_failure(e.what());
+                    }
+                    lock.lock();
+                }
+            };
+            /** Rethrow the failure that stopped the journal, if any */
+            void check() {
+                if(this->failed.load(std::memory_order_acquire)) {
+                    boost::unique_lock<boost::mutex> lock(this->failure_guard);
+                    throw StorageJournalError(this->failure);
+                }
+            };
+            /** Stop the journal for good: what is buffered or half written can't be made durable any more */
+            void record_failure(const std::string& what) {
+                boost::unique_lock<boost::mutex> lock(this->failure_guard);
+                if(this->failure.empty()) {
+                    this->failure=what;
+                }
+                this->failed.store(true, std::memory_order_release);
+            };
+            void fail(const std::string& what) {
+                this->record_failure(what);
+                throw StorageJournalError(what);
+            };
+
+            std::string directory;
+            StorageJournalOptions options;
+            Logs logs;
+            std::vector<uint64_t> snapshots;
+            uint64_t snapshot_generation;       // Newest snapshot, 0 if none
+            uint64_t generation;                // Written to by new records
+            Stripe* stripes;
+            size_t stripe_mask;
+            boost::mutex compaction;
+            boost::mutex wakeup_guard;
+            boost::condition_variable wakeup;
+            bool running;
+            boost::thread flusher;
+            boost::mutex failure_guard;
+            std::string failure;                // The first failure
+            std::atomic<bool> failed;           // Every call throws failure from then on
+    };
+};
+#endif
@@ -27,7 +27,8 @@ namespace Storage {
                 return _instance;
             }
             // Real storage holder
-            Storage::StorageCache<std::string, Storage::StorageItem> cache;
+            // Keys are field paths ("48.61.3"), indexed for ordered listing and prefix scans
+            Storage::StorageCache<std::string, Storage::StorageItem, Storage::FlatStore, Storage::PathKeyIndex> cache;
 
         private:
             static StorageManager* _instance;
@@ -0,0 +1,349 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageMessage.hpp - Bitmap driven (ISO8583 style) message parsing and ingestion into a cache
+#ifndef _STORAGEAPI_STORAGEMESSAGE_H_
+#define _STORAGEAPI_STORAGEMESSAGE_H_
+#include <stdint.h>
+#include <cstddef>
+#include <algorithm>
+#include <charconv>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "StorageCache.hpp"
+#include "StorageItem.hpp"
+
+/// [Definitions]
+// Highest field number: primary and secondary bitmap
+#define FASTCACHE_MESSAGE_FIELDS 128u
+
+// Deepest subfield nesting, e.g. 3 for "48.61.3"
+#ifndef FASTCACHE_MESSAGE_DEPTH
+#define FASTCACHE_MESSAGE_DEPTH 4u
+#endif
+
+namespace Storage {
+    // Field lengths
+    enum fastcache_fieldlength {
+        FASTCACHE_FIELD_FIXED,      // Always the field's size
+        FASTCACHE_FIELD_LLVAR,      // Two length digits (ASCII or EBCDIC), then up to size bytes
+        FASTCACHE_FIELD_LLLVAR      // Three length digits, then up to size bytes
+    };
+
+    /**
+     * StorageLayout
+     * Which fields a message (or a field made of subfields) has and how long they are.
+     *
+     * A bitmapped layout starts with field 0 (the message type, if defined) and an 8 byte bitmap, bit
+     * 1 (the high bit) announcing a second one for fields 65 ... 128; then come the fields whose bits
+     * are set.  Otherwise the defined fields follow each other in number order, as far as the data
+     * goes.  A field with subfields is parsed by their layout, and its subfields are reported under
+     * dotted keys, e.g. "48.61.3".
+     *
+     * parse() walks the input in place: keys are built in a local buffer and values are handed out
+     * as pointers into the input.
+     */
+    class StorageLayout {
+        public:
+            struct Field {
+                int fldno;                  // -1 if not defined
+                uint32_t descriptor;        // Id in StorageDescriptors
+                fastcache_fieldlength length;
+                size_t size;                // Fixed size or maximum
+                shared_ptr<const StorageLayout> subfields;
+            };
+
+            /** @param bitmapped fields announced by a bitmap, otherwise all in turn */
+            explicit StorageLayout(bool bitmapped=true) : bitmapped(bitmapped) {};
+            /**
+             * Define a field
+             *
+             * @param fldno field number, 0 ... 128 (not 1 if bitmapped, that bit announces the second bitmap)
+             * @param descriptor field descriptor
+             * @param length how the length is given
+             * @param size fixed size, or maximum for variable lengths
+             * @retval the layout, to chain definitions
+             * @throws std::out_of_range for a field number outside the layout
+             */
+            StorageLayout& field(int fldno, std::string_view descriptor, fastcache_fieldlength length, size_t size) {
+                if(fldno < 0 || fldno > (int)FASTCACHE_MESSAGE_FIELDS || (this->bitmapped && fldno==1)) {
+                    throw std::out_of_range("Field number outside the layout");
+                }
+                if(this->fields.size() <= (size_t)fldno) {
+                    Field undefined={-1, 0, FASTCACHE_FIELD_FIXED, 0, shared_ptr<const StorageLayout>()};
+                    this->fields.resize(fldno + 1, undefined);
+                }
+                Field& defined=this->fields[fldno];
+                defined.fldno=fldno;
+                defined.descriptor=StorageDescriptors::instance().intern(descriptor);
+                defined.length=length;
+                defined.size=size;
+                defined.subfields.reset();
+                return *this;
+            };
+            /**
+             * Define a field made of subfields
+             *
+             * @param subfields their layout, copied
+             */
+            StorageLayout& field(int fldno, std::string_view descriptor, fastcache_fieldlength length, size_t size, const StorageLayout& subfields) {
+                this->field(fldno, descriptor, length, size);
+                this->fields[fldno].subfields=boost::make_shared<StorageLayout>(subfields);
+                return *this;
+            };
+            /**
+             * Parse a message
+             *
+             * @param data the message
+             * @param size its length
+             * @param visit called as visit(std::string_view key, const Field&, const uint8_t* value, size_t length)
+             *        for every field without subfields, in message order; key and value point into buffers
+             *        that only live for the call
+             * @retval bytes parsed, the rest of data is left alone
+             * @throws std::length_error if the data ends inside a field
+             * @throws std::invalid_argument for a field not in the layout, or a bad length
+             */
+            template <class F>
+            size_t parse(const uint8_t* data, size_t size, F visit) const {
+                char path[FASTCACHE_MESSAGE_DEPTH * 4];
+                return this->parse(data, size, path, 0, 1, visit);
+            };
+
+        private:
+            /** Parse into path[0 ... length), depth levels deep */
+            template <class F>
+            size_t parse(const uint8_t* data, size_t size, char* path, size_t length, unsigned int depth, F& visit) const {
+                if(depth > FASTCACHE_MESSAGE_DEPTH) {
+                    throw std::invalid_argument("Subfields nested too deep");
+                }
+                size_t position=0;
+                if(!this->bitmapped) {
+                    for(size_t fldno=0; fldno<this->fields.size() && position<size; fldno++) {
+                        if(this->fields[fldno].fldno >= 0) {
+                            position+=this->read(this->fields[fldno], data + position, size - position, path, length, depth, visit);
+                        }
+                    }
+                    return position;
+                }
+                if(this->defined(0)) {
+                    position+=this->read(this->fields[0], data, size, path, length, depth, visit);
+                }
+                uint64_t bitmap[2]={this->bitmap(data, size, position), 0};
+                if(bitmap[0] >> 63) {
+                    bitmap[1]=this->bitmap(data, size, position);
+                }
+                bitmap[0]&=~((uint64_t)1 << 63);
+                for(size_t word=0; word<2; word++) {
+                    for(uint64_t bits=bitmap[word]; bits; ) {
+                        unsigned int bit=fastcache_clz64(bits);
+                        bits&=~((uint64_t)1 << (63 - bit));
+                        size_t fldno=word * 64 + bit + 1;
+                        if(!this->defined(fldno)) {
+                            throw std::invalid_argument("Field " + std::to_string(fldno) + " is not in the layout");
+                        }
+                        position+=this->read(this->fields[fldno], data + position, size - position, path, length, depth, visit);
+                    }
+                }
+                return position;
+            };
+            /** Read one field at data, appending its number to the path.  @retval bytes read */
+            template <class F>
+            size_t read(const Field& field, const uint8_t* data, size_t size, char* path, size_t length, unsigned int depth, F& visit) const {
+                size_t digits=(field.length==FASTCACHE_FIELD_LLVAR)?2:(field.length==FASTCACHE_FIELD_LLLVAR)?3:0;
+                size_t value=field.size;
+                if(digits) {
+                    if(size < digits) {
+                        throw std::length_error("Truncated message");
+                    }
+                    value=0;
+                    for(size_t n=0; n<digits; n++) {
+                        // '0' ... '9' in ASCII (0x30 ...) or EBCDIC (0xF0 ...)
+                        if(((data[n] & 0xF0)!=0x30 && (data[n] & 0xF0)!=0xF0) || (data[n] & 0x0F) > 9) {
+                            throw std::invalid_argument("Bad length digit in field " + std::to_string(field.fldno));
+                        }
+                        value=value * 10 + (data[n] & 0x0F);
+                    }
+                    if(value > field.size) {
+                        throw std::invalid_argument("Field " + std::to_string(field.fldno) + " is longer than its maximum");
+                    }
+                }
+                if(size - digits < value) {
+                    throw std::length_error("Truncated message");
+                }
+                if(length) {
+                    path[length++]='.';
+                }
+                length+=std::to_chars(path + length, path + length + 3, field.fldno).ptr - (path + length);
+                if(!field.subfields) {
+                    visit(std::string_view(path, length), field, data + digits, value);
+                } else if(field.subfields->parse(data + digits, value, path, length, depth + 1, visit)!=value) {
+                    throw std::invalid_argument("Subfields of field " + std::to_string(field.fldno) + " do not fill it");
+                }
+                return digits + value;
+            };
+            /** Read a bitmap, big endian.  @retval its bits, field 1 highest */
+            static uint64_t bitmap(const uint8_t* data, size_t size, size_t& position) {
+                if(size - position < 8) {
+                    throw std::length_error("Truncated message");
+                }
+                uint64_t bits=0;
+                for(size_t n=0; n<8; n++) {
+                    bits=(bits << 8) | data[position + n];
+                }
+                position+=8;
+                return bits;
+            };
+            bool defined(size_t fldno) const {
+                return fldno < this->fields.size() && this->fields[fldno].fldno >= 0;
+            };
+
+            bool bitmapped;
+            std::vector<Field> fields;      // By field number
+    };
+
+    /**
+     * StorageIngest
+     * Parses messages into StorageItems and writes each batch with one multi_emplace(), which locks
+     * every shard once and allocates each field together with its entry.
+     *
+     * feed() takes a byte stream of messages framed by a 2 byte big endian length.  Whole frames are
+     * parsed straight from the caller's buffer; only a frame split across feed() calls is copied, to
+     * be finished by the next call.  Keys are field paths ("3.1", "48.61.3"), so the cache must be
+     * keyed by std::string; a later message overwrites the fields of an earlier one.
+     */
+    template <class Cache>
+    class StorageIngest {
+        public:
+            /**
+             * @param cache the cache to write to
+             * @param layout the message layout, copied
+             * @param expiration UNIX timestamp for the written fields, 0 for none
+             * @param mode the write mode
+             */
+            StorageIngest(Cache& cache, const StorageLayout& layout, time_t expiration=0, const fastcache_writemode mode=FASTCACHE_WRITEMODE_WRITE_ALWAYS)
+                : cache(cache), layout(layout), expiration(expiration), mode(mode), fields(0) {};
+            /**
+             * Ingest one message, without framing
+             *
+             * @param data the message
+             * @param size its length
+             * @retval number of fields written
+             * @throws see StorageLayout::parse(); nothing is written then
+             */
+            size_t message(const uint8_t* data, size_t size) {
+                Batch batch;
+                batch.reserve(this->fields);
+                this->parse(batch, data, size);
+                return this->write(batch);
+            };
+            /**
+             * Ingest the complete frames of a stream
+             *
+             * A frame that fails to parse is skipped; the others are written and then the first error
+             * is thrown.
+             *
+             * @param data the next stream bytes
+             * @param size their length
+             * @retval number of fields written
+             */
+            size_t feed(const uint8_t* data, size_t size) {
+                Batch batch;
+                batch.reserve(this->fields);
+                std::exception_ptr error;
+                if(!this->partial.empty()) {
+                    size_t taken=this->complete(data, size);
+                    data+=taken;
+                    size-=taken;
+                    if(this->partial.size() < PREFIX || this->partial.size() < PREFIX + frame(this->partial.data())) {
+                        return 0;
+                    }
+                    this->frame_of(batch, this->partial.data() + PREFIX, this->partial.size() - PREFIX, error);
+                    this->partial.clear();
+                }
+                while(size >= PREFIX && size - PREFIX >= frame(data)) {
+                    size_t length=frame(data);
+                    this->frame_of(batch, data + PREFIX, length, error);
+                    data+=PREFIX + length;
+                    size-=PREFIX + length;
+                }
+                this->partial.assign(data, data + size);
+                size_t written=this->write(batch);
+                if(error) {
+                    std::rethrow_exception(error);
+                }
+                return written;
+            };
+            /** Bytes of an incomplete frame kept for the next feed() */
+            size_t pending() const {
+                return this->partial.size();
+            };
+
+        private:
+            typedef std::vector<std::pair<std::string, StorageItem> > Batch;
+
+            static const size_t PREFIX=2;
+
+            static size_t frame(const uint8_t* prefix) {
+                return ((size_t)prefix[0] << 8) | prefix[1];
+            };
+            /** Append to the split frame until it is whole.  @retval bytes taken */
+            size_t complete(const uint8_t* data, size_t size) {
+                size_t taken=0;
+                if(this->partial.size() < PREFIX) {
+                    taken=std::min(size, PREFIX - this->partial.size());
+                    this->partial.insert(this->partial.end(), data, data + taken);
+                    if(this->partial.size() < PREFIX) {
+                        return taken;
+                    }
+                }
+                size_t missing=PREFIX + frame(this->partial.data()) - this->partial.size();
+                size_t more=std::min(size - taken, missing);
+                this->partial.insert(this->partial.end(), data + taken, data + taken + more);
+                return taken + more;
+            };
+            /** Parse a frame into the batch; on failure drop its fields and keep the first error */
+            void frame_of(Batch& batch, const uint8_t* data, size_t size, std::exception_ptr& error) {
+                size_t before=batch.size();
+                try {
+                    this->parse(batch, data, size);
+                } catch(const std::exception&) {
+                    batch.resize(before);
+                    if(!error) {
+                        error=std::current_exception();
+                    }
+                }
+            };
+            void parse(Batch& batch, const uint8_t* data, size_t size) {
+                size_t parsed=this->layout.parse(data, size, [&batch](std::string_view key, const StorageLayout::Field& field, const uint8_t* value, size_t length) {
+                    batch.emplace_back(std::string(key), StorageItem());
+                    StorageItem& item=batch.back().second;
+                    item.fldno=field.fldno;
+                    item.set_descriptor_id(field.descriptor);
+                    item.set_raw(value, length);
+                });
+                if(parsed!=size) {
+                    throw std::invalid_argument("Bytes left after the last field");
+                }
+            };
+            size_t write(Batch& batch) {
+                if(batch.empty()) {
+                    return 0;
+                }
+                this->fields=batch.size();
+                return this->cache.multi_emplace(std::move(batch), this->expiration, this->mode);
+            };
+
+            Cache& cache;
+            const StorageLayout layout;
+            const time_t expiration;
+            const fastcache_writemode mode;
+            size_t fields;      // In the last batch, to size the next
+            std::vector<uint8_t> partial;       // Split frame, prefix included
+    };
+};
+#endif
@@ -0,0 +1,65 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageSerializer.hpp - Byte representation of keys and values (snapshots)
+#ifndef _STORAGEAPI_STORAGESERIALIZER_H_
+#define _STORAGEAPI_STORAGESERIALIZER_H_
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace Storage {
+    /**
+     * StorageSerializer
+     * How a key or value type is written to and read from a snapshot.
+     *
+     * Specializations provide
+     *   static size_t size(const T&)                          bytes write() produces
+     *   static void write(const T&, uint8_t* out)
+     *   static T read(const uint8_t* in, size_t size)      throws std::length_error if size is too short
+     * The format is native (host byte order); snapshots move between processes, not architectures.
+     */
+    template <class T, class Enable=void>
+    struct StorageSerializer;
+
+    /** Arithmetic types and enums: their bytes */
+    template <class T>
+    struct StorageSerializer<T, typename std::enable_if<std::is_arithmetic<T>::value || std::is_enum<T>::value>::type> {
+        static size_t size(const T& /* value */) {
+            return sizeof(T);
+        };
+        static void write(const T& value, uint8_t* out) {
+            std::memcpy(out, &value, sizeof(T));
+        };
+        /** @throws std::length_error if size doesn't cover a T */
+        static T read(const uint8_t* in, size_t size) {
+            if(size < sizeof(T)) {
+                throw std::length_error("Truncated value");
+            }
+            T value;
+            std::memcpy(&value, in, sizeof(T));
+            return value;
+        };
+    };
+
+    /** Strings: their characters */
+    template <>
+    struct StorageSerializer<std::string> {
+        static size_t size(const std::string& value) {
+            return value.size();
+        };
+        static void write(const std::string& value, uint8_t* out) {
+            if(!value.empty()) {
+                std::memcpy(out, value.data(), value.size());
+            }
+        };
+        static std::string read(const uint8_t* in, size_t size) {
+            return std::string((const char*)in, size);
+        };
+    };
+};
+#endif
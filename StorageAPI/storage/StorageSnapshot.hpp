@@ -0,0 +1,350 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageSnapshot.hpp - Snapshot files: written shard by shard, read through a memory map
+#ifndef _STORAGEAPI_STORAGESNAPSHOT_H_
+#define _STORAGEAPI_STORAGESNAPSHOT_H_
+#include <stdint.h>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(_WIN32)
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Storage {
+    /** A snapshot could not be written or read */
+    struct StorageSnapshotError : std::runtime_error {
+        explicit StorageSnapshotError(const std::string& what) : std::runtime_error(what) {};
+    };
+
+    /**
+     * Snapshot layout (host byte order, everything 8 byte aligned):
+     *
+     *   SnapshotHeader
+     *   SnapshotSection[header.sections]         one per shard of the writing cache
+     *   records of section 0, section 1, ...
+     *
+     * A record is a SnapshotRecord followed by the key and the value bytes (StorageSerializer),
+     * padded to 8 bytes.  Nothing needs to be parsed up front but the record lengths.
+     */
+    struct SnapshotHeader {
+        char magic[8];              // FASTCACHE_SNAPSHOT_MAGIC
+        uint32_t version;
+        uint32_t sections;
+        uint64_t entries;
+        int64_t created;            // UNIX ms
+    };
+    struct SnapshotSection {
+        uint64_t offset;            // From the start of the file
+        uint64_t size;
+        uint64_t entries;
+    };
+    struct SnapshotRecord {
+        uint32_t key_size;
+        uint32_t value_size;
+        int64_t expiration;         // UNIX ms, 0 = never
+        int64_t ttl;                // ms, 0 if not written with a TTL (StorageTTL)
+        uint8_t sliding;
+        uint8_t refresh;
+        uint8_t reserved[6];
+
+        /** Bytes of a record incl. padding */
+        static size_t span(size_t key_size, size_t value_size) {
+            return (sizeof(SnapshotRecord) + key_size + value_size + 7) & ~(size_t)7;
+        };
+        /**
+         * Append a record to a section buffer
+         *
+         * @param record the header, key_size and value_size set
+         * @retval where the key goes; the value follows it
+         */
+        static uint8_t* append(std::vector<uint8_t>& buffer, const SnapshotRecord& record) {
+            size_t at=buffer.size();
+            buffer.resize(at + span(record.key_size, record.value_size), 0);
+            std::memcpy(&buffer[at], &record, sizeof(record));
+            return &buffer[at + sizeof(record)];
+        };
+    };
+    #define FASTCACHE_SNAPSHOT_MAGIC "FCSNAP\0\0"
+    #define FASTCACHE_SNAPSHOT_VERSION 2u
+
+    /**
+     * SnapshotWriter
+     * Writes a snapshot to `path`.tmp and renames it over `path` on commit(), so a crash leaves the
+     * previous snapshot intact.  commit() returns once the file and its directory entry are on disk.
+     */
+    class SnapshotWriter {
+        public:
+            /**
+             * @param path the snapshot file
+             * @param sections number of sections append() will be called for
+             * @throws StorageSnapshotError if the file can't be created
+             */
+            SnapshotWriter(const std::string& path, size_t sections)
+                : path(path), temporary(path + ".tmp"), directory(sections), offset(0), entries(0) {
+
+                this->file=std::fopen(this->temporary.c_str(), "wb");
+                if(!this->file) {
+                    throw StorageSnapshotError("Cannot create " + this->temporary + ": " + std::strerror(errno));
+                }
+                // Header and directory are written last, reserve their room
+                this->offset=sizeof(SnapshotHeader) + sections * sizeof(SnapshotSection);
+                std::vector<uint8_t> room(this->offset, 0);
+                this->write(&room[0], room.size());
+            };
+            ~SnapshotWriter() {
+                if(this->file) {
+                    std::fclose(this->file);
+                    std::remove(this->temporary.c_str());
+                }
+            };
+            /** Write the next section */
+            void append(const std::vector<uint8_t>& records, uint64_t count) {
+                SnapshotSection& section=this->directory[this->next++];
+                section.offset=this->offset;
+                section.size=records.size();
+                section.entries=count;
+                if(!records.empty()) {
+                    this->write(&records[0], records.size());
+                }
+                this->offset+=records.size();
+                this->entries+=count;
+            };
+            /**
+             * Finish the file, flush it to disk and put it in place
+             *
+             * @param created UNIX ms to record
+             */
+            void commit(int64_t created) {
+                SnapshotHeader header;
+                std::memset(&header, 0, sizeof(header));
+                std::memcpy(header.magic, FASTCACHE_SNAPSHOT_MAGIC, sizeof(header.magic));
+                header.version=FASTCACHE_SNAPSHOT_VERSION;
+                header.sections=(uint32_t)this->directory.size();
+                header.entries=this->entries;
+                header.created=created;
+                if(std::fseek(this->file, 0, SEEK_SET)!=0) {
+                    this->fail("seek");
+                }
+                this->write(&header, sizeof(header));
+                if(!this->directory.empty()) {
+                    this->write(&this->directory[0], this->directory.size() * sizeof(SnapshotSection));
+                }
+                if(std::fflush(this->file)!=0) {
+                    this->fail("flush");
+                }
+                // Never rename a file that may not be on disk over the previous snapshot
+                #if defined(_WIN32)
+                if(_commit(_fileno(this->file))!=0) {
+                    this->fail("sync");
+                }
+                #else
+                if(fsync(fileno(this->file))!=0) {
+                    this->fail("sync");
+                }
+                #endif
+                int closed=std::fclose(this->file);
+                this->file=NULL;        // Gone either way
+                if(closed!=0) {
+                    int error=errno;
+                    std::remove(this->temporary.c_str());
+                    errno=error;
+                    this->fail("close");
+                }
+                #if defined(_WIN32)
+                // rename() doesn't replace on Windows, and removing first would leave no snapshot for a moment
+                if(!MoveFileExA(this->temporary.c_str(), this->path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+                    DWORD error=GetLastError();
+                    std::remove(this->temporary.c_str());
+                    throw StorageSnapshotError("Cannot rename " + this->temporary + ": error " + std::to_string(error));
+                }
+                #else
+                if(std::rename(this->temporary.c_str(), this->path.c_str())!=0) {
+                    int error=errno;
+                    std::remove(this->temporary.c_str());
+                    throw StorageSnapshotError("Cannot rename " + this->temporary + ": " + std::strerror(error));
+                }
+                // The rename is only durable with its directory entry
+                std::string directory=this->path.substr(0, this->path.find_last_of('/') + 1);
+                if(directory.empty()) {
+                    directory=".";
+                }
+                int dir=open(directory.c_str(), O_RDONLY);
+                if(dir < 0) {
+                    throw StorageSnapshotError("Cannot open " + directory + ": " + std::strerror(errno));
+                }
+                if(fsync(dir)!=0) {
+                    int error=errno;
+                    close(dir);
+                    throw StorageSnapshotError("Cannot sync " + directory + ": " + std::strerror(error));
+                }
+                close(dir);
+                #endif
+            };
+
+        private:
+            SnapshotWriter(const SnapshotWriter&);
+            SnapshotWriter& operator=(const SnapshotWriter&);
+
+            void write(const void* data, size_t size) {
+                if(std::fwrite(data, 1, size, this->file)!=size) {
+                    this->fail("write");
+                }
+            };
+            void fail(const char* what) {
+                throw StorageSnapshotError(std::string("Cannot ") + what + " " + this->temporary + ": " + std::strerror(errno));
+            };
+
+            std::string path;
+            std::string temporary;
+            std::FILE* file;
+            std::vector<SnapshotSection> directory;
+            size_t next=0;
+            uint64_t offset;
+            uint64_t entries;
+    };
+
+    /**
+     * SnapshotFile
+     * A snapshot mapped read-only into memory.  Pages are only read once records are touched.
+     */
+    class SnapshotFile {
+        public:
+            /**
+             * @param path the snapshot file
+             * @throws StorageSnapshotError if it can't be mapped or its header or directory are broken
+             */
+            explicit SnapshotFile(const std::string& path) : data(NULL), size(0) {
+                #if defined(_WIN32)
+                this->handle=CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+                if(this->handle==INVALID_HANDLE_VALUE) {
+                    throw StorageSnapshotError("Cannot open " + path);
+                }
+                LARGE_INTEGER length;
+                GetFileSizeEx(this->handle, &length);
+                this->size=(size_t)length.QuadPart;
+                this->mapping=this->size?CreateFileMappingA(this->handle, NULL, PAGE_READONLY, 0, 0, NULL):NULL;
+                if(this->mapping) {
+                    this->data=(const uint8_t*)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+                }
+                #else
+                int fd=open(path.c_str(), O_RDONLY);
+                if(fd < 0) {
+                    throw StorageSnapshotError("Cannot open " + path + ": " + std::strerror(errno));
+                }
+                struct stat status;
+                if(fstat(fd, &status)==0 && status.st_size > 0) {
+                    this->size=(size_t)status.st_size;
+                    void* mapped=mmap(NULL, this->size, PROT_READ, MAP_SHARED, fd, 0);
+                    this->data=(mapped==MAP_FAILED)?NULL:(const uint8_t*)mapped;
+                }
+                close(fd);
+                #endif
+                if(!this->data) {
+                    this->unmap();
+                    throw StorageSnapshotError("Cannot map " + path);
+                }
+                if(!this->valid()) {
+                    this->unmap();
+                    throw StorageSnapshotError(path + " is not a valid snapshot");
+                }
+            };
+            ~SnapshotFile() {
+                this->unmap();
+            };
+            const SnapshotHeader& header() const {
+                return *(const SnapshotHeader*)this->data;
+            };
+            const SnapshotSection& section(size_t index) const {
+                return ((const SnapshotSection*)(this->data + sizeof(SnapshotHeader)))[index];
+            };
+            /**
+             * Step through the records of a section
+             *
+             * @param cursor position in the section, start at section(n).offset
+             * @param end section(n).offset + section(n).size
+             * @param record receives the record header
+             * @param key receives the key bytes (the value follows them)
+             * @retval false at the end of the section
+             * @throws StorageSnapshotError if a record runs past its section
+             */
+            bool next(uint64_t& cursor, uint64_t end, SnapshotRecord& record, const uint8_t*& key) const {
+                if(cursor >= end) {
+                    return false;
+                }
+                if(end - cursor < sizeof(SnapshotRecord)) {
+                    throw StorageSnapshotError("Truncated snapshot record");
+                }
+                std::memcpy(&record, this->data + cursor, sizeof(record));
+                size_t span=SnapshotRecord::span(record.key_size, record.value_size);
+                if(end - cursor < span) {
+                    throw StorageSnapshotError("Truncated snapshot record");
+                }
+                key=this->data + cursor + sizeof(SnapshotRecord);
+                cursor+=span;
+                return true;
+            };
+
+        private:
+            SnapshotFile(const SnapshotFile&);
+            SnapshotFile& operator=(const SnapshotFile&);
+
+            bool valid() const {
+                if(this->size < sizeof(SnapshotHeader)) {
+                    return false;
+                }
+                const SnapshotHeader& header=this->header();
+                if(std::memcmp(header.magic, FASTCACHE_SNAPSHOT_MAGIC, sizeof(header.magic))!=0 || header.version!=FASTCACHE_SNAPSHOT_VERSION) {
+                    return false;
+                }
+                if((this->size - sizeof(SnapshotHeader)) / sizeof(SnapshotSection) < header.sections) {
+                    return false;
+                }
+                for(size_t n=0; n<header.sections; n++) {
+                    const SnapshotSection& section=this->section(n);
+                    if(section.offset > this->size || section.size > this->size - section.offset || (section.offset & 7)) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+            void unmap() {
+                #if defined(_WIN32)
+                if(this->data) {
+                    UnmapViewOfFile(this->data);
+                }
+                if(this->mapping) {
+                    CloseHandle(this->mapping);
+                }
+                CloseHandle(this->handle);
+                this->mapping=NULL;
+                this->handle=INVALID_HANDLE_VALUE;
+                #else
+                if(this->data) {
+                    munmap((void*)this->data, this->size);
+                }
+                #endif
+                this->data=NULL;
+            };
+
+            const uint8_t* data;
+            size_t size;
+            #if defined(_WIN32)
+            HANDLE handle;
+            HANDLE mapping;
+            #endif
+    };
+};
+#endif
@@ -0,0 +1,251 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageStats.hpp - Cache counters, sampled latency histograms and their Prometheus text form
+#ifndef _STORAGEAPI_STORAGESTATS_H_
+#define _STORAGEAPI_STORAGESTATS_H_
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include "StorageTable.hpp"
+
+/// [Definitions]
+// One in this many get()/set() calls per thread is timed (power of two), 0 to time none
+#ifndef FASTCACHE_STATS_SAMPLE
+#define FASTCACHE_STATS_SAMPLE 64u
+#endif
+
+// Copies of each histogram, so timing threads rarely share a cache line
+#ifndef FASTCACHE_STATS_STRIPES
+#define FASTCACHE_STATS_STRIPES 8u
+#endif
+
+namespace Storage {
+    /** Percentiles of a latency histogram, in ns */
+    struct StorageLatency {
+        uint64_t count;         // Samples, not calls (see FASTCACHE_STATS_SAMPLE)
+        double mean;
+        uint64_t p50;
+        uint64_t p90;
+        uint64_t p99;
+        uint64_t p999;
+        uint64_t max;
+        uint64_t sum;
+    };
+
+    /** Counters of a cache, see StorageCache::stats() */
+    struct StorageCacheStats {
+        uint64_t hits=0;
+        uint64_t misses=0;
+        uint64_t evictions=0;
+        double hit_rate=0.0;            // hits / (hits + misses)
+        double evictions_per_sec=0.0;   // Since construction
+        uint64_t entries=0;             // Incl. expired ones not removed yet
+        uint64_t inserts=0;             // Writes of new keys
+        uint64_t overwrites=0;          // Writes replacing an entry
+        uint64_t deletes=0;
+        uint64_t expirations=0;         // Removed by the curator
+        uint64_t contention=0;          // Lock acquisitions and optimistic reads that had to wait or retry
+        StorageLatency get_latency={0, 0.0, 0, 0, 0, 0, 0, 0};
+        StorageLatency set_latency={0, 0.0, 0, 0, 0, 0, 0, 0};
+    };
+
+    /**
+     * LatencyHistogram
+     * HDR-style histogram of durations in ns: 16 linear sub-buckets per power of two, so any value is
+     * within 6.25% of its bucket.  Recording is one relaxed increment into the calling thread's stripe.
+     */
+    class LatencyHistogram {
+        public:
+            static const unsigned int SUB_BITS=4;
+            static const unsigned int SUB=1u << SUB_BITS;
+            static const unsigned int MAX_EXPONENT=42;      // ~73 minutes, longer durations are clamped
+            static const unsigned int BUCKETS=(MAX_EXPONENT - SUB_BITS + 2) * SUB;
+
+            LatencyHistogram() {
+                for(unsigned int s=0; s<FASTCACHE_STATS_STRIPES; s++) {
+                    for(unsigned int b=0; b<BUCKETS; b++) {
+                        this->stripes[s].counts[b].store(0, std::memory_order_relaxed);
+                    }
+                    this->stripes[s].sum.store(0, std::memory_order_relaxed);
+                }
+            };
+            void record(uint64_t ns) {
+                Stripe& stripe=this->stripes[stripe_of_thread()];
+                stripe.counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+                stripe.sum.fetch_add(ns, std::memory_order_relaxed);
+            };
+            /** Percentiles over everything recorded so far.  Taken without stopping writers. */
+            StorageLatency summary() const {
+                StorageLatency latency={0, 0.0, 0, 0, 0, 0, 0, 0};
+                uint64_t counts[BUCKETS];
+                for(unsigned int b=0; b<BUCKETS; b++) {
+                    counts[b]=0;
+                    for(unsigned int s=0; s<FASTCACHE_STATS_STRIPES; s++) {
+                        counts[b]+=this->stripes[s].counts[b].load(std::memory_order_relaxed);
+                    }
+                    latency.count+=counts[b];
+                    if(counts[b]) {
+                        latency.max=upper(b);
+                    }
+                }
+                for(unsigned int s=0; s<FASTCACHE_STATS_STRIPES; s++) {
+                    latency.sum+=this->stripes[s].sum.load(std::memory_order_relaxed);
+                }
+                if(latency.count) {
+                    latency.mean=(double)latency.sum / latency.count;
+                    latency.p50=percentile(counts, latency.count, 0.5);
+                    latency.p90=percentile(counts, latency.count, 0.9);
+                    latency.p99=percentile(counts, latency.count, 0.99);
+                    latency.p999=percentile(counts, latency.count, 0.999);
+                }
+                return latency;
+            };
+            /** Bucket of a value */
+            static unsigned int bucket(uint64_t ns) {
+                if(ns < SUB) {
+                    return (unsigned int)ns;
+                }
+                unsigned int exponent=63 - fastcache_clz64(ns);
+                if(exponent > MAX_EXPONENT) {
+                    return BUCKETS - 1;
+                }
+                return (exponent - SUB_BITS + 1) * SUB + (unsigned int)((ns >> (exponent - SUB_BITS)) & (SUB - 1));
+            };
+            /** Largest value of a bucket */
+            static uint64_t upper(unsigned int bucket) {
+                if(bucket < SUB) {
+                    return bucket;
+                }
+                unsigned int exponent=bucket / SUB + SUB_BITS - 1;
+                uint64_t lower=(uint64_t)(SUB + bucket % SUB) << (exponent - SUB_BITS);
+                return lower + ((uint64_t)1 << (exponent - SUB_BITS)) - 1;
+            };
+            /** Is this call of the calling thread one to time? */
+            static bool sample() {
+                #if FASTCACHE_STATS_SAMPLE
+                static thread_local uint32_t calls=0;
+                return (calls++ & (FASTCACHE_STATS_SAMPLE - 1))==0;
+                #else
+                return false;
+                #endif
+            };
+
+        private:
+            struct alignas(64) Stripe {
+                std::atomic<uint64_t> counts[BUCKETS];
+                std::atomic<uint64_t> sum;
+            };
+
+            static unsigned int stripe_of_thread() {
+                static std::atomic<unsigned int> next(0);
+                static thread_local unsigned int stripe=next.fetch_add(1, std::memory_order_relaxed) % FASTCACHE_STATS_STRIPES;
+                return stripe;
+            };
+            static uint64_t percentile(const uint64_t* counts, uint64_t total, double q) {
+                uint64_t rank=(uint64_t)(q * total + 0.5), seen=0;
+                if(rank==0) {
+                    rank=1;
+                }
+                for(unsigned int b=0; b<BUCKETS; b++) {
+                    seen+=counts[b];
+                    if(seen >= rank) {
+                        return upper(b);
+                    }
+                }
+                return upper(BUCKETS - 1);
+            };
+
+            Stripe stripes[FASTCACHE_STATS_STRIPES];
+    };
+
+    /** Times its scope into a histogram, if sampled */
+    class LatencyTimer {
+        public:
+            explicit LatencyTimer(LatencyHistogram& histogram) : histogram(histogram), sampled(LatencyHistogram::sample()) {
+                if(this->sampled) {
+                    this->start=std::chrono::steady_clock::now();
+                }
+            };
+            ~LatencyTimer() {
+                if(this->sampled) {
+                    this->histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count());
+                }
+            };
+
+        private:
+            LatencyTimer(const LatencyTimer&);
+            LatencyTimer& operator=(const LatencyTimer&);
+
+            LatencyHistogram& histogram;
+            bool sampled;
+            std::chrono::steady_clock::time_point start;
+    };
+
+    /**
+     * Stats in the Prometheus text exposition format (version 0.0.4)
+     *
+     * Counters become <prefix>_<name>_total, entries a gauge, latencies summaries in seconds.
+     *
+     * @param stats from StorageCache::stats()
+     * @param prefix metric name prefix
+     * @param labels added to every sample, e.g. "cache=\"fields\"", empty for none
+     */
+    inline std::string fastcache_prometheus(const StorageCacheStats& stats, const std::string& prefix="fastcache", const std::string& labels="") {
+        std::string text;
+        char line[1024];
+        const std::string plain=labels.empty()?std::string():"{" + labels + "}";
+        const std::string joined=labels.empty()?std::string():labels + ",";
+        struct Counter {
+            const char* name;
+            const char* help;
+            uint64_t value;
+        } counters[]={
+            {"hits", "Lookups that found a live entry", stats.hits},
+            {"misses", "Lookups that found nothing or an expired entry", stats.misses},
+            {"inserts", "Writes of new keys", stats.inserts},
+            {"overwrites", "Writes replacing an entry", stats.overwrites},
+            {"deletes", "Entries deleted", stats.deletes},
+            {"evictions", "Entries evicted for capacity", stats.evictions},
+            {"expirations", "Expired entries removed", stats.expirations},
+            {"contention", "Lock acquisitions and optimistic reads that had to wait or retry", stats.contention},
+        };
+        for(size_t n=0; n<sizeof(counters) / sizeof(counters[0]); n++) {
+            std::snprintf(line, sizeof(line), "# HELP %s_%s_total %s\n# TYPE %s_%s_total counter\n%s_%s_total%s %llu\n",
+                          prefix.c_str(), counters[n].name, counters[n].help, prefix.c_str(), counters[n].name,
+                          prefix.c_str(), counters[n].name, plain.c_str(), (unsigned long long)counters[n].value);
+            text+=line;
+        }
+        std::snprintf(line, sizeof(line), "# HELP %s_entries Entries held\n# TYPE %s_entries gauge\n%s_entries%s %llu\n",
+                      prefix.c_str(), prefix.c_str(), prefix.c_str(), plain.c_str(), (unsigned long long)stats.entries);
+        text+=line;
+        struct Summary {
+            const char* name;
+            const StorageLatency* latency;
+        } summaries[]={{"get", &stats.get_latency}, {"set", &stats.set_latency}};
+        for(size_t n=0; n<sizeof(summaries) / sizeof(summaries[0]); n++) {
+            const StorageLatency& latency=*summaries[n].latency;
+            std::snprintf(line, sizeof(line), "# HELP %s_%s_latency_seconds %s() latency, sampled\n# TYPE %s_%s_latency_seconds summary\n",
+                          prefix.c_str(), summaries[n].name, summaries[n].name, prefix.c_str(), summaries[n].name);
+            text+=line;
+            const struct {
+                const char* q;
+                uint64_t ns;
+            } quantiles[]={{"0.5", latency.p50}, {"0.9", latency.p90}, {"0.99", latency.p99}, {"0.999", latency.p999}};
+            for(size_t q=0; q<sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                std::snprintf(line, sizeof(line), "%s_%s_latency_seconds{%squantile=\"%s\"} %.9f\n",
+                              prefix.c_str(), summaries[n].name, joined.c_str(), quantiles[q].q, quantiles[q].ns / 1e9);
+                text+=line;
+            }
+            std::snprintf(line, sizeof(line), "%s_%s_latency_seconds_sum%s %.9f\n%s_%s_latency_seconds_count%s %llu\n",
+                          prefix.c_str(), summaries[n].name, plain.c_str(), latency.sum / 1e9,
+                          prefix.c_str(), summaries[n].name, plain.c_str(), (unsigned long long)latency.count);
+            text+=line;
+        }
+        return text;
+    };
+};
+#endif
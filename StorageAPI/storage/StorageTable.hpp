@@ -0,0 +1,656 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageTable.hpp - Shard stores (open-addressing flat table, ordered map)
+#ifndef _STORAGEAPI_STORAGETABLE_H_
+#define _STORAGEAPI_STORAGETABLE_H_
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <boost/functional/hash.hpp>
+#include "StorageEpoch.hpp"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define FASTCACHE_TABLE_SSE2 1
+#endif
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+namespace Storage {
+    /**
+     * Control bytes
+     *
+     * Every slot of a FlatTable has one control byte.  Full slots hold the low 7 bits
+     * of the (mixed) hash, so a probe rejects almost every foreign slot without ever
+     * touching the node.  Empty and deleted slots have the sign bit set.
+     */
+    enum fastcache_ctrl {
+        FASTCACHE_CTRL_EMPTY=-128,
+        FASTCACHE_CTRL_DELETED=-2
+    };
+
+    /** Number of control bytes probed at once */
+    static const size_t FASTCACHE_GROUP_WIDTH=16u;
+
+    /**
+     * StorageHash
+     * Key hash of a cache.  Lookups may pass any type that compares equal to Key; it has to
+     * hash the same way, which is what the specializations guarantee.
+     */
+    template <class Key>
+    struct StorageHash {
+        template <class K>
+        size_t operator()(const K& key) const {
+            return boost::hash<Key>()(key);
+        };
+    };
+    /** Strings hash their characters, so std::string, std::string_view and C strings agree */
+    template <>
+    struct StorageHash<std::string> {
+        size_t operator()(std::string_view key) const {
+            return boost::hash_range(key.begin(), key.end());
+        };
+    };
+
+    /** Index of the lowest set bit (mask must not be 0) */
+    inline unsigned fastcache_ctz(uint32_t mask) {
+        #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (unsigned)index;
+        #else
+        return (unsigned)__builtin_ctz(mask);
+        #endif
+    };
+
+    /** Number of zero bits above the highest set bit (mask must not be 0) */
+    inline unsigned fastcache_clz64(uint64_t mask) {
+        #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, mask);
+        return 63u - (unsigned)index;
+        #else
+        return (unsigned)__builtin_clzll(mask);
+        #endif
+    };
+
+    /** Index of the lowest set bit (mask must not be 0) */
+    inline unsigned fastcache_ctz64(uint64_t mask) {
+        #if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, mask);
+        return (unsigned)index;
+        #else
+        return (unsigned)__builtin_ctzll(mask);
+        #endif
+    };
+
+    /** Number of set bits */
+    inline unsigned fastcache_popcount64(uint64_t mask) {
+        #if defined(_MSC_VER)
+        // __popcnt64 needs a POPCNT capable CPU, count by halves instead
+        mask=mask - ((mask >> 1) & 0x5555555555555555ull);
+        mask=(mask & 0x3333333333333333ull) + ((mask >> 2) & 0x3333333333333333ull);
+        mask=(mask + (mask >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+        return (unsigned)((mask * 0x0101010101010101ull) >> 56);
+        #else
+        return (unsigned)__builtin_popcountll(mask);
+        #endif
+    };
+
+    /** Number of zero bits above the highest set bit of a group mask */
+    inline unsigned fastcache_clz_group(uint32_t mask) {
+        unsigned n=0;
+        for(uint32_t bit=1u << (FASTCACHE_GROUP_WIDTH - 1); bit && !(mask & bit); bit>>=1) {
+            ++n;
+        }
+        return n;
+    };
+
+    /**
+     * CtrlGroup
+     * FASTCACHE_GROUP_WIDTH control bytes, matched in one go (SSE2 or scalar)
+     */
+    class CtrlGroup {
+        public:
+            explicit CtrlGroup(const int8_t* pos){
+                #ifdef FASTCACHE_TABLE_SSE2
+                this->ctrl=_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos));
+                #else
+                std::memcpy(this->ctrl, pos, FASTCACHE_GROUP_WIDTH);
+                #endif
+            };
+            /** Bitmask of slots whose control byte equals h2 */
+            uint32_t match(int8_t h2) const {
+                #ifdef FASTCACHE_TABLE_SSE2
+                return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), this->ctrl));
+                #else
+                uint32_t mask=0;
+                for(size_t n=0; n<FASTCACHE_GROUP_WIDTH; n++) {
+                    if(this->ctrl[n]==h2) mask|=1u << n;
+                }
+                return mask;
+                #endif
+            };
+            /** Bitmask of empty slots */
+            uint32_t match_empty() const {
+                return this->match((int8_t)FASTCACHE_CTRL_EMPTY);
+            };
+            /** Bitmask of empty or deleted slots (sign bit set) */
+            uint32_t match_empty_or_deleted() const {
+                #ifdef FASTCACHE_TABLE_SSE2
+                return (uint32_t)_mm_movemask_epi8(this->ctrl);
+                #else
+                uint32_t mask=0;
+                for(size_t n=0; n<FASTCACHE_GROUP_WIDTH; n++) {
+                    if(this->ctrl[n]<0) mask|=1u << n;
+                }
+                return mask;
+                #endif
+            };
+
+        private:
+            #ifdef FASTCACHE_TABLE_SSE2
+            __m128i ctrl;
+            #else
+            int8_t ctrl[FASTCACHE_GROUP_WIDTH];
+            #endif
+    };
+
+    /**
+     * FlatTable
+     * SwissTable-style open-addressing hash table of node pointers.
+     *
+     * Nodes must expose `key` and `hash` members; the table never owns them.  Every
+     * call that removes a node from the table hands it back to the caller.
+     * Capacity is a power of two, the control array carries FASTCACHE_GROUP_WIDTH-1
+     * cloned bytes at its tail so a group can be loaded at any position.
+     *
+     * find() may run concurrently with a writer as long as the caller is pinned in an
+     * epoch and validates the result (see StorageCache's optimistic read mode): slots are
+     * published before their control byte, and arrays replaced by a rehash are handed to
+     * the reclaimer instead of being freed.
+     */
+    template <class Key, class Node>
+    class FlatTable {
+        public:
+            static const size_t MIN_CAPACITY=FASTCACHE_GROUP_WIDTH;
+            static const bool CONCURRENT_READS=true;
+
+            /** Resume point of for_each_from() */
+            struct Position {
+                Position() : slot(0), generation(0) {};
+
+                size_t slot;
+                uint64_t generation;    // Of the arrays the slot refers to
+            };
+
+            FlatTable() : reclaimer(NULL), count(0), deleted(0), generation(0) {
+                this->arrays.store(new Arrays(MIN_CAPACITY), std::memory_order_relaxed);
+            };
+            ~FlatTable(){
+                delete this->arrays.load(std::memory_order_relaxed);
+            };
+            /**
+             * Route replaced arrays through a reclaimer
+             *
+             * @param reclaimer the owner's reclaimer, NULL to free at once
+             */
+            void set_reclaimer(EpochReclaimer* reclaimer){
+                this->reclaimer=reclaimer;
+            };
+            /**
+             * Find a node
+             *
+             * @param key the key
+             * @param hash the hash of the key
+             * @retval the node, NULL if not found
+             */
+            template <class K>
+            Node* find(const K& key, size_t hash) const {
+                const Arrays* arrays=this->arrays.load(std::memory_order_acquire);
+                size_t index=find_index(arrays, key, hash);
+                return (index==NPOS)?NULL:arrays->slots[index].load(std::memory_order_acquire);
+            };
+            /**
+             * Pull the first probe group of a hash into the cache
+             *
+             * @param hash the hash of a key about to be looked up
+             */
+            void prefetch(size_t hash) const {
+                const Arrays* arrays=this->arrays.load(std::memory_order_acquire);
+                size_t pos=(size_t)(mix(hash) >> 7) & (arrays->capacity - 1);
+                #if defined(__GNUC__)
+                __builtin_prefetch(arrays->ctrl + pos);
+                __builtin_prefetch(arrays->slots + pos);
+                #elif defined(FASTCACHE_TABLE_SSE2)
+                _mm_prefetch(reinterpret_cast<const char*>(arrays->ctrl + pos), _MM_HINT_T0);
+                _mm_prefetch(reinterpret_cast<const char*>(arrays->slots + pos), _MM_HINT_T0);
+                #endif
+            };
+            /**
+             * Insert a node, replacing any node with the same key
+             *
+             * @param node the node to insert
+             * @retval the displaced node, NULL if the key was new
+             */
+            Node* assign(Node* node){
+                Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                size_t index=find_index(arrays, node->key, node->hash);
+                if(index!=NPOS) {
+                    return arrays->slots[index].exchange(node, std::memory_order_acq_rel);
+                }
+                this->insert_new(node);
+                return NULL;
+            };
+            /**
+             * Insert a node only if its key is not present
+             *
+             * @param node the node to insert
+             * @retval the node already holding the key (node was not inserted), NULL if inserted
+             */
+            Node* insert(Node* node){
+                Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                size_t index=find_index(arrays, node->key, node->hash);
+                if(index!=NPOS) {
+                    return arrays->slots[index].load(std::memory_order_relaxed);
+                }
+                this->insert_new(node);
+                return NULL;
+            };
+            /**
+             * Replace a node only if its key is present
+             *
+             * @param node the node to insert
+             * @retval the displaced node, NULL if the key was absent (node was not inserted)
+             */
+            Node* replace(Node* node){
+                Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                size_t index=find_index(arrays, node->key, node->hash);
+                if(index==NPOS) {
+                    return NULL;
+                }
+                return arrays->slots[index].exchange(node, std::memory_order_acq_rel);
+            };
+            /**
+             * Remove a key
+             *
+             * @param key the key
+             * @param hash the hash of the key
+             * @retval the removed node, NULL if not found
+             */
+            template <class K>
+            Node* erase(const K& key, size_t hash){
+                Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                size_t index=find_index(arrays, key, hash);
+                if(index==NPOS) {
+                    return NULL;
+                }
+                Node* old=arrays->slots[index].load(std::memory_order_relaxed);
+                this->erase_at(arrays, index);
+                return old;
+            };
+            /**
+             * Remove every node matching a predicate
+             *
+             * @param pred bool(Node*)
+             * @param disposer void(Node*), called for every removed node
+             * @retval number of removed nodes
+             */
+            template <class Pred, class Disposer>
+            size_t erase_if(Pred pred, Disposer disposer){
+                Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                size_t removed=0;
+                for(size_t n=0; n<arrays->capacity; n++) {
+                    if(arrays->ctrl[n]>=0 && pred(arrays->slots[n].load(std::memory_order_relaxed))) {
+                        Node* old=arrays->slots[n].load(std::memory_order_relaxed);
+                        this->erase_at(arrays, n);
+                        disposer(old);
+                        ++removed;
+                    }
+                }
+                return removed;
+            };
+            /** Visit every node */
+            template <class Visitor>
+            void for_each(Visitor visitor) const {
+                const Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                for(size_t n=0; n<arrays->capacity; n++) {
+                    if(arrays->ctrl[n]>=0) {
+                        visitor(arrays->slots[n].load(std::memory_order_relaxed));
+                    }
+                }
+            };
+            /**
+             * Visit nodes in batches
+             *
+             * The table may change between batches.  If it was rehashed meanwhile the walk starts over, so
+             * nodes present throughout are visited at least once (and possibly twice).
+             *
+             * @param position where the previous batch stopped, default constructed for the first one
+             * @param budget maximum number of nodes to visit
+             * @retval true if nodes may be left
+             */
+            template <class Visitor>
+            bool for_each_from(Position& position, size_t budget, Visitor visitor) const {
+                const Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                if(position.generation!=this->generation) {
+                    position.slot=0;
+                    position.generation=this->generation;
+                }
+                for(; position.slot<arrays->capacity; position.slot++) {
+                    if(arrays->ctrl[position.slot]>=0) {
+                        if(budget-- == 0) {
+                            return true;
+                        }
+                        visitor(arrays->slots[position.slot].load(std::memory_order_relaxed));
+                    }
+                }
+                return false;
+            };
+            /** Remove every node, handing each to the disposer */
+            template <class Disposer>
+            void clear(Disposer disposer){
+                this->for_each(disposer);
+                this->publish(new Arrays(MIN_CAPACITY));
+                this->count=0;
+                this->deleted=0;
+            };
+            size_t size() const {
+                return this->count;
+            };
+
+        private:
+            static const size_t NPOS=(size_t)-1;
+
+            /** Control bytes and slots of one capacity, replaced as a whole on rehash */
+            struct Arrays {
+                explicit Arrays(size_t capacity) : capacity(capacity) {
+                    this->ctrl=new int8_t[capacity + FASTCACHE_GROUP_WIDTH - 1];
+                    std::memset(this->ctrl, FASTCACHE_CTRL_EMPTY, capacity + FASTCACHE_GROUP_WIDTH - 1);
+                    this->slots=new std::atomic<Node*>[capacity];
+                    for(size_t n=0; n<capacity; n++) {
+                        this->slots[n].store(NULL, std::memory_order_relaxed);
+                    }
+                };
+                ~Arrays(){
+                    delete[] this->ctrl;
+                    delete[] this->slots;
+                };
+                void set_ctrl(size_t index, int8_t value){
+                    this->ctrl[index]=value;
+                    // Keep the cloned tail in sync
+                    if(index < FASTCACHE_GROUP_WIDTH - 1) {
+                        this->ctrl[this->capacity + index]=value;
+                    }
+                };
+
+                const size_t capacity;
+                int8_t* ctrl;
+                std::atomic<Node*>* slots;
+            };
+
+            FlatTable(const FlatTable&);
+            FlatTable& operator=(const FlatTable&);
+
+            /**
+             * Mix the caller's hash
+             *
+             * The cache picks its shard from the low bits of the very same hash, so all keys
+             * of one shard share them.  A full avalanche makes h1/h2 independent of that.
+             */
+            static uint64_t mix(size_t hash){
+                uint64_t h=(uint64_t)hash;
+                h^=h >> 33;
+                h*=0xff51afd7ed558ccdull;
+                h^=h >> 33;
+                h*=0xc4ceb9fe1a85ec53ull;
+                h^=h >> 33;
+                return h;
+            };
+            template <class K>
+            static size_t find_index(const Arrays* arrays, const K& key, size_t hash){
+                uint64_t h=mix(hash);
+                int8_t h2=(int8_t)(h & 0x7F);
+                size_t mask=arrays->capacity - 1;
+                size_t pos=(size_t)(h >> 7) & mask;
+                size_t step=0;
+                while(true) {
+                    CtrlGroup group(arrays->ctrl + pos);
+                    // Pairs with the release store of a slot made before its control byte
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    for(uint32_t bits=group.match(h2); bits; bits&=bits - 1) {
+                        size_t index=(pos + fastcache_ctz(bits)) & mask;
+                        Node* node=arrays->slots[index].load(std::memory_order_acquire);
+                        // A concurrent reader may see a slot that is just being vacated
+                        if(node && node->hash==hash && node->key==key) {
+                            return index;
+                        }
+                    }
+                    if(group.match_empty()) {
+                        return NPOS;
+                    }
+                    step+=FASTCACHE_GROUP_WIDTH;
+                    pos=(pos + step) & mask;
+                    if(step > arrays->capacity) {
+                        // Only a reader racing a rehash can get here
+                        return NPOS;
+                    }
+                }
+            };
+            /** First empty or deleted slot on the probe sequence of hash */
+            static size_t find_non_full(const Arrays* arrays, size_t hash){
+                uint64_t h=mix(hash);
+                size_t mask=arrays->capacity - 1;
+                size_t pos=(size_t)(h >> 7) & mask;
+                size_t step=0;
+                while(true) {
+                    uint32_t bits=CtrlGroup(arrays->ctrl + pos).match_empty_or_deleted();
+                    if(bits) {
+                        return (pos + fastcache_ctz(bits)) & mask;
+                    }
+                    step+=FASTCACHE_GROUP_WIDTH;
+                    pos=(pos + step) & mask;
+                }
+            };
+            void insert_new(Node* node){
+                Arrays* arrays=this->arrays.load(std::memory_order_relaxed);
+                // Keep at least 1/8 of the slots empty so every probe terminates
+                size_t limit=arrays->capacity - arrays->capacity / 8;
+                if(this->count + this->deleted + 1 > limit) {
+                    // Mostly tombstones?  Then a same-size rehash is enough.
+                    arrays=this->rehash((this->count * 2 < limit)?arrays->capacity:arrays->capacity * 2);
+                }
+                size_t index=find_non_full(arrays, node->hash);
+                if(arrays->ctrl[index]==FASTCACHE_CTRL_DELETED) {
+                    --this->deleted;
+                }
+                arrays->slots[index].store(node, std::memory_order_release);
+                std::atomic_thread_fence(std::memory_order_release);
+                arrays->set_ctrl(index, (int8_t)(mix(node->hash) & 0x7F));
+                ++this->count;
+            };
+            void erase_at(Arrays* arrays, size_t index){
+                size_t mask=arrays->capacity - 1;
+                // If no probe window around this slot was ever completely full, no probe
+                // sequence can have passed it and the slot may go straight back to empty.
+                uint32_t empty_after=CtrlGroup(arrays->ctrl + index).match_empty();
+                uint32_t empty_before=CtrlGroup(arrays->ctrl + ((index - FASTCACHE_GROUP_WIDTH) & mask)).match_empty();
+                bool never_full=empty_before && empty_after &&
+                    (fastcache_ctz(empty_after) + fastcache_clz_group(empty_before)) < FASTCACHE_GROUP_WIDTH;
+                arrays->slots[index].store(NULL, std::memory_order_release);
+                if(never_full) {
+                    arrays->set_ctrl(index, (int8_t)FASTCACHE_CTRL_EMPTY);
+                } else {
+                    arrays->set_ctrl(index, (int8_t)FASTCACHE_CTRL_DELETED);
+                    ++this->deleted;
+                }
+                --this->count;
+            };
+            /** Swap in new arrays, retiring the old ones */
+            void publish(Arrays* arrays){
+                ++this->generation;
+                Arrays* old=this->arrays.exchange(arrays, std::memory_order_acq_rel);
+                if(this->reclaimer) {
+                    this->reclaimer->retire(old);
+                } else {
+                    delete old;
+                }
+            };
+            Arrays* rehash(size_t capacity){
+                const Arrays* old=this->arrays.load(std::memory_order_relaxed);
+                Arrays* arrays=new Arrays(capacity);
+                for(size_t n=0; n<old->capacity; n++) {
+                    if(old->ctrl[n]>=0) {
+                        Node* node=old->slots[n].load(std::memory_order_relaxed);
+                        size_t index=find_non_full(arrays, node->hash);
+                        arrays->slots[index].store(node, std::memory_order_relaxed);
+                        arrays->set_ctrl(index, old->ctrl[n]);
+                    }
+                }
+                this->deleted=0;
+                this->publish(arrays);
+                return arrays;
+            };
+
+            std::atomic<Arrays*> arrays;
+            EpochReclaimer* reclaimer;
+            size_t count;
+            size_t deleted;
+            uint64_t generation;        // Bumped whenever the arrays are replaced
+    };
+
+    /**
+     * OrderedTable
+     * std::map backed store with the FlatTable interface.  Slower, but iterates in key order.
+     * The comparator is transparent, so lookups by other key types don't build a Key.
+     */
+    template <class Key, class Node>
+    class OrderedTable {
+        typedef std::map<Key, Node*, std::less<> > Map;
+
+        public:
+            static const bool CONCURRENT_READS=false;
+
+            void set_reclaimer(EpochReclaimer* /* reclaimer */){
+            };
+            template <class K>
+            Node* find(const K& key, size_t /* hash */) const {
+                typename Map::const_iterator it=this->map.find(key);
+                return (it==this->map.end())?NULL:it->second;
+            };
+            void prefetch(size_t /* hash */) const {
+            };
+            Node* assign(Node* node){
+                std::pair<typename Map::iterator, bool> result=this->map.insert(typename Map::value_type(node->key, node));
+                if(result.second) {
+                    return NULL;
+                }
+                Node* old=result.first->second;
+                result.first->second=node;
+                return old;
+            };
+            Node* insert(Node* node){
+                std::pair<typename Map::iterator, bool> result=this->map.insert(typename Map::value_type(node->key, node));
+                return result.second?NULL:result.first->second;
+            };
+            Node* replace(Node* node){
+                typename Map::iterator it=this->map.find(node->key);
+                if(it==this->map.end()) {
+                    return NULL;
+                }
+                Node* old=it->second;
+                it->second=node;
+                return old;
+            };
+            template <class K>
+            Node* erase(const K& key, size_t /* hash */){
+                typename Map::iterator it=this->map.find(key);
+                if(it==this->map.end()) {
+                    return NULL;
+                }
+                Node* old=it->second;
+                this->map.erase(it);
+                return old;
+            };
+            template <class Pred, class Disposer>
+            size_t erase_if(Pred pred, Disposer disposer){
+                size_t removed=0;
+                for(typename Map::iterator it=this->map.begin(); it != this->map.end(); /* no increment */) {
+                    if(pred(it->second)) {
+                        Node* old=it->second;
+                        this->map.erase(it++);
+                        disposer(old);
+                        ++removed;
+                    } else {
+                        ++it;
+                    }
+                }
+                return removed;
+            };
+            template <class Visitor>
+            void for_each(Visitor visitor) const {
+                for(typename Map::const_iterator it=this->map.begin(); it != this->map.end(); ++it) {
+                    visitor(it->second);
+                }
+            };
+            /** Resume point of for_each_from(): the last key visited */
+            struct Position {
+                Position() : started(false) {};
+
+                bool started;
+                Key last;
+            };
+            /**
+             * Visit nodes in batches, in key order
+             *
+             * Each batch resumes after the last key visited, so nodes present throughout are visited once.
+             *
+             * @param position where the previous batch stopped, default constructed for the first one
+             * @param budget maximum number of nodes to visit
+             * @retval true if nodes may be left
+             */
+            template <class Visitor>
+            bool for_each_from(Position& position, size_t budget, Visitor visitor) const {
+                typename Map::const_iterator it=position.started?this->map.upper_bound(position.last):this->map.begin();
+                for(; it != this->map.end(); ++it) {
+                    if(budget-- == 0) {
+                        return true;
+                    }
+                    visitor(it->second);
+                    position.started=true;
+                    position.last=it->first;
+                }
+                return false;
+            };
+            template <class Disposer>
+            void clear(Disposer disposer){
+                this->for_each(disposer);
+                this->map.clear();
+            };
+            size_t size() const {
+                return this->map.size();
+            };
+
+        private:
+            Map map;
+    };
+
+    /** Store selectors for StorageCache */
+    struct FlatStore {
+        template <class Key, class Node>
+        struct table { typedef FlatTable<Key, Node> type; };
+    };
+    struct OrderedStore {
+        template <class Key, class Node>
+        struct table { typedef OrderedTable<Key, Node> type; };
+    };
+};
+#endif
@@ -0,0 +1,231 @@
+/*---------------------------------------------------------------------------------------------
+ *  Copyright (c) Finanz Informatik. All rights reserved.
+ *  Licensed under the Apache-2.0 License. See License.txt in the project root for license information.
+ *--------------------------------------------------------------------------------------------*/
+// StorageTasks.hpp - Work stealing task pool for whole-cache operations
+#ifndef _STORAGEAPI_STORAGETASKS_H_
+#define _STORAGEAPI_STORAGETASKS_H_
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/locks.hpp>
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <vector>
+
+/// [Definitions]
+// Worker threads of the shared pool.  0 = one less than the hardware threads (the caller works too).
+#ifndef FASTCACHE_TASK_THREADS
+#define FASTCACHE_TASK_THREADS 0u
+#endif
+
+namespace Storage {
+    /**
+     * TaskPool
+     * Runs index ranges (e.g. one index per shard) on worker threads.
+     *
+     * Every worker owns a deque of ranges.  It takes work from the back of its own deque, splitting
+     * ranges in half and keeping the upper half there for others, and steals from the front of the
+     * other deques when it runs dry.  The calling thread joins in, so a pool without workers simply
+     * runs everything inline.
+     */
+    class TaskPool {
+        public:
+            /** The shared pool.  Never destroyed, its workers idle until needed. */
+            static TaskPool& instance() {
+                static TaskPool* pool=new TaskPool(FASTCACHE_TASK_THREADS);
+                return *pool;
+            };
+            /**
+             * @param threads worker threads, 0 for one less than the hardware threads
+             */
+            explicit TaskPool(size_t threads) : queued(0), stopping(false) {
+                if(threads==0) {
+                    unsigned int hardware=boost::thread::hardware_concurrency();
+                    threads=(hardware > 1)?hardware - 1:0;
+                }
+                // One deque per worker, plus one shared by the calling threads
+                for(size_t n=0; n<=threads; n++) {
+                    this->queues.push_back(new Queue());
+                }
+                for(size_t n=0; n<threads; n++) {
+                    this->workers.push_back(new boost::thread(&TaskPool::work, this, n));
+                }
+            };
+            ~TaskPool() {
+                {    // Scope for lock
+                    boost::lock_guard<boost::mutex> lock(this->sleep_lock);
+                    this->stopping=true;
+                }
+                this->wake.notify_all();
+                for(size_t n=0; n<this->workers.size(); n++) {
+                    this->workers[n]->join();
+                    delete this->workers[n];
+                }
+                for(size_t n=0; n<this->queues.size(); n++) {
+                    delete this->queues[n];
+                }
+            };
+            /** Number of worker threads */
+            size_t size() const {
+                return this->workers.size();
+            };
+            /**
+             * Run fn(0) ... fn(count - 1) in parallel and wait for all of them
+             *
+             * Calls may nest and may come from several threads at once.  Not an interruption point.
+             *
+             * @param count number of indexes
+             * @param fn called once per index
+             * @throws the first exception thrown by fn, after all indexes are done
+             */
+            template <class F>
+            void parallel_for(size_t count, F fn) {
+                if(count <= 1 || this->workers.empty()) {
+                    for(size_t n=0; n<count; n++) {
+                        fn(n);
+                    }
+                    return;
+                }
+                // The job lives on our stack, so we must not leave before the workers are done with it
+                boost::this_thread::disable_interruption no_interruption;
+                Job job(fn, count);
+                Queue* home=this->queues.back();
+                // Hand every worker a share up front, then work on our own
+                size_t parts=(count < this->queues.size())?count:this->queues.size();
+                for(size_t part=1; part<parts; part++) {
+                    this->push(this->queues[part - 1], Range(&job, count * part / parts, count * (part + 1) / parts));
+                }
+                this->run(Range(&job, 0, count / parts), home);
+                Range range;
+                while(job.pending.load(std::memory_order_acquire) && this->take(home, range)) {
+                    this->run(range, home);
+                }
+                boost::unique_lock<boost::mutex> lock(job.lock);
+                while(job.pending.load(std::memory_order_acquire)) {
+                    job.done.wait(lock);
+                }
+                if(job.error) {
+                    std::rethrow_exception(job.error);
+                }
+            };
+
+        private:
+            struct Job {
+                template <class F>
+                Job(F fn, size_t count) : fn(fn), pending(count) {};
+
+                std::function<void(size_t)> fn;
+                std::atomic<size_t> pending;    // Indexes not yet run
+                boost::mutex lock;
+                boost::condition_variable done;
+                std::exception_ptr error;
+            };
+            struct Range {
+                Range() : job(NULL), begin(0), end(0) {};
+                Range(Job* job, size_t begin, size_t end) : job(job), begin(begin), end(end) {};
+
+                Job* job;
+                size_t begin;
+                size_t end;
+            };
+            struct alignas(64) Queue {
+                boost::mutex lock;
+                std::deque<Range> ranges;
+            };
+
+            TaskPool(const TaskPool&);
+            TaskPool& operator=(const TaskPool&);
+
+            void work(size_t index) {
+                Queue* home=this->queues[index];
+                Range range;
+                while(true) {
+                    if(this->take(home, range)) {
+                        this->run(range, home);
+                        continue;
+                    }
+                    boost::unique_lock<boost::mutex> lock(this->sleep_lock);
+                    if(this->stopping) {
+                        return;
+                    }
+                    if(this->queued.load(std::memory_order_acquire)==0) {
+                        this->wake.wait(lock);
+                    }
+                }
+            };
+            /** Run a range, leaving all but its first index to thieves */
+            void run(Range range, Queue* home) {
+                while(range.end - range.begin > 1) {
+                    size_t middle=range.begin + (range.end - range.begin) / 2;
+                    this->push(home, Range(range.job, middle, range.end));
+                    range.end=middle;
+                }
+                Job* job=range.job;
+                try {
+                    job->fn(range.begin);
+                } catch(...) {
+                    boost::lock_guard<boost::mutex> lock(job->lock);
+                    if(!job->error) {
+                        job->error=std::current_exception();
+                    }
+                }
+                // Under the lock: the caller may destroy the job as soon as it sees nothing pending
+                boost::lock_guard<boost::mutex> lock(job->lock);
+                if(job->pending.fetch_sub(1, std::memory_order_acq_rel)==1) {
+                    job->done.notify_all();
+                }
+            };
+            void push(Queue* queue, const Range& range) {
+                {    // Scope for lock
+                    boost::lock_guard<boost::mutex> lock(queue->lock);
+                    queue->ranges.push_back(range);
+                }
+                this->queued.fetch_add(1, std::memory_order_release);
+                {    // Sleepers check queued under this lock, so none can miss the notification
+                    boost::lock_guard<boost::mutex> lock(this->sleep_lock);
+                }
+                this->wake.notify_one();
+            };
+            /** Pop from our own deque's back, else steal from another's front */
+            bool take(Queue* home, Range& range) {
+                if(this->queued.load(std::memory_order_acquire)==0) {
+                    return false;
+                }
+                {    // Scope for lock
+                    boost::lock_guard<boost::mutex> lock(home->lock);
+                    if(!home->ranges.empty()) {
+                        range=home->ranges.back();
+                        home->ranges.pop_back();
+                        this->queued.fetch_sub(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+                for(size_t n=0; n<this->queues.size(); n++) {
+                    Queue* victim=this->queues[n];
+                    if(victim==home) {
+                        continue;
+                    }
+                    boost::lock_guard<boost::mutex> lock(victim->lock);
+                    if(!victim->ranges.empty()) {
+                        range=victim->ranges.front();
+                        victim->ranges.pop_front();
+                        this->queued.fetch_sub(1, std::memory_order_relaxed);
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            std::vector<Queue*> queues;
+            std::vector<boost::thread*> workers;
+            std::atomic<size_t> queued;     // Ranges in all deques
+            boost::mutex sleep_lock;
+            boost::condition_variable wake;
+            bool stopping;
+    };
+};
+#endif